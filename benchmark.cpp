@@ -0,0 +1,502 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// Benchmark of the overhead of libnettest2::Runner. It runs synthetic nettests
+// that either return immediately or wait for a configurable latency, and
+// optionally submits the measurements to an in-process HTTP stub acting as
+// bouncer and collector. For each scenario it reports the measurements per
+// second, the p50 and p99 per measurement overhead (i.e. the time between
+// the measurement_start and measurement_done events, minus the time spent
+// running the nettest), the allocations per measurement and the peak RSS
+// of the process so far. Only POSIX systems are supported.
+//
+// Usage: benchmark [--collector] [--latency-ms=N] [--inputs=N[,N...]]
+//                  [--parallelism=N[,N...]]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "date.h"
+#include "json.hpp"
+#include "libnettest2.hpp"
+
+using namespace measurement_kit;
+
+// Allocation counting
+// ```````````````````
+
+static std::atomic<uint64_t> g_allocations{0};
+
+// We prevent inlining, otherwise GCC warns that we free() memory allocated
+// with new, not knowing that we have replaced the allocation functions.
+#ifdef __GNUC__
+#define BENCHMARK_NOINLINE __attribute__((noinline))
+#else
+#define BENCHMARK_NOINLINE
+#endif
+
+BENCHMARK_NOINLINE void *operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc((size > 0) ? size : 1);
+  if (p == nullptr) throw std::bad_alloc{};
+  return p;
+}
+
+BENCHMARK_NOINLINE void *operator new[](size_t size) { return operator new(size); }
+
+BENCHMARK_NOINLINE void operator delete(void *p) noexcept { free(p); }
+
+BENCHMARK_NOINLINE void operator delete[](void *p) noexcept { free(p); }
+
+BENCHMARK_NOINLINE void operator delete(void *p, size_t) noexcept { free(p); }
+
+BENCHMARK_NOINLINE void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static uint64_t peak_rss_kib() noexcept {
+  struct rusage usage {};
+  (void)getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return (uint64_t)usage.ru_maxrss / 1024;  // Bytes on macOS
+#else
+  return (uint64_t)usage.ru_maxrss;
+#endif
+}
+
+static uint64_t now_ns() noexcept {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// CollectorStub
+// `````````````
+
+// CollectorStub is a minimal HTTP/1.1 server, listening on the loopback,
+// which replies to the bouncer and collector requests made by the Runner.
+// It serves each connection in its own thread and supports keep-alive.
+class CollectorStub {
+ public:
+  bool start() noexcept;
+
+  std::string base_url() const noexcept;
+
+  uint64_t updates() const noexcept;
+
+  void stop() noexcept;
+
+  ~CollectorStub() noexcept;
+
+ private:
+  void accept_loop() noexcept;
+  void serve(int fd) noexcept;
+  std::string reply(const std::string &path) noexcept;
+
+  std::thread acceptor_;
+  std::vector<std::thread> connections_;
+  std::vector<int> fds_;
+  int listener_ = -1;
+  std::mutex mutex_;
+  uint16_t port_ = 0;
+  std::atomic_bool stopping_{false};
+  std::atomic<uint64_t> updates_{0};
+};
+
+bool CollectorStub::start() noexcept {
+  listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (listener_ == -1) return false;
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sin);
+  if (::bind(listener_, (sockaddr *)&sin, sizeof(sin)) != 0 ||
+      ::listen(listener_, 256) != 0 ||
+      ::getsockname(listener_, (sockaddr *)&sin, &len) != 0) {
+    (void)::close(listener_);
+    listener_ = -1;
+    return false;
+  }
+  port_ = ntohs(sin.sin_port);
+  acceptor_ = std::thread{[this]() noexcept { accept_loop(); }};
+  return true;
+}
+
+std::string CollectorStub::base_url() const noexcept {
+  return "http://127.0.0.1:" + std::to_string(port_);
+}
+
+uint64_t CollectorStub::updates() const noexcept { return updates_; }
+
+void CollectorStub::stop() noexcept {
+  if (listener_ == -1 || stopping_.exchange(true)) return;
+  // Shutting down the sockets wakes up the threads blocked on them.
+  (void)::shutdown(listener_, SHUT_RDWR);
+  acceptor_.join();
+  (void)::close(listener_);
+  std::unique_lock<std::mutex> lock{mutex_};
+  for (auto fd : fds_) {
+    (void)::shutdown(fd, SHUT_RDWR);
+  }
+  auto connections = std::move(connections_);
+  lock.unlock();
+  for (auto &thread : connections) {
+    thread.join();
+  }
+}
+
+CollectorStub::~CollectorStub() noexcept { stop(); }
+
+void CollectorStub::accept_loop() noexcept {
+  while (!stopping_) {
+    int fd = ::accept(listener_, nullptr, nullptr);
+    if (fd == -1) break;
+    int on = 1;
+    (void)::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    std::unique_lock<std::mutex> _{mutex_};
+    fds_.push_back(fd);
+    connections_.push_back(std::thread{[this, fd]() noexcept { serve(fd); }});
+  }
+}
+
+static bool send_all(int fd, const std::string &data) noexcept {
+  size_t off = 0;
+  while (off < data.size()) {
+    auto n = ::send(fd, data.data() + off, data.size() - off, 0);
+    if (n <= 0) return false;
+    off += (size_t)n;
+  }
+  return true;
+}
+
+static std::string header_value(const std::string &headers,
+                                const std::string &name) noexcept {
+  std::string lower = headers;
+  std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+  auto pos = lower.find("\r\n" + name + ":");
+  if (pos == std::string::npos) return "";
+  pos += name.size() + 3;
+  auto end = lower.find("\r\n", pos);
+  auto value = lower.substr(pos, end - pos);
+  value.erase(0, value.find_first_not_of(' '));
+  return value;
+}
+
+static bool recv_more(int fd, std::string *buffer) noexcept {
+  char chunk[65536];
+  auto n = ::recv(fd, chunk, sizeof(chunk), 0);
+  if (n <= 0) return false;
+  buffer->append(chunk, (size_t)n);
+  return true;
+}
+
+void CollectorStub::serve(int fd) noexcept {
+  std::string buffer;
+  for (;;) {
+    size_t header_end = std::string::npos;
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos &&
+           recv_more(fd, &buffer)) {
+      // NOTHING
+    }
+    if (header_end == std::string::npos) break;
+    auto headers = buffer.substr(0, header_end + 2);
+    auto first_space = headers.find(' ');
+    auto second_space = headers.find(' ', first_space + 1);
+    auto path = headers.substr(first_space + 1, second_space - first_space - 1);
+    auto length = (size_t)strtoull(
+        header_value(headers, "content-length").c_str(), nullptr, 10);
+    if (header_value(headers, "expect") == "100-continue" &&
+        !send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+      break;
+    }
+    while (buffer.size() < header_end + 4 + length && recv_more(fd, &buffer)) {
+      // NOTHING
+    }
+    if (buffer.size() < header_end + 4 + length) break;
+    buffer.erase(0, header_end + 4 + length);
+    auto body = reply(path);
+    if (!send_all(fd, "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: application/json\r\n"
+                      "Content-Length: " + std::to_string(body.size()) +
+                      "\r\n\r\n" + body)) {
+      break;
+    }
+  }
+  {
+    // Once closed, the number may be reused, e.g. by the sockets of cURL,
+    // hence stop() must not shut it down anymore.
+    std::unique_lock<std::mutex> _{mutex_};
+    fds_.erase(std::find(fds_.begin(), fds_.end(), fd));
+  }
+  (void)::close(fd);
+}
+
+std::string CollectorStub::reply(const std::string &path) noexcept {
+  if (path == "/bouncer/net-tests") {
+    return R"({"net-tests":[{"collector":"httpo://stub.onion",)"
+           R"("collector-alternate":[{"type":"https","address":")" +
+           base_url() + R"("}],"test-helpers":{},)"
+           R"("test-helpers-alternate":{}}]})";
+  }
+  if (path == "/report") {
+    return R"({"backend_version":"0.0.0","report_id":"benchmark"})";
+  }
+  if (path.size() >= 6 && path.compare(path.size() - 6, 6, "/close") == 0) {
+    return "{}";
+  }
+  updates_ += 1;
+  return R"({"status":"success"})";
+}
+
+// SyntheticNettest
+// ````````````````
+
+// SyntheticNettest waits for |latency| when running, or returns immediately
+// if |latency| is zero. The input is the index of the entry of |runtimes|
+// where it stores how long it took running, in nanoseconds.
+class SyntheticNettest : public libnettest2::Nettest {
+ public:
+  SyntheticNettest(std::chrono::milliseconds latency,
+                   std::vector<uint64_t> *runtimes) noexcept;
+
+  std::string name() const noexcept override;
+
+  bool needs_input() const noexcept override;
+
+  bool run(const libnettest2::Settings &settings,
+           const libnettest2::NettestContext &context,
+           std::string input,
+           nlohmann::json *result,
+           libnettest2::BytesInfo *info) noexcept override;
+
+  ~SyntheticNettest() noexcept override;
+
+ private:
+  std::chrono::milliseconds latency_;
+  std::vector<uint64_t> *runtimes_ = nullptr;
+};
+
+SyntheticNettest::SyntheticNettest(std::chrono::milliseconds latency,
+                                   std::vector<uint64_t> *runtimes) noexcept
+    : latency_{latency}, runtimes_{runtimes} {}
+
+std::string SyntheticNettest::name() const noexcept { return "synthetic"; }
+
+bool SyntheticNettest::needs_input() const noexcept { return true; }
+
+bool SyntheticNettest::run(const libnettest2::Settings &,
+                           const libnettest2::NettestContext &context,
+                           std::string input,
+                           nlohmann::json *result,
+                           libnettest2::BytesInfo *) noexcept {
+  auto begin = now_ns();
+  if (latency_.count() > 0) {
+    (void)context.cancellation->wait_for(latency_);
+  }
+  (*result)["synthetic"] = true;
+  auto idx = (size_t)strtoull(input.c_str(), nullptr, 10);
+  if (idx < runtimes_->size()) {
+    (*runtimes_)[idx] = now_ns() - begin;  // Each index has a single writer
+  }
+  return true;
+}
+
+SyntheticNettest::~SyntheticNettest() noexcept {}
+
+// BenchmarkRunner
+// ```````````````
+
+// BenchmarkRunner records when each measurement starts and is done, and
+// otherwise discards the events, except for warnings.
+class BenchmarkRunner : public libnettest2::Runner {
+ public:
+  BenchmarkRunner(const libnettest2::Settings &settings,
+                  libnettest2::Nettest &nettest, size_t count) noexcept;
+
+  std::vector<uint64_t> started;
+  std::vector<uint64_t> done;
+
+ protected:
+  void on_event(const nlohmann::json &event) const noexcept override;
+
+  void on_typed_event(const libnettest2::Event &event) const
+      noexcept override;
+};
+
+BenchmarkRunner::BenchmarkRunner(const libnettest2::Settings &settings,
+                                 libnettest2::Nettest &nettest,
+                                 size_t count) noexcept
+    : libnettest2::Runner{settings, nettest}, started(count), done(count) {}
+
+void BenchmarkRunner::on_event(const nlohmann::json &) const noexcept {}
+
+void BenchmarkRunner::on_typed_event(const libnettest2::Event &event) const
+    noexcept {
+  // Each index is started and done by a single thread, hence the entries
+  // of the vectors, which we only read when run() returns, have one writer.
+  auto self = const_cast<BenchmarkRunner *>(this);
+  switch (event.id) {
+    case libnettest2::EventId::measurement_start:
+      if (event.idx < started.size()) self->started[event.idx] = now_ns();
+      break;
+    case libnettest2::EventId::measurement_done:
+      if (event.idx < done.size()) self->done[event.idx] = now_ns();
+      break;
+    case libnettest2::EventId::log:
+      if (event.log_level <= libnettest2::LogLevel::log_warning) {
+        fprintf(stderr, "warning: %s\n", event.message->c_str());
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Scenarios
+// `````````
+
+class Scenario {
+ public:
+  size_t inputs = 0;
+  uint16_t parallelism = 0;
+  std::chrono::milliseconds latency{0};
+  bool collector = false;
+};
+
+static bool run_scenario(const Scenario &scenario) noexcept {
+  CollectorStub stub;
+  if (scenario.collector && !stub.start()) {
+    fprintf(stderr, "fatal: cannot start the collector stub\n");
+    return false;
+  }
+  libnettest2::Settings settings;
+  settings.bouncer_base_url = stub.base_url();
+  settings.max_runtime = UINT16_MAX;
+  settings.no_asn_lookup = true;
+  settings.no_bouncer = !scenario.collector;
+  settings.no_cc_lookup = true;
+  settings.no_collector = !scenario.collector;
+  settings.no_ip_lookup = true;
+  settings.no_resolver_lookup = true;
+  settings.parallelism = scenario.parallelism;
+  settings.inputs.reserve(scenario.inputs);
+  for (size_t i = 0; i < scenario.inputs; ++i) {
+    settings.inputs.push_back(std::to_string(i));
+  }
+  std::vector<uint64_t> runtimes(scenario.inputs);
+  SyntheticNettest nettest{scenario.latency, &runtimes};
+  BenchmarkRunner runner{settings, nettest, scenario.inputs};
+  auto allocations = g_allocations.load();
+  auto begin = now_ns();
+  auto ok = runner.run();
+  auto elapsed = (double)(now_ns() - begin) / 1e09;
+  allocations = g_allocations.load() - allocations;
+  stub.stop();
+  std::vector<double> overheads;
+  overheads.reserve(scenario.inputs);
+  for (size_t i = 0; i < scenario.inputs; ++i) {
+    if (runner.started[i] == 0 || runner.done[i] < runner.started[i]) continue;
+    auto total = runner.done[i] - runner.started[i];
+    overheads.push_back(
+        (double)(total - std::min(total, runtimes[i])) / 1e03);
+  }
+  auto quantile = [&overheads](double q) -> double {
+    if (overheads.empty()) return 0.0;
+    auto nth = overheads.begin() + (ptrdiff_t)(q * (overheads.size() - 1));
+    std::nth_element(overheads.begin(), nth, overheads.end());
+    return *nth;
+  };
+  auto count = overheads.size();
+  auto p50 = quantile(0.5);
+  auto p99 = quantile(0.99);
+  printf("inputs=%zu parallelism=%u latency_ms=%lld collector=%s "
+         "measurements=%zu measurements_per_sec=%.0f p50_overhead_us=%.1f "
+         "p99_overhead_us=%.1f allocations_per_measurement=%.1f "
+         "peak_rss_kib=%llu\n",
+         scenario.inputs, (unsigned)scenario.parallelism,
+         (long long)scenario.latency.count(),
+         (scenario.collector) ? "yes" : "no", count,
+         (elapsed > 0.0) ? count / elapsed : 0.0, p50, p99,
+         (count > 0) ? (double)allocations / count : 0.0,
+         (unsigned long long)peak_rss_kib());
+  if (scenario.collector && stub.updates() != count) {
+    fprintf(stderr, "warning: the collector received %llu measurements\n",
+            (unsigned long long)stub.updates());
+  }
+  fflush(stdout);
+  return ok && count == scenario.inputs;
+}
+
+// main
+// ````
+
+static std::vector<size_t> parse_list(const char *s) noexcept {
+  std::vector<size_t> values;
+  while (*s != '\0') {
+    char *end = nullptr;
+    values.push_back((size_t)strtoull(s, &end, 10));
+    s = (*end == ',') ? end + 1 : end;
+    if (*end != ',' && *end != '\0') break;
+  }
+  return values;
+}
+
+static void usage(FILE *fp, const char *progname) noexcept {
+  fprintf(fp,
+          "usage: %s [--collector] [--latency-ms=N] [--inputs=N[,N...]] "
+          "[--parallelism=N[,N...]]\n",
+          progname);
+}
+
+int main(int argc, char **argv) {
+  (void)signal(SIGPIPE, SIG_IGN);
+  std::vector<size_t> inputs{10000, 100000, 1000000};
+  std::vector<size_t> parallelisms{1, 8, 64};
+  Scenario scenario;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--help") {
+      usage(stdout, argv[0]);
+      return EXIT_SUCCESS;
+    } else if (arg == "--collector") {
+      scenario.collector = true;
+    } else if (arg.compare(0, 13, "--latency-ms=") == 0) {
+      scenario.latency = std::chrono::milliseconds{atoll(argv[i] + 13)};
+    } else if (arg.compare(0, 9, "--inputs=") == 0) {
+      inputs = parse_list(argv[i] + 9);
+    } else if (arg.compare(0, 14, "--parallelism=") == 0) {
+      parallelisms = parse_list(argv[i] + 14);
+    } else {
+      usage(stderr, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  auto ok = true;
+  for (auto count : inputs) {
+    for (auto parallelism : parallelisms) {
+      scenario.inputs = count;
+      scenario.parallelism =
+          (uint16_t)std::min<size_t>(std::max<size_t>(parallelism, 1),
+                                     UINT16_MAX);
+      ok = run_scenario(scenario) && ok;
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
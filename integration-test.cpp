@@ -60,7 +60,7 @@ MockWebConnectivity::~MockWebConnectivity() noexcept {}
 
 int main() {
   libnettest2::Settings settings;
-  settings.log_level = libnettest2::log_debug;
+  settings.log_level = libnettest2::LogLevel::log_debug;
   settings.geoip_asn_path = "GeoLite2-ASN_20180731/GeoLite2-ASN.mmdb";
   settings.geoip_country_path = "GeoLite2-Country_20180703/GeoLite2-Country.mmdb";
   settings.inputs = {"www.google.com", "www.kernel.org"};
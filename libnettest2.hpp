@@ -7,27 +7,46 @@
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <io.h>
+#include <process.h>
+#include <share.h>
 #endif
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <math.h>
 #ifndef _WIN32
 #include <netdb.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #endif
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <exception>
-#include <iomanip>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <random>
 #include <sstream>
 #include <string>
+#include <system_error>
 #include <thread>
 #include <type_traits>
 #include <utility>
@@ -35,6 +54,9 @@
 
 #include <curl/curl.h>
 #include <maxminddb.h>
+#ifdef LIBNETTEST2_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 // TODO(bassosimone): add documentation and restructure code such that what
 // does not need to be documented and processed by a user lies below a specific
@@ -155,16 +177,40 @@ class Settings {
   //
   // settings inside the 'options' sub-dictionary
   //
+  // Note: when adaptive_parallelism is true, parallelism is the maximum
+  // number of measurements that we may run concurrently. In any case, we run
+  // at most 256 measurements concurrently, and no more than the inputs.
+  bool adaptive_parallelism = false;
   bool all_endpoints = false;
   std::string bouncer_base_url = "https://bouncer.ooni.io";
   std::string ca_bundle_path;
   std::string collector_base_url;
+  // When discovery_cache_path is not empty, we cache in such file the bouncer
+  // response and the probe IP. Entries younger than discovery_cache_ttl
+  // seconds (zero means one hour) are used without contacting the network,
+  // while older entries are used and refreshed in the background. Since the
+  // probe IP changes with the network, we only use it when it's younger than
+  // twice discovery_cache_ttl, and only when we're on the same local address.
+  std::string discovery_cache_path;
+  uint16_t discovery_cache_ttl = 0;
   std::string engine_name = default_engine_name();
   std::string engine_version = version();
   std::string engine_version_full = version();
   std::string geoip_asn_path;
   std::string geoip_country_path;
+  // When http_compression is true, we ask the bouncer and the collector for
+  // compressed responses and, if compiled with LIBNETTEST2_HAVE_ZLIB, we gzip
+  // the measurements we submit, unless a collector replies that it does not
+  // support compressed bodies, in which case we stop compressing for it.
+  bool http_compression = false;
+  // When input_seed is not zero, randomize_input shuffles the inputs in the
+  // same order every time, regardless of the platform.
+  uint32_t input_seed = 0;
   Timeout max_runtime = TimeoutDefault;
+  // When metrics_interval is not zero, run() emits the status.metrics event
+  // with the metrics of the Runner every metrics_interval seconds and once
+  // more before status.end (see RunnerMetrics).
+  uint16_t metrics_interval = 0;
   bool no_asn_lookup = false;
   bool no_bouncer = false;
   bool no_cc_lookup = false;
@@ -172,7 +218,7 @@ class Settings {
   bool no_file_report = false;
   bool no_ip_lookup = false;
   bool no_resolver_lookup = false;
-  uint8_t parallelism = 0;
+  uint16_t parallelism = 0;
   std::string platform;
   uint16_t port = 0;
   std::string probe_ip;
@@ -185,12 +231,35 @@ class Settings {
   bool save_real_probe_cc = true;
   bool save_real_resolver_ip = true;
   std::string server;
+  // When shard_count is greater than one, the inputs are split into that many
+  // shards and we only measure the inputs of the shard_index-th shard (zero
+  // based). The input at position P in the order given by inputs followed by
+  // input_filepaths belongs to the (P % shard_count)-th shard. Since this does
+  // not depend on randomize_input, probes running distinct shards with the
+  // same inputs never measure the same input twice.
+  uint32_t shard_count = 0;
+  uint32_t shard_index = 0;
   std::string software_name = default_engine_name();
   std::string software_version = version();
+  // When spool_path is not empty, we append the measurements to such file
+  // before submitting them, and we resubmit in the background, with backoff,
+  // those whose submission failed. Measurements that could not be submitted
+  // before their report was closed are submitted into the report of a later
+  // run of the same nettest (see Spool). A single Runner at a time may use a
+  // spool: the others sharing the same path run without it.
+  std::string spool_path;
+  // When submission_batch_size is greater than one, we submit up to that many
+  // measurements together, waiting at most submission_batch_timeout
+  // milliseconds for a batch to fill up.
+  uint16_t submission_batch_size = 0;
+  uint16_t submission_batch_timeout = 0;
 };
 
+// parse_settings() parses the JSON settings in |str| into |settings|. The
+// fields that are not in |str| keep their value. On error, |err| tells what
+// went wrong. |warn| may contain a warning also when successful.
 bool parse_settings(std::string str, Settings *settings,
-                    std::string *err) noexcept;
+                    std::string *err, std::string *warn) noexcept;
 
 // EndpointInfo
 // ````````````
@@ -208,11 +277,106 @@ class EndpointInfo {
   std::string front;  // Only valid for endpoint_type_cloudfront
 };
 
+// ReportTarget is a collector, and the report opened with it, to which we
+// submit measurements.
+class ReportTarget {
+ public:
+  size_t index = 0;  // Index of the collector in the ranking
+  std::string url;
+  std::string report_id;
+};
+
+// EndpointSelector uses the collectors ranked by Runner::rank_endpoints(),
+// the best first, and fails over to the next collector in the ranking when
+// the one in use fails. It is safe to use from several threads.
+class EndpointSelector {
+ public:
+  // OpenFunc opens a report with |endpoint|, setting |report_id|.
+  using OpenFunc = std::function<bool(const EndpointInfo &endpoint,
+                                      std::string *report_id)>;
+
+  // EndpointSelector() selects among the |ranked| collectors, with which
+  // we open reports using |open|, which MAY be empty if we don't.
+  EndpointSelector(std::vector<EndpointInfo> ranked, OpenFunc open) noexcept;
+
+  EndpointSelector(const EndpointSelector &) noexcept = delete;
+  EndpointSelector &operator=(const EndpointSelector &) noexcept = delete;
+  EndpointSelector(EndpointSelector &&) noexcept = delete;
+  EndpointSelector &operator=(EndpointSelector &&) noexcept = delete;
+
+  // open() opens a report with the best collector that works and copies it
+  // into |target|. Returns false if no collector works.
+  bool open(ReportTarget *target) noexcept;
+
+  // current() copies the collector in use into |target|. Returns false if
+  // there is no collector in use.
+  bool current(ReportTarget *target) const noexcept;
+
+  // failover() is called when |target| fails. If |target| is still in use,
+  // opens a report with the next collector that works. Then, copies the
+  // collector in use into |target|. Returns false if no collector is left.
+  bool failover(ReportTarget *target) noexcept;
+
+  // reports() returns the collectors with which we opened a report.
+  std::vector<ReportTarget> reports() const noexcept;
+
+  // front() returns true if |url| belongs to a cloudfronted collector, in
+  // which case it sets |fronted| to the same URL on the front and |host| to
+  // the host of the collector, to which the front forwards our requests.
+  bool front(const std::string &url, std::string *fronted,
+             std::string *host) const noexcept;
+
+ private:
+  // open_from() is like open() but starts from the collector at |index|. The
+  // caller MUST hold failover_mutex_.
+  bool open_from(size_t index, ReportTarget *target) noexcept;
+
+  // target() copies the collector at |index| into |target|. The caller MUST
+  // hold mutex_. Returns false if |index| is out of range.
+  bool target(size_t index, ReportTarget *target) const noexcept;
+
+  std::vector<EndpointInfo> endpoints_;
+  std::vector<std::string> report_ids_;
+  OpenFunc open_;
+  size_t current_ = 0;  // Equal to endpoints_.size() when there's none
+  std::mutex failover_mutex_;
+  mutable std::mutex mutex_;
+};
+
+// Cancellation
+// ````````````
+
+// CancellationToken tells long running operations that they should stop as
+// soon as possible. Runner::interrupt() cancels the token of the Runner.
+class CancellationToken {
+ public:
+  // cancel() marks the token as cancelled and wakes up the waiters.
+  void cancel() noexcept;
+
+  // cancelled() returns whether the token has been cancelled.
+  bool cancelled() const noexcept;
+
+  // wait_for() sleeps for |timeout| unless the token is cancelled earlier.
+  // Returns false if the token has been cancelled.
+  bool wait_for(std::chrono::milliseconds timeout) noexcept;
+
+ private:
+  std::atomic_bool cancelled_{false};
+  std::condition_variable cond_;
+  std::mutex mutex_;
+};
+
 // Nettest context
 // ```````````````
 
 class NettestContext {
  public:
+  // Nettests SHOULD check |cancellation|, which is never null, and return as
+  // soon as possible when it's cancelled, and MAY wait using it. A nettest
+  // cut short by |cancellation| SHOULD return false, so that we don't submit
+  // its measurement.
+  std::shared_ptr<CancellationToken> cancellation =
+      std::make_shared<CancellationToken>();
   std::vector<EndpointInfo> collectors;
   std::string probe_asn;
   std::string probe_cc;
@@ -255,447 +419,1878 @@ class Nettest {
   virtual ~Nettest() noexcept;
 };
 
-// Runner
-// ``````
+// Byte accounting
+// ```````````````
 
-class Runner {
+// BytesCategory tells with whom we exchanged bytes.
+enum class BytesCategory : uint8_t {
+  bouncer,
+  geoip,  // Includes looking up the resolver IP
+  collector,
+  nettest,
+};
+
+// The number of values of BytesCategory.
+constexpr size_t num_bytes_categories = 4;
+
+// bytes_category_name() returns the name of |category|, e.g., "collector".
+const char *bytes_category_name(BytesCategory category) noexcept;
+
+// The size of a cache line on the architectures we care about.
+constexpr size_t cache_line_size = 64;
+
+// BytesCounters contains |slots| sets of counters, one BytesInfo for each
+// BytesCategory, each set in its own cache line. By giving each thread its
+// own slot, threads transferring data concurrently do not contend the same
+// cache line. The totals are computed on demand by adding all the slots.
+class BytesCounters {
  public:
-  Runner(const Settings &settings, Nettest &nettest) noexcept;
+  explicit BytesCounters(size_t slots) noexcept;
 
-  Runner(const Runner &) noexcept = delete;
-  Runner &operator=(const Runner &) noexcept = delete;
-  Runner(Runner &&) noexcept = delete;
-  Runner &operator=(Runner &&) noexcept = delete;
+  BytesCounters(const BytesCounters &) noexcept = delete;
+  BytesCounters &operator=(const BytesCounters &) noexcept = delete;
+  BytesCounters(BytesCounters &&) noexcept = delete;
+  BytesCounters &operator=(BytesCounters &&) noexcept = delete;
 
-  virtual ~Runner() noexcept;
+  ~BytesCounters() noexcept;
 
-  bool run() noexcept;
+  // get() returns the counters for |category| in |slot|, modulo slots().
+  BytesInfo *get(size_t slot, BytesCategory category) noexcept;
 
-  void interrupt() noexcept;
+  // slots() returns the number of slots.
+  size_t slots() const noexcept;
 
-  LogLevel get_log_level() const noexcept;
+  // bytes_down() and bytes_up() return the total for |category|.
+  uint64_t bytes_down(BytesCategory category) const noexcept;
+  uint64_t bytes_up(BytesCategory category) const noexcept;
 
- protected:
-  // Methods you typically want to override
-  // ``````````````````````````````````````
-  // The on_event() method is called when a event occurs. Note that this
-  // method MAY be called from another thread context.
+  // total_down() and total_up() return the total for all categories.
+  uint64_t total_down() const noexcept;
+  uint64_t total_up() const noexcept;
 
-  virtual void on_event(const nlohmann::json &event) const noexcept;
+ private:
+  const BytesInfo *at(size_t slot, BytesCategory category) const noexcept;
 
-  // Methods you generally DON'T want to override
-  // ````````````````````````````````````````````
-  // You may want to override them in unit tests, however.
+  char *base_ = nullptr;  // Aligned to cache_line_size
+  size_t slots_ = 0;
+  char *storage_ = nullptr;
+};
 
+// MeasurementBytes contains the bytes that were exchanged by the nettest with
+// the network, and with the collector to submit the measurement.
+class MeasurementBytes {
  public:
-  virtual void emit_ev(std::string key, nlohmann::json value) const noexcept;
+  uint64_t collector_down = 0;
+  uint64_t collector_up = 0;
+  uint64_t nettest_down = 0;
+  uint64_t nettest_up = 0;
+};
 
-  class BytesInfoWrapper {
-   public:
-    const Runner *owner = nullptr;
-    BytesInfo *info = nullptr;
-  };
+// cURL handle pool
+// ````````````````
 
- protected:
-  virtual bool run_with_index32(
-      const std::chrono::time_point<std::chrono::steady_clock> &begin,
-      const std::string &test_start_time,
-      const std::vector<std::string> &inputs, const NettestContext &ctx,
-      const std::string &collector_base_url, uint32_t i,
-      BytesInfo *info) const noexcept;
+// CurlxPool keeps warm cURL easy handles around, attached to a CURLSH object
+// sharing DNS results and TLS sessions. Since each easy handle retains its
+// live connections, this allows several requests towards the same host (e.g.
+// the collector) to avoid paying for a new TCP and TLS handshake each time. It
+// is safe to use from many threads.
+class CurlxPool {
+ public:
+  CurlxPool() noexcept;
 
-  virtual bool query_bouncer(std::string nettest_name,
-                             std::vector<std::string> nettest_helper_names,
-                             std::string nettest_version,
-                             std::vector<EndpointInfo> *collectors,
-                             std::map<std::string,
-                               std::vector<EndpointInfo>> *helpers,
-                             BytesInfo *info,
-                             ErrContext *err) noexcept;
+  CurlxPool(const CurlxPool &) noexcept = delete;
+  CurlxPool &operator=(const CurlxPool &) noexcept = delete;
+  CurlxPool(CurlxPool &&) noexcept = delete;
+  CurlxPool &operator=(CurlxPool &&) noexcept = delete;
 
-  virtual bool lookup_ip(std::string *ip, BytesInfo *info,
-                         ErrContext *err) noexcept;
+  ~CurlxPool() noexcept;
 
-  virtual bool lookup_resolver_ip(std::string *ip, BytesInfo *info,
-                                  ErrContext *err) noexcept;
+  // borrow() returns an idle handle, or a new one. Returns nullptr when
+  // we cannot allocate a new handle. The caller owns the handle.
+  CURL *borrow() noexcept;
 
-  virtual bool open_report(const std::string &collector_base_url,
-                           const std::string &test_start_time,
-                           const NettestContext &context,
-                           std::string *report_id,
-                           BytesInfo *info, ErrContext *err) noexcept;
+  // recycle() resets the options of |handle| and puts it into the pool such
+  // that a later borrow() reuses it. Takes ownership of |handle|.
+  void recycle(CURL *handle) noexcept;
 
-  virtual bool update_report(const std::string &collector_base_url,
-                             const std::string &report_id,
-                             const std::string &json_str,
-                             BytesInfo *info, ErrContext *err) const noexcept;
+  // borrow_multi() is like borrow() but returns a multi handle configured
+  // for multiplexing. Multi handles keep their own connection cache, which
+  // is why it's important to reuse them.
+  CURLM *borrow_multi() noexcept;
 
-  virtual bool close_report(const std::string &collector_base_url,
-                            const std::string &report_id,
-                            BytesInfo *info, ErrContext *err) noexcept;
+  // recycle_multi() gives back a multi handle with no easy handles attached
+  // to it. Takes ownership of |handle|.
+  void recycle_multi(CURLM *handle) noexcept;
 
-  // MaxMindDB code
-  // ``````````````
+  // lock() and unlock() are called by cURL to protect the shared data.
+  void lock(curl_lock_data data) noexcept;
+  void unlock(curl_lock_data data) noexcept;
 
-  virtual bool lookup_asn(const std::string &dbpath, const std::string &ip,
-                          std::string *asn, std::string *network_name,
-                          ErrContext *err) noexcept;
+ private:
+  // Upper bound to the number of handles we keep around. We don't need much
+  // more than the number of threads concurrently using the pool.
+  static constexpr size_t max_idle = 64;
+
+  std::vector<CURL *> idle_;
+  std::vector<CURLM *> idle_multi_;
+  std::mutex idle_mutex_;
+  std::mutex share_mutexes_[CURL_LOCK_DATA_LAST];
+  CURLSH *share_ = nullptr;
+};
 
-  virtual bool lookup_cc(const std::string &dbpath, const std::string &probe_ip,
-                         std::string *cc, ErrContext *err) noexcept;
+// Measurement submission
+// ``````````````````````
 
-  // cURL code
-  // `````````
+// Submission is a serialized measurement waiting to be submitted.
+class Submission {
+ public:
+  uint32_t idx = 0;
+  std::string json_str;
+  MeasurementBytes bytes;
+};
 
-  class CurlxDeleter {
+// SubmissionQueue is a bounded queue through which the nettest workers hand
+// over serialized measurements to the threads submitting them. Pushing when
+// the queue is full blocks, so a slow collector applies backpressure rather
+// than causing us to buffer an unbounded amount of measurements.
+class SubmissionQueue {
+ public:
+  explicit SubmissionQueue(size_t capacity) noexcept;
+
+  // push() blocks until there is room in the queue. Returns false if the
+  // queue has been closed, in which case |submission| is not consumed.
+  bool push(Submission &submission) noexcept;
+
+  // pop() blocks until there is a submission in the queue. Returns false
+  // when the queue has been closed and there is nothing left to pop.
+  bool pop(Submission *submission) noexcept;
+
+  // pop_batch() is like pop() but, after the first submission, it waits for
+  // at most |timeout| for more submissions, until |batch| contains |count|
+  // submissions. Appends to |batch|, which should be initially empty.
+  bool pop_batch(std::vector<Submission> *batch, size_t count,
+                 std::chrono::milliseconds timeout) noexcept;
+
+  // close() wakes up all waiters and prevents further pushes.
+  void close() noexcept;
+
+ private:
+  size_t capacity_ = 0;
+  bool closed_ = false;
+  std::condition_variable cond_;
+  std::mutex mutex_;
+  std::deque<Submission> queue_;
+};
+
+// Spool is an append-only file where we save the measurements until they have
+// been submitted. Each line is a JSON object: either a measurement, i.e.
+// `{"idx":<idx>,"report_id":<report_id>,"measurement":<measurement>}`, or a
+// marker telling that a measurement has been submitted, i.e.
+// `{"done":true,"idx":<idx>,"report_id":<report_id>}`. Adding entries never
+// blocks on the disk: a background thread writes them and syncs the file in
+// batches. Opening the spool drops the submitted measurements from the file.
+// A Spool holds an exclusive lock on the file at its path plus ".lock" while
+// open, so that a single Spool, in any process, uses the file at a time.
+class Spool {
+ public:
+  explicit Spool(std::string path) noexcept;
+
+  Spool(const Spool &) noexcept = delete;
+  Spool &operator=(const Spool &) noexcept = delete;
+  Spool(Spool &&) noexcept = delete;
+  Spool &operator=(Spool &&) noexcept = delete;
+
+  // open() loads the measurements not submitted yet, including the ones of
+  // previous runs, and starts the background writer. Fails with reason
+  // "spool_busy_error" if another Spool is using the file.
+  bool open(ErrContext *err) noexcept;
+
+  // add() saves the measurement |json_str|, which MUST be a single line, with
+  // index |idx| in the report |report_id|.
+  void add(const std::string &report_id, uint32_t idx,
+           const std::string &json_str) noexcept;
+
+  // done() records that the measurement has been submitted.
+  void done(const std::string &report_id, uint32_t idx) noexcept;
+
+  // failed() records that the submission of the measurement failed.
+  void failed(const std::string &report_id, uint32_t idx) noexcept;
+
+  // failed_indexes() returns the indexes of the measurements of |report_id|
+  // whose submission failed and that are already on disk.
+  std::vector<uint32_t> failed_indexes(const std::string &report_id) noexcept;
+
+  // report_ids() returns the reports having measurements not submitted yet,
+  // including the reports of previous runs.
+  std::vector<std::string> report_ids() noexcept;
+
+  // read() loads from disk the measurement with index |idx| in |report_id|.
+  bool read(const std::string &report_id, uint32_t idx,
+            std::string *json_str) noexcept;
+
+  // pending() returns the number of measurements not submitted yet.
+  size_t pending() noexcept;
+
+  // sync() waits until all the entries added so far are on disk.
+  void sync() noexcept;
+
+  // ~Spool() writes the remaining entries and stops the background writer.
+  ~Spool() noexcept;
+
+ private:
+  class Record {
    public:
-    void operator()(CURL *handle) noexcept;
+    bool failed = false;
+    uint64_t length = 0;
+    uint64_t offset = 0;
   };
-  using UniqueCurlx = std::unique_ptr<CURL, CurlxDeleter>;
 
-  virtual bool curlx_post_json(std::string url,
-                               std::string requestbody,
-                               long timeout,
-                               std::string *responsebody,
-                               BytesInfo *info,
-                               ErrContext *err) const noexcept;
+  void append_locked(std::string line) noexcept;
+  bool lock_file_locked(ErrContext *err) noexcept;
+  void loop() noexcept;
+  void unlock_file_locked() noexcept;
+
+  std::string buffer_;  // Entries not yet written
+  std::condition_variable cond_;
+  FILE *file_ = nullptr;
+  int lock_fd_ = -1;
+  std::mutex mutex_;
+  std::string path_;
+  std::map<std::string, std::map<uint32_t, Record>> records_;
+  bool stop_ = false;
+  uint64_t synced_ = 0;  // Size of the file on disk
+  bool sync_requested_ = false;
+  std::thread thread_;
+};
 
-  virtual bool curlx_get(std::string url,
-                         long timeout,
-                         std::string *responsebody,
-                         BytesInfo *info,
-                         ErrContext *err) noexcept;
+// Worker pool
+// ```````````
 
-  virtual bool curlx_common(UniqueCurlx &handle,
-                            std::string url,
-                            long timeout,
-                            std::string *responsebody,
-                            BytesInfo *info,
-                            ErrContext *err) const noexcept;
+// WaitGroup allows to wait for a set of tasks to complete.
+class WaitGroup {
+ public:
+  // add() increases the number of tasks we're waiting for by |count|.
+  void add(size_t count) noexcept;
+
+  // done() signals that a task has completed.
+  void done() noexcept;
+
+  // wait() blocks until all tasks have completed.
+  void wait() noexcept;
+
+  // wait_for() is like wait() but returns false after |timeout|.
+  bool wait_for(std::chrono::milliseconds timeout) noexcept;
 
  private:
-  // Private attributes
-  // ``````````````````
+  std::condition_variable cond_;
+  size_t count_ = 0;
+  std::mutex mutex_;
+};
 
-  std::atomic_bool interrupted_{false};
+// WorkerPool is a set of threads running tasks. A Runner creates a pool the
+// first time it runs and reuses it across runs. Multiple Runners may share a
+// single pool owned by the embedder (see Runner::set_worker_pool()). Threads
+// are created when there is no idle thread to run a task, so tasks never wait
+// for each other, unless the system refuses to create more threads. Threads
+// idle for a while exit, and all of them are joined when the pool is destroyed.
+class WorkerPool {
+ public:
+  WorkerPool() noexcept;
 
-  Nettest &nettest_;
+  WorkerPool(const WorkerPool &) noexcept = delete;
+  WorkerPool &operator=(const WorkerPool &) noexcept = delete;
+  WorkerPool(WorkerPool &&) noexcept = delete;
+  WorkerPool &operator=(WorkerPool &&) noexcept = delete;
 
-  const Settings &settings_;
+  ~WorkerPool() noexcept;
+
+  // submit() schedules |task| for running in a background thread.
+  void submit(std::function<void()> &&task) noexcept;
+
+ private:
+  void loop() noexcept;
+
+  std::condition_variable cond_;
+  std::vector<std::thread> exited_;  // To be joined
+  size_t idle_ = 0;
+  std::mutex mutex_;
+  bool stop_ = false;
+  std::deque<std::function<void()>> tasks_;
+  std::vector<std::thread> threads_;
 };
 
-// Implementation section
-// ``````````````````````
-// This is a single header library. In some use cases you may want to split
-// the interface and implementation using LIBNETTEST2_NO_INLINE_IMPL.
-#ifndef LIBNETTEST2_NO_INLINE_IMPL
+// Adaptive parallelism
+// ````````````````````
 
-// Errors
-// ``````
+// ConcurrencyController implements additive-increase/multiplicative-decrease
+// control of the number of measurements running concurrently. After a round,
+// i.e. after as many measurements as the current limit, we compare the round's
+// average runtime and error rate with the best ones seen so far. If neither of
+// them degraded significantly we increase the limit by one, otherwise we halve
+// it. The limit is always between one and the configured maximum.
+class ConcurrencyController {
+ public:
+  ConcurrencyController(size_t initial, size_t maximum) noexcept;
 
-const char *libnettest2_strerror(Errors n) noexcept {
-#define XX(e_) case Errors::e_: return #e_;
-  switch (n) {
-    LIBNETTEST2_ENUM_OWN_ERRORS(XX)
-  }
-#undef XX
-  return "invalid_argument";
-}
+  // acquire() blocks until we can start another measurement.
+  void acquire() noexcept;
 
-// JSON parsing of settings
-// ````````````````````````
+  // release() signals that a measurement started by acquire() is done.
+  void release() noexcept;
 
-// describe_pointer<T> and DESCRIBE_POINTER are helpers designed to allow
-// us to tell the user the expected type of a variable.
-template <typename Type> struct describe_pointer;
+  // update() accounts for a measurement that took |runtime| seconds and that
+  // succeeded if |success| is true. Returns true if this changed the limit.
+  bool update(double runtime, bool success) noexcept;
 
-using StringStringMap = std::map<std::string, std::string>;
+  // limit() returns the current maximum number of concurrent measurements.
+  size_t limit() noexcept;
 
-#define DESCRIBE_POINTER(T, V)                   \
-  template <>                                    \
-  struct describe_pointer<T> {                   \
-    static constexpr const char *type_name = V;  \
-  }
+ private:
+  double best_error_rate_ = 1.0;
+  double best_runtime_ = 0.0;  // Zero means "not yet known"
+  std::condition_variable cond_;
+  size_t errors_ = 0;
+  size_t in_flight_ = 0;
+  size_t limit_ = 1;
+  size_t maximum_ = 1;
+  std::mutex mutex_;
+  size_t samples_ = 0;
+  double total_runtime_ = 0.0;
+};
 
-DESCRIBE_POINTER(bool, "bool");
-DESCRIBE_POINTER(double, "double");
-DESCRIBE_POINTER(StringStringMap, "std::map<std::string, std::string>");
-DESCRIBE_POINTER(std::vector<std::string>, "std::vector<std::string>");
-DESCRIBE_POINTER(std::string, "std::string");
-DESCRIBE_POINTER(uint8_t, "uint8_t");
-DESCRIBE_POINTER(uint16_t, "uint16_t");
+// DeadlineScheduler decides whether to start another measurement given the
+// time |budget| in seconds measured from |begin|. It estimates the runtime
+// of a measurement from a moving average of the runtimes seen so far plus
+// twice their mean deviation, like TCP does for the retransmission timeout
+// (RFC 6298), and starts a measurement only if it would complete in time.
+class DeadlineScheduler {
+ public:
+  DeadlineScheduler(std::chrono::steady_clock::time_point begin,
+                    double budget) noexcept;
 
-#undef DESCRIBE_POINTER  // Tidy
+  // admit() returns true if a measurement started now would likely complete
+  // before the deadline.
+  bool admit() noexcept;
 
-template <typename Type>
-bool json_maybe_get(const nlohmann::json &doc, std::string ptr_string,
-                    Type *value, std::string *err) noexcept {
-  if (value == nullptr || err == nullptr) {
-    return false;
-  }
-  nlohmann::json::json_pointer pointer{ptr_string};
-  *value = {};
-  nlohmann::json entry;
-  try {
-    entry = doc.at(pointer);
-  } catch (const std::exception &exc) {
-    return true;  // No entry? It's okay because we're maybe_get() not get()
-  }
-  try {
-    *value = entry.get<Type>();
-  } catch (const std::exception &) {
-    std::stringstream ss;
-    ss << "invalid_settings_error: cannot convert variable accessed using "
-       << "'" << ptr_string << "' as JSON pointer from JSON type '"
-       << entry.type_name() << "' to C++ type '"
-       << describe_pointer<Type>::type_name << "'";
-    *err = ss.str();
-    return false;
-  }
-  return true;
-}
+  // update() accounts for a measurement that took |runtime| seconds.
+  void update(double runtime) noexcept;
 
-template <typename Type>
-std::string out_of_range_error_gen(
-    const std::string &ptr, Type minimum, Type maximum) noexcept {
-  std::stringstream ss;
-  ss << "invalid_settings_error: cannot validate variable accessed using "
-     << "'" << ptr << "' because the value is out of range (The "
-     << "minimum acceptable value is " << minimum << " while the maximum "
-     << "acceptable value is " << maximum << ")";
-  return ss.str();
-}
+  // estimate() returns the expected runtime of a measurement in seconds,
+  // which is zero until we have seen the first measurement.
+  double estimate() noexcept;
 
-static std::string format_error_gen(const std::string &ptr) noexcept {
-  std::stringstream ss;
-  ss << "invalid_settings_error: cannot validate variable accessed using "
-     << "'" << ptr << "' because the variable should be an integer "
-     << "but you actually provided a floating point number";
-  return ss.str();
-}
+  // deadline() returns the time after which no measurement should be running.
+  std::chrono::steady_clock::time_point deadline() const noexcept;
 
-bool parse_settings(std::string str, Settings *settings,
-                    std::string *err, std::string *warn) noexcept {
-  if (settings == nullptr || err == nullptr) {
-    return false;
-  }
-  // Note: warn is currently only used by the feature allowing a app to pass
-  // us a number to be treated like a boolean value.
-  if (warn == nullptr) {
-    return false;
-  }
-  nlohmann::json doc;
-  try {
-    doc = nlohmann::json::parse(str);
-  } catch (const std::exception &) {
-    *err = "json_parse_error";
-    return false;
-  }
-  if (!doc.is_object()) {
-    *err = "invalid_settings_error: JSON document is not an object";
-    return false;
-  }
-  if (doc.count("options") <= 0) {
-    *err = "invalid_settings_error: missing 'options' entry";
-    return false;
-  }
-  if (!doc.at("options").is_object()) {
-    *err = "invalid_settings_error: 'options' entry is not an object";
-    return false;
-  }
-  if (doc.count("name") <= 0) {
-    *err = "invalid_settings_error: missing 'name' entry";
+ private:
+  std::chrono::steady_clock::time_point deadline_;
+  double deviation_ = 0.0;
+  double mean_ = 0.0;
+  std::mutex mutex_;
+  size_t samples_ = 0;
+};
+
+// Metrics
+// ```````
+
+// The number of buckets of a LatencyHistogram.
+constexpr size_t latency_histogram_buckets = 32;
+
+// LatencyHistogram counts latencies into buckets whose upper bounds are the
+// powers of two in microseconds, such that the last bucket is for latencies
+// longer than about 18 minutes. Recording and reading are lock free, hence the
+// histogram can safely be updated by many threads without contention.
+class LatencyHistogram {
+ public:
+  // record() accounts for a latency of |seconds|.
+  void record(double seconds) noexcept;
+
+  // count() returns the number of latencies recorded so far.
+  uint64_t count() const noexcept;
+
+  // sum() returns the sum of the latencies recorded so far, in seconds.
+  double sum() const noexcept;
+
+  // max() returns the longest latency recorded so far, in seconds.
+  double max() const noexcept;
+
+  // quantile() returns an upper bound for the |q|-th quantile, where |q| is
+  // between zero and one, in seconds. Returns zero if count() is zero.
+  double quantile(double q) const noexcept;
+
+ private:
+  std::atomic<uint64_t> buckets_[latency_histogram_buckets] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> max_us_{0};
+  std::atomic<uint64_t> sum_us_{0};
+};
+
+// Phase is a phase of Runner::run() whose latency we measure. Phases from
+// nettest_run onwards are measured once per measurement, or per submission.
+enum class Phase : uint8_t {
+  bouncer,
+  ip_lookup,
+  asn_lookup,
+  cc_lookup,
+  resolver_lookup,
+  open_report,
+  nettest_run,
+  serialization,
+  update_report,
+  close_report,
+};
+
+// The number of values of Phase.
+constexpr size_t num_phases = 10;
+
+// phase_name() returns the name of |phase|, e.g., "open_report".
+const char *phase_name(Phase phase) noexcept;
+
+// RunnerMetrics contains the metrics of a Runner since it was constructed.
+// All its fields are atomic, hence they can be read while running.
+class RunnerMetrics {
+ public:
+  // The latency of each phase, indexed by the value of Phase.
+  LatencyHistogram phases[num_phases];
+
+  // Counters.
+  std::atomic<uint64_t> measurements{0};
+  std::atomic<uint64_t> measurement_failures{0};
+  std::atomic<uint64_t> submissions{0};
+  std::atomic<uint64_t> submission_failures{0};
+  std::atomic<uint64_t> submission_retries{0};
+
+  // Gauges: the measurements waiting to be submitted, the running nettest
+  // workers, and how many of them are currently running a nettest.
+  std::atomic<int64_t> queue_depth{0};
+  std::atomic<int64_t> workers{0};
+  std::atomic<int64_t> busy_workers{0};
+
+  // phase() returns the histogram of |phase|.
+  LatencyHistogram &phase(Phase phase) noexcept;
+  const LatencyHistogram &phase(Phase phase) const noexcept;
+
+  // record() accounts for a |phase| that started at |start| and ended now.
+  void record(Phase phase,
+              std::chrono::steady_clock::time_point start) noexcept;
+};
+
+// to_json() converts |metrics| to the JSON used by the status.metrics event,
+// where the latencies are in seconds and the utilization is the fraction of
+// workers currently running a nettest.
+void to_json(nlohmann::json &j, const RunnerMetrics &metrics) noexcept;
+
+// MaxMindDB handle cache
+// ``````````````````````
+
+// MmdbHandle is an open MaxMindDB database. Lookups using the same handle
+// can safely run concurrently in several threads.
+class MmdbHandle {
+ public:
+  MMDB_s mmdb{};
+  bool is_open = false;
+  int64_t mtime = 0;
+
+  MmdbHandle() noexcept = default;
+  MmdbHandle(const MmdbHandle &) noexcept = delete;
+  MmdbHandle &operator=(const MmdbHandle &) noexcept = delete;
+  MmdbHandle(MmdbHandle &&) noexcept = delete;
+  MmdbHandle &operator=(MmdbHandle &&) noexcept = delete;
+
+  ~MmdbHandle() noexcept;
+};
+
+// MmdbCache is a process-wide cache of open MaxMindDB databases, keyed by
+// path and modification time, such that we don't map the databases again
+// and parse their metadata for every lookup.
+class MmdbCache {
+ public:
+  // global() returns the process-wide cache.
+  static MmdbCache &global() noexcept;
+
+  // open() returns a handle for |dbpath|. The database is opened again if it
+  // is not cached or if it has changed since we opened it. The handle stays
+  // valid as long as the caller keeps the returned pointer. On failure, this
+  // method returns a null pointer and fills |err|.
+  std::shared_ptr<MmdbHandle> open(
+      const std::string &dbpath, ErrContext *err) noexcept;
+
+  // reload() forgets all the cached handles, such that the next open() will
+  // open the databases again. Lookups in progress are not affected.
+  void reload() noexcept;
+
+ private:
+  std::map<std::string, std::shared_ptr<MmdbHandle>> handles_;
+  std::mutex mutex_;
+};
+
+// Discovery cache
+// ```````````````
+
+// DiscoveryCache is a persistent cache, stored as a JSON file, of the probe
+// discovery results that require network round trips. Each entry is a JSON
+// value along with the time when it was stored. Writes atomically replace
+// the file, so readers never see a partially written cache. Several Runners
+// may share the same file, but when processes write it concurrently one may
+// lose the entries stored meanwhile by another, which then only costs more
+// network round trips to discover them again. An instance reads the file on
+// the first get() and then serves the entries from memory, so long-lived
+// instances don't see the entries written by others. With an empty path, the cache is only kept
+// in memory. Instances are safe to use from several threads.
+class DiscoveryCache {
+ public:
+  explicit DiscoveryCache(std::string path) noexcept;
+
+  // get() loads the entry for |key| into |value|. Returns false if there is
+  // no such entry. Otherwise, sets |fresh| to whether the entry is younger
+  // than |ttl| seconds.
+  bool get(const std::string &key, int64_t ttl, nlohmann::json *value,
+           bool *fresh) noexcept;
+
+  // put() stores |value| as the entry for |key|.
+  bool put(const std::string &key, nlohmann::json value) noexcept;
+
+ private:
+  nlohmann::json doc_;  // The entries, once loaded
+  bool loaded_ = false;
+  std::string path_;
+};
+
+// Input sources
+// `````````````
+
+// InputSource produces the inputs of a nettest. The nettest workers pull the
+// inputs lazily, so a source does not need to hold all of them in memory.
+// Implementations MUST be safe to use from several threads.
+class InputSource {
+ public:
+  // next() stores the next input into |input|. Returns false when there are
+  // no more inputs.
+  virtual bool next(std::string *input) noexcept = 0;
+
+  // next_with_position() is like next() except that it also stores into
+  // |position| the number of inputs produced before |input|. The default
+  // implementation serializes the calls to next(), such that the positions
+  // follow the order of the inputs. Sources that can pair inputs and their
+  // positions without a lock override it.
+  virtual bool next_with_position(std::string *input,
+                                  uint64_t *position) noexcept;
+
+  virtual ~InputSource() noexcept;
+
+ private:
+  std::mutex position_mutex_;
+  uint64_t position_ = 0;
+};
+
+// VectorInputSource produces the inputs in |inputs|, which MUST outlive the
+// source, in random order if |randomize| is true. Randomizing only shuffles
+// the inputs' indexes, so the inputs themselves are never copied.
+class VectorInputSource : public InputSource {
+ public:
+  VectorInputSource(const std::vector<std::string> &inputs,
+                    bool randomize) noexcept;
+
+  // This constructor only produces the inputs at the positions P for which
+  // P % |shard_count| equals |shard_index|. When |seed| is not zero, the
+  // random order only depends on |seed| and on the number of inputs.
+  VectorInputSource(const std::vector<std::string> &inputs, bool randomize,
+                    uint32_t seed, uint32_t shard_index,
+                    uint32_t shard_count) noexcept;
+
+  bool next(std::string *input) noexcept override;
+
+  bool next_with_position(std::string *input,
+                          uint64_t *position) noexcept override;
+
+ private:
+  const std::vector<std::string> &inputs_;
+  std::atomic<uint64_t> next_{0};
+  std::vector<size_t> order_;  // Empty unless randomizing
+};
+
+// FileInputSource produces the lines of the files at |paths|, in order, while
+// skipping empty lines. Files are read incrementally as inputs are needed.
+class FileInputSource : public InputSource {
+ public:
+  explicit FileInputSource(std::vector<std::string> paths) noexcept;
+
+  bool next(std::string *input) noexcept override;
+
+ private:
+  std::ifstream file_;
+  std::mutex mutex_;
+  size_t next_path_ = 0;
+  std::vector<std::string> paths_;
+};
+
+// FunctionInputSource produces the inputs returned by |func|, which returns
+// false when there are no more inputs. Calls to |func| are serialized.
+class FunctionInputSource : public InputSource {
+ public:
+  explicit FunctionInputSource(
+      std::function<bool(std::string *)> &&func) noexcept;
+
+  bool next(std::string *input) noexcept override;
+
+ private:
+  bool done_ = false;
+  std::function<bool(std::string *)> func_;
+  std::mutex mutex_;
+};
+
+// ChainInputSource produces all the inputs of each of |sources| in turn.
+class ChainInputSource : public InputSource {
+ public:
+  explicit ChainInputSource(
+      std::vector<std::unique_ptr<InputSource>> &&sources) noexcept;
+
+  bool next(std::string *input) noexcept override;
+
+ private:
+  size_t current_ = 0;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<InputSource>> sources_;
+};
+
+// ShardInputSource produces the inputs of |source| at the positions P for
+// which P % |shard_count| equals |shard_index|, where the position of the first
+// input of |source| is |first_position|.
+class ShardInputSource : public InputSource {
+ public:
+  ShardInputSource(std::unique_ptr<InputSource> &&source, uint32_t shard_index,
+                   uint32_t shard_count, uint64_t first_position) noexcept;
+
+  bool next(std::string *input) noexcept override;
+
+ private:
+  std::mutex mutex_;
+  uint64_t position_ = 0;
+  uint32_t shard_count_ = 1;
+  uint32_t shard_index_ = 0;
+  std::unique_ptr<InputSource> source_;
+};
+
+// ShuffleInputSource produces the inputs of |source| in random order using a
+// buffer of up to |capacity| inputs. Each call returns a random input from the
+// buffer and replaces it with the next input of |source|. This shuffles with
+// bounded memory, at the cost of a less uniform permutation than a full one.
+// When |seed| is not zero, the order only depends on |seed| and |source|.
+class ShuffleInputSource : public InputSource {
+ public:
+  ShuffleInputSource(std::unique_ptr<InputSource> &&source,
+                     size_t capacity) noexcept;
+
+  ShuffleInputSource(std::unique_ptr<InputSource> &&source, size_t capacity,
+                     uint32_t seed) noexcept;
+
+  bool next(std::string *input) noexcept override;
+
+ private:
+  std::vector<std::string> buffer_;
+  size_t capacity_ = 1;
+  std::mt19937_64 engine_;
+  bool filled_ = false;
+  std::mutex mutex_;
+  std::unique_ptr<InputSource> source_;
+};
+
+// Event sink
+// ``````````
+
+// EventSink writes serialized events to an output stream from a dedicated
+// thread, so that the threads emitting events do not contend on the stream.
+// Events are queued into a bounded lock-free ring buffer that supports many
+// producers and one consumer. The consumer writes events in batches and only
+// flushes the stream when the ring buffer is empty.
+class EventSink {
+ public:
+  // EventSink() creates a sink writing on |out|, which MUST outlive the sink,
+  // with room for |capacity| events, rounded up to a power of two.
+  EventSink(std::ostream &out, size_t capacity) noexcept;
+
+  EventSink(const EventSink &) noexcept = delete;
+  EventSink &operator=(const EventSink &) noexcept = delete;
+  EventSink(EventSink &&) noexcept = delete;
+  EventSink &operator=(EventSink &&) noexcept = delete;
+
+  // global() returns the process-wide sink writing on std::clog.
+  static EventSink &global() noexcept;
+
+  // push() queues |line| for writing. If the ring buffer is full, it blocks
+  // until the consumer has written a batch of events.
+  void push(std::string &&line) noexcept;
+
+  // flush() waits until all the events queued so far have been written.
+  void flush() noexcept;
+
+  // ~EventSink() writes the events still queued and joins the consumer.
+  ~EventSink() noexcept;
+
+ private:
+  class Cell {
+   public:
+    std::atomic<uint64_t> sequence{0};
+    std::string line;
+  };
+
+  bool try_push(std::string *line) noexcept;
+  bool try_pop(std::string *line) noexcept;
+  void loop() noexcept;
+
+  std::unique_ptr<Cell[]> cells_;
+  std::condition_variable cond_;
+  std::atomic<uint64_t> enqueue_pos_{0};
+  uint64_t dequeue_pos_ = 0;  // Only used by the consumer
+  uint64_t mask_ = 0;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::ostream &out_;
+  std::atomic<uint64_t> pushed_{0};
+  std::atomic_bool sleeping_{false};
+  bool stop_ = false;
+  std::thread thread_;
+  std::atomic<uint64_t> waiting_{0};  // Producers waiting on not_full_
+  std::atomic<uint64_t> written_{0};
+};
+
+// Runner scheduling
+// `````````````````
+
+// RunnerScheduler limits the number of Runners that are running at the same
+// time. Runners sharing a scheduler wait in run() until a slot is available.
+// When |fifo| is true, the Runners are admitted in the order in which they
+// arrived, otherwise in no specific order.
+class RunnerScheduler {
+ public:
+  RunnerScheduler(size_t max_active, bool fifo) noexcept;
+
+  RunnerScheduler(const RunnerScheduler &) noexcept = delete;
+  RunnerScheduler &operator=(const RunnerScheduler &) noexcept = delete;
+  RunnerScheduler(RunnerScheduler &&) noexcept = delete;
+  RunnerScheduler &operator=(RunnerScheduler &&) noexcept = delete;
+
+  // global() returns the scheduler used by Runners that have not been
+  // configured otherwise, which runs a single Runner at a time.
+  static std::shared_ptr<RunnerScheduler> global() noexcept;
+
+  // acquire() blocks until a slot is available and takes it.
+  void acquire() noexcept;
+
+  // release() gives back a slot taken with acquire().
+  void release() noexcept;
+
+  ~RunnerScheduler() noexcept;
+
+ private:
+  size_t active_ = 0;
+  std::condition_variable cond_;
+  bool fifo_ = false;
+  size_t max_active_ = 1;
+  std::mutex mutex_;
+  uint64_t next_ticket_ = 0;  // Ticket given to the next arriving Runner
+  uint64_t serving_ = 0;      // Ticket of the next Runner to admit
+};
+
+// Typed events
+// ````````````
+
+// EventId identifies the events that are emitted frequently, i.e., once or
+// more per measurement, which are delivered as Event rather than as JSON.
+enum class EventId : uint32_t {
+  log = 0,
+  measurement = 1,
+  measurement_start = 2,
+  measurement_done = 3,
+  measurement_submission = 4,
+  failure_measurement = 5,
+  failure_measurement_submission = 6,
+};
+
+// Event is the payload of a typed event. Only the fields relevant to the
+// event identified by |id| are set. The pointers refer to memory owned by the
+// emitter, therefore they are only valid while the event is being handled.
+class Event {
+ public:
+  EventId id = EventId::log;
+  uint32_t idx = 0;                       // All events but log
+  LogLevel log_level = LogLevel::log_quiet;  // log
+  const std::string *message = nullptr;   // log
+  const std::string *input = nullptr;     // measurement_start
+  const std::string *json_str = nullptr;  // measurement and submission failure
+  const char *failure = nullptr;          // failure_*
+  const ErrContext *err = nullptr;        // failure_measurement_submission
+  const MeasurementBytes *bytes = nullptr;  // measurement_done (optional)
+};
+
+// Runner
+// ``````
+
+class CurlxSlist;
+
+class Runner {
+ public:
+  Runner(const Settings &settings, Nettest &nettest) noexcept;
+
+  Runner(const Runner &) noexcept = delete;
+  Runner &operator=(const Runner &) noexcept = delete;
+  Runner(Runner &&) noexcept = delete;
+  Runner &operator=(Runner &&) noexcept = delete;
+
+  virtual ~Runner() noexcept;
+
+  bool run() noexcept;
+
+  // interrupt() cancels the measurements and the transfers in progress, and
+  // makes run() submit the measurements that are over, close the report and
+  // return as soon as possible. It applies to the run in progress, or to the
+  // next one if none is in progress. It is safe to call from any thread.
+  void interrupt() noexcept;
+
+  // transfers_cancelled() returns whether the transfers in progress should
+  // be aborted. This is the case after interrupt() until no measurement is
+  // in progress anymore, when run() drains the submissions and closes the
+  // report. Submissions are never aborted, since their measurements are over.
+  bool transfers_cancelled() const noexcept;
+
+  LogLevel get_log_level() const noexcept;
+
+  // set_worker_pool() allows to share |pool| with other Runners. It MUST be
+  // called before run(), otherwise run() creates a pool on demand.
+  void set_worker_pool(std::shared_ptr<WorkerPool> pool) noexcept;
+
+  // set_input_source() configures the source of the inputs of the nettest,
+  // replacing Settings::inputs and Settings::input_filepaths. Since a source
+  // is consumed as inputs are pulled from it, it can be used by a single run
+  // only. Settings::randomize_input and Settings::shard_count do not apply
+  // to |source|.
+  void set_input_source(std::shared_ptr<InputSource> source) noexcept;
+
+  // set_event_sink() configures the sink to which the default on_event()
+  // writes the events. If not set, it uses EventSink::global().
+  void set_event_sink(std::shared_ptr<EventSink> sink) noexcept;
+
+  // set_scheduler() configures the scheduler deciding when run() may start,
+  // which allows to run several Runners concurrently. If not set, it uses
+  // RunnerScheduler::global(), which runs a single Runner at a time.
+  void set_scheduler(std::shared_ptr<RunnerScheduler> scheduler) noexcept;
+
+  // set_curlx_pool() allows to share |pool|, hence warm connections, DNS
+  // results and TLS sessions, with other Runners. It MUST be called before
+  // run(). If not set, each Runner uses its own pool.
+  void set_curlx_pool(std::shared_ptr<CurlxPool> pool) noexcept;
+
+  // set_discovery_cache() allows to share |cache| with other Runners. It MUST
+  // be called before run(). If set, we use |cache| regardless of the value
+  // of Settings::discovery_cache_path.
+  void set_discovery_cache(std::shared_ptr<DiscoveryCache> cache) noexcept;
+
+  // metrics() returns the metrics of this Runner, which can be read from
+  // any thread, also while run() is running.
+  const RunnerMetrics &metrics() const noexcept;
+
+ protected:
+  // Methods you typically want to override
+  // ``````````````````````````````````````
+  // The on_event() method is called when a event occurs. Note that this
+  // method MAY be called from another thread context.
+
+  virtual void on_event(const nlohmann::json &event) const noexcept;
+
+  // The on_typed_event() method is called for the events enumerated by
+  // EventId. The default implementation converts |event| to JSON and passes
+  // it to on_event(). Override it to handle these events without allocating
+  // memory. Like on_event(), it MAY be called from another thread context.
+
+  virtual void on_typed_event(const Event &event) const noexcept;
+
+  // Methods you generally DON'T want to override
+  // ````````````````````````````````````````````
+  // You may want to override them in unit tests, however.
+
+ public:
+  virtual void emit_ev(std::string key, nlohmann::json value) const noexcept;
+
+  void emit_typed_ev(const Event &event) const noexcept;
+
+  // The following methods emit typed events with the given payload.
+
+  void emit_measurement(uint32_t idx, const std::string &json_str) const
+      noexcept;
+
+  void emit_measurement_start(uint32_t idx, const std::string &input) const
+      noexcept;
+
+  void emit_measurement_done(uint32_t idx) const noexcept;
+
+  // emit_measurement_done() overload also telling the bytes exchanged
+  // because of the measurement at index |idx|.
+  void emit_measurement_done(uint32_t idx,
+                             const MeasurementBytes &bytes) const noexcept;
+
+  void emit_measurement_submission(uint32_t idx) const noexcept;
+
+  void emit_failure_measurement(uint32_t idx, const char *failure) const
+      noexcept;
+
+  // emit_failure_measurement_submission() emits the event without |idx|,
+  // |err| and |json_str| when |err| is null.
+  void emit_failure_measurement_submission(uint32_t idx, const char *failure,
+                                           const ErrContext *err,
+                                           const std::string *json_str) const
+      noexcept;
+
+  class BytesInfoWrapper {
+   public:
+    const Runner *owner = nullptr;
+    BytesInfo *info = nullptr;
+  };
+
+  // CurlxBody is a JSON request body made of pieces that we send one after
+  // the other, so we never need to concatenate them. The memory referenced by
+  // the pieces MUST outlive the transfer.
+  class CurlxBody {
+   public:
+    std::vector<std::pair<const char *, size_t>> pieces;
+    size_t current = 0;  // Index of the piece we are sending
+    size_t offset = 0;   // Offset within the current piece
+    const char *content_encoding = nullptr;  // Not set unless compressed
+  };
+
+  // CurlxSink receives the body of a response as it arrives.
+  class CurlxSink {
+   public:
+    // reserve() is called before the first append() with the size of the
+    // body, when the response specifies it using Content-Length.
+    virtual void reserve(uint64_t size) noexcept;
+
+    // append() receives the next |count| bytes of the body. It returns false
+    // to interrupt the transfer.
+    virtual bool append(const char *data, size_t count) noexcept = 0;
+
+    virtual ~CurlxSink() noexcept;
+  };
+
+  // CurlxStringSink appends the body to a caller owned string, reserving in
+  // advance the space for the whole body when its size is known.
+  class CurlxStringSink : public CurlxSink {
+   public:
+    explicit CurlxStringSink(std::string *body) noexcept;
+
+    void reserve(uint64_t size) noexcept override;
+
+    bool append(const char *data, size_t count) noexcept override;
+
+   private:
+    std::string *body_ = nullptr;
+  };
+
+  class CurlxSinkWrapper {
+   public:
+    CURL *handle = nullptr;
+    CurlxSink *sink = nullptr;
+    bool started = false;
+  };
+
+ protected:
+  // run_with_input32() measures the |input| that a worker pulled from the
+  // input source as measurement |i|, where |i| is the position of |input|.
+  // The bytes exchanged by the nettest are added to |info|. If we submit the
+  // measurement ourself, rather than queueing it, the bytes exchanged with
+  // the collector are added to |collector_info|.
+  virtual bool run_with_input32(
+      const std::chrono::time_point<std::chrono::steady_clock> &begin,
+      const std::string &test_start_time, const std::string &input,
+      const NettestContext &ctx, const std::string &collector_base_url,
+      uint32_t i, BytesInfo *info, BytesInfo *collector_info) const noexcept;
+
+  // make_measurement_template() serializes the fields of a measurement that
+  // do not change during a run, i.e., all fields but id, input, the start
+  // time, test_keys and test_runtime, into |result|, as a JSON object without
+  // the final closing brace, to which we append the missing fields.
+  virtual bool make_measurement_template(const NettestContext &ctx,
+                                         const std::string &test_start_time,
+                                         std::string *result) const noexcept;
+
+  // submit_measurement() submits |json_str| to the collector and emits the
+  // events concerning the measurement at index |i|, whose nettest exchanged
+  // |bytes|. It runs in the context of the threads draining the submission
+  // queue. The bytes exchanged with the collector are added to |info|.
+  virtual void submit_measurement(const NettestContext &ctx,
+                                  const std::string &collector_base_url,
+                                  uint32_t i, std::string json_str,
+                                  MeasurementBytes bytes,
+                                  BytesInfo *info) const noexcept;
+
+  // submit_measurements() is like submit_measurement() except that it
+  // submits all the measurements in |batch| together.
+  virtual void submit_measurements(const NettestContext &ctx,
+                                   const std::string &collector_base_url,
+                                   std::vector<Submission> batch,
+                                   BytesInfo *info) const noexcept;
+
+  // report_target() copies into |target| where to submit measurements. That
+  // is |collector_base_url| and the report of |ctx|, unless we are using the
+  // ranked collectors, in which case it's the collector in use.
+  virtual void report_target(const NettestContext &ctx,
+                             const std::string &collector_base_url,
+                             ReportTarget *target) const noexcept;
+
+  // fail_over() is called when submitting to |target| failed with |err|. If
+  // the error means the collector may be unavailable, fails over to the
+  // next one, setting |target|. Returns false if we cannot fail over.
+  virtual bool fail_over(const ErrContext &err,
+                         ReportTarget *target) const noexcept;
+
+  virtual bool query_bouncer(std::string nettest_name,
+                             std::vector<std::string> nettest_helper_names,
+                             std::string nettest_version,
+                             std::vector<EndpointInfo> *collectors,
+                             std::map<std::string,
+                               std::vector<EndpointInfo>> *helpers,
+                             BytesInfo *info,
+                             ErrContext *err) noexcept;
+
+  virtual bool lookup_ip(std::string *ip, BytesInfo *info,
+                         ErrContext *err) noexcept;
+
+  // rank_endpoints() sorts each of |lists| by the latency of connecting to
+  // its endpoints, which we measure racing connections to the endpoints of
+  // all the lists at once, the fastest first. Then come the endpoints we
+  // cannot connect to, and then the onion ones, which we don't probe. Sets
+  // the i-th entry of |reachable| to whether we can connect to any endpoint
+  // of the i-th list. Returns false if we cannot probe at all.
+  virtual bool rank_endpoints(
+      const std::vector<std::vector<EndpointInfo> *> &lists,
+      std::vector<bool> *reachable, BytesInfo *info) noexcept;
+
+  // rank_endpoints_cached() is like rank_endpoints() except that it uses the
+  // ranking of each key of |lists| saved in the discovery cache, if configured
+  // and fresh, and only probes the other lists. It skips the lists with nothing
+  // to probe, which are therefore not in |reachable|.
+  virtual bool rank_endpoints_cached(
+      const std::map<std::string, std::vector<EndpointInfo> *> &lists,
+      std::map<std::string, bool> *reachable, BytesInfo *info) noexcept;
+
+  virtual bool lookup_resolver_ip(std::string *ip, BytesInfo *info,
+                                  ErrContext *err) noexcept;
+
+  // query_bouncer_cached() is like query_bouncer() except that it uses the
+  // discovery cache, if configured. A stale cache entry is used anyway and
+  // refreshed in the background (see discovery_refreshes_).
+  virtual bool query_bouncer_cached(
+      std::string nettest_name, std::vector<std::string> nettest_helper_names,
+      std::string nettest_version, std::vector<EndpointInfo> *collectors,
+      std::map<std::string, std::vector<EndpointInfo>> *helpers,
+      BytesInfo *info, ErrContext *err) noexcept;
+
+  // lookup_ip_cached() is like lookup_ip() except that it uses the discovery
+  // cache, if configured, like query_bouncer_cached() does.
+  virtual bool lookup_ip_cached(std::string *ip, BytesInfo *info,
+                                ErrContext *err) noexcept;
+
+  // discovery_cache() returns the discovery cache, i.e. the one configured
+  // with set_discovery_cache() or the one at Settings::discovery_cache_path,
+  // which run() opens once per Runner, or nullptr if there's none.
+  std::shared_ptr<DiscoveryCache> discovery_cache() const noexcept;
+
+  virtual bool open_report(const std::string &collector_base_url,
+                           const std::string &test_start_time,
+                           const NettestContext &context,
+                           std::string *report_id,
+                           BytesInfo *info, ErrContext *err) noexcept;
+
+  virtual bool update_report(const std::string &collector_base_url,
+                             const std::string &report_id,
+                             const std::string &json_str,
+                             BytesInfo *info, ErrContext *err) const noexcept;
+
+  // update_report_many() submits all the measurements in |batch| to the
+  // collector. On return, |errs| contains an entry for each entry in |batch|
+  // whose code is zero if the corresponding submission succeeded, and the
+  // bytes used to submit each entry have been added to its bytes field.
+  // Returns true only if all the submissions succeeded.
+  virtual bool update_report_many(const std::string &collector_base_url,
+                                  const std::string &report_id,
+                                  std::vector<Submission> *batch,
+                                  std::vector<ErrContext> *errs,
+                                  BytesInfo *info) const noexcept;
+
+  virtual bool close_report(const std::string &collector_base_url,
+                            const std::string &report_id,
+                            BytesInfo *info, ErrContext *err) noexcept;
+
+  // MaxMindDB code
+  // ``````````````
+
+  virtual bool lookup_asn(const std::string &dbpath, const std::string &ip,
+                          std::string *asn, std::string *network_name,
+                          ErrContext *err) noexcept;
+
+  virtual bool lookup_cc(const std::string &dbpath, const std::string &probe_ip,
+                         std::string *cc, ErrContext *err) noexcept;
+
+  // cURL code
+  // `````````
+
+  class CurlxDeleter {
+   public:
+    void operator()(CURL *handle) noexcept;
+  };
+  using UniqueCurlx = std::unique_ptr<CURL, CurlxDeleter>;
+
+  virtual bool curlx_post_json(std::string url,
+                               std::string requestbody,
+                               long timeout,
+                               std::string *responsebody,
+                               BytesInfo *info,
+                               ErrContext *err) const noexcept;
+
+  virtual bool curlx_get(std::string url,
+                         long timeout,
+                         std::string *responsebody,
+                         BytesInfo *info,
+                         ErrContext *err) noexcept;
+
+  virtual bool curlx_common(UniqueCurlx &handle,
+                            std::string url,
+                            long timeout,
+                            std::string *responsebody,
+                            BytesInfo *info,
+                            ErrContext *err) const noexcept;
+
+  virtual bool curlx_setup_post(CURL *handle, const std::string &requestbody,
+                                CurlxSlist *headers) const noexcept;
+
+  // curlx_setup_post_body() is like curlx_setup_post() except that the
+  // request body is |body|, which cURL reads as the transfer proceeds.
+  virtual bool curlx_setup_post_body(CURL *handle, CurlxBody *body,
+                                     CurlxSlist *headers) const noexcept;
+
+  // curlx_setup_front() is called after the other setup functions that use
+  // |headers|. If |url| belongs to a cloudfronted collector, it replaces it
+  // with the URL on the front and adds the Host header naming the collector
+  // to |headers|, such that we reach the collector through the front.
+  virtual bool curlx_setup_front(CURL *handle, std::string *url,
+                                 CurlxSlist *headers) const noexcept;
+
+  // curlx_setup_common() configures the options common to all requests.
+  // The response body is passed to the sink of |sw|, which must outlive
+  // the transfer together with |w|.
+  virtual bool curlx_setup_common(CURL *handle, const std::string &url,
+                                  long timeout, CurlxSinkWrapper *sw,
+                                  BytesInfoWrapper *w) const noexcept;
+
+  // curlx_account() adds to |info| the bytes sent and received by |handle|
+  // once its transfer is over. We need this because, unless the log level
+  // is debug, we don't install the debug callback that otherwise counts the
+  // bytes as they flow, which is expensive since it makes cURL log a lot.
+  virtual void curlx_account(CURL *handle, BytesInfo *info) const noexcept;
+
+  class CurlxMultiDeleter {
+   public:
+    void operator()(CURLM *handle) noexcept;
+  };
+  using UniqueCurlxMulti = std::unique_ptr<CURLM, CurlxMultiDeleter>;
+
+  // CurlxRequest is a POST request part of a curlx_multi_post_json() batch.
+  // When body has pieces, we send them, otherwise we send requestbody.
+  class CurlxRequest {
+   public:
+    std::string url;
+    std::string requestbody;
+    CurlxBody body;
+    std::string encoded_body;  // Storage for the compressed body, if any
+    // The pieces of the body before compressing it, if compressed.
+    std::vector<std::pair<const char *, size_t>> plain_pieces;
+    std::string responsebody;
+    bool ok = false;
+    ErrContext err;
+    uint64_t bytes_down = 0;  // Bytes exchanged by this request
+    uint64_t bytes_up = 0;
+    bool compress = true;  // Whether we may compress the body
+    // Set when the collector rejected the body, possibly because compressed.
+    bool compression_rejected = false;
+  };
+
+  // curlx_compress_body() replaces the body of |request| with its gzip
+  // compression, unless compression is disabled, unavailable or not worth
+  // it, or the collector does not support it, or |request| forbids it.
+  virtual void curlx_compress_body(CurlxRequest *request) const noexcept;
+
+  // curlx_multi_post_json() performs all |requests| concurrently, possibly
+  // multiplexed over a single HTTP/2 connection. Returns true only if all
+  // requests succeeded; the outcome of each request is in |requests|. Since
+  // it submits measurements, interrupt() does not abort its transfers.
+  virtual bool curlx_multi_post_json(std::vector<CurlxRequest> *requests,
+                                     long timeout,
+                                     BytesInfo *info) const noexcept;
+
+ private:
+  // Private attributes
+  // ``````````````````
+
+  std::atomic_bool interrupted_{false};
+
+  mutable RunnerMetrics metrics_;
+
+  std::shared_ptr<CancellationToken> cancellation_ =
+      std::make_shared<CancellationToken>();
+
+  // Set when no measurement is in progress and run() is draining the
+  // submissions and closing the report.
+  std::atomic_bool draining_{false};
+
+  // The multi handles in use, which interrupt() wakes up.
+  mutable std::vector<CURLM *> multis_;
+  mutable std::mutex multis_mutex_;
+
+  std::shared_ptr<CurlxPool> curlx_pool_ = std::make_shared<CurlxPool>();
+
+  std::shared_ptr<WorkerPool> worker_pool_;
+
+  std::shared_ptr<InputSource> input_source_;
+
+  std::shared_ptr<EventSink> event_sink_;
+
+  // Set when the default on_event() has written events into the sink.
+  mutable std::atomic_bool event_sink_used_{false};
+
+  std::shared_ptr<RunnerScheduler> scheduler_;
+
+  std::shared_ptr<DiscoveryCache> discovery_cache_;
+
+  // Only valid while run() is running and we are submitting measurements.
+  SubmissionQueue *submission_queue_ = nullptr;
+
+  // Only valid while run() is running and Settings::spool_path is set.
+  Spool *spool_ = nullptr;
+
+  // Only valid while run() is running with adaptive parallelism.
+  ConcurrencyController *concurrency_ = nullptr;
+
+  // Only valid while run() is running the nettest workers.
+  DeadlineScheduler *deadline_ = nullptr;
+
+  // Only valid while run() is using the discovered collectors.
+  EndpointSelector *collectors_ = nullptr;
+
+  // Set when run() cancels the measurements still running at the deadline.
+  std::atomic_bool deadline_expired_{false};
+
+  // Only valid while run() is running the nettest workers.
+  const std::string *measurement_template_ = nullptr;
+
+  // Tracks the refreshes of stale discovery cache entries, which run in the
+  // background. We wait for them before run() returns.
+  WaitGroup discovery_refreshes_;
+
+  Nettest &nettest_;
+
+  const Settings &settings_;
+};
+
+// Engine
+// ``````
+
+class EngineJob;
+
+// Engine is a long-lived object running many jobs concurrently. Each job runs
+// the nettest named by its settings, with its own report, events and
+// cancellation. The jobs share the worker pool, the cURL handle pool, the
+// discovery cache and the event sink of the engine, so starting a job neither
+// creates threads nor repeats the discovery, and reuses warm connections.
+// MMDB handles are already shared by all Runners (see MmdbCache). At most
+// |max_active| jobs run at the same time, in the order of submission.
+class Engine {
+ public:
+  // NettestFactory returns a new instance of the nettest called |name|, or
+  // nullptr if there is no such nettest.
+  using NettestFactory =
+      std::function<std::unique_ptr<Nettest>(const std::string &name)>;
+
+  // EventHandler receives the events of a job. It MAY be called from several
+  // threads at the same time.
+  using EventHandler = std::function<void(const nlohmann::json &event)>;
+
+  // Engine() creates an engine creating nettests with |factory| and running
+  // up to |max_active| jobs at the same time. We cache discovery results in
+  // the file at |discovery_cache_path| or, when it's empty, in memory. The
+  // events of jobs without handler go to |sink|, or EventSink::global().
+  Engine(NettestFactory factory, size_t max_active,
+         std::string discovery_cache_path,
+         std::shared_ptr<EventSink> sink) noexcept;
+
+  Engine(const Engine &) noexcept = delete;
+  Engine &operator=(const Engine &) noexcept = delete;
+  Engine(Engine &&) noexcept = delete;
+  Engine &operator=(Engine &&) noexcept = delete;
+
+  // submit() parses |settings| using parse_settings() and queues a job with
+  // them, whose events are passed to |handler|. Without handler, the events
+  // are written to the sink, with the job ID as their "job" field. Returns
+  // nullptr on failure, setting |err|. See parse_settings() for |warn|. The
+  // job ignores Settings::discovery_cache_path and uses the engine cache.
+  std::shared_ptr<EngineJob> submit(const std::string &settings,
+                                    EventHandler handler, std::string *err,
+                                    std::string *warn) noexcept;
+
+  // interrupt() interrupts all the jobs, including the queued ones.
+  void interrupt() noexcept;
+
+  // wait() blocks until all the jobs submitted so far are done.
+  void wait() noexcept;
+
+  // ~Engine() waits for all the jobs to be done.
+  ~Engine() noexcept;
+
+ private:
+  // start() starts queued jobs while fewer than max_active_ are running. The
+  // caller MUST hold mutex_.
+  void start() noexcept;
+
+  // done() is called by the task running |job| once the job is done.
+  void done(std::shared_ptr<EngineJob> job) noexcept;
+
+  std::condition_variable cond_;
+  std::shared_ptr<CurlxPool> curlx_pool_ = std::make_shared<CurlxPool>();
+  std::shared_ptr<DiscoveryCache> discovery_cache_;
+  std::shared_ptr<EventSink> event_sink_;
+  NettestFactory factory_;
+  size_t max_active_ = 1;
+  std::mutex mutex_;
+  uint64_t next_id_ = 0;
+  std::deque<std::shared_ptr<EngineJob>> queued_;
+  std::vector<std::shared_ptr<EngineJob>> running_;
+  // Never blocks since we don't start more jobs than that at the same time.
+  std::shared_ptr<RunnerScheduler> scheduler_;
+  std::shared_ptr<WorkerPool> worker_pool_ = std::make_shared<WorkerPool>();
+};
+
+// EngineJob is a job submitted to an Engine.
+class EngineJob {
+ public:
+  EngineJob(const EngineJob &) noexcept = delete;
+  EngineJob &operator=(const EngineJob &) noexcept = delete;
+  EngineJob(EngineJob &&) noexcept = delete;
+  EngineJob &operator=(EngineJob &&) noexcept = delete;
+
+  // id() returns the ID of this job, which is unique within its Engine.
+  uint64_t id() const noexcept;
+
+  // interrupt() interrupts this job (see Runner::interrupt()). A job that is
+  // interrupted while queued does not run at all. It is safe to call from
+  // any thread.
+  void interrupt() noexcept;
+
+  // done() returns whether this job is done.
+  bool done() const noexcept;
+
+  // wait() blocks until this job is done.
+  void wait() noexcept;
+
+  // metrics() returns the metrics of this job (see Runner::metrics()).
+  const RunnerMetrics &metrics() const noexcept;
+
+  ~EngineJob() noexcept;
+
+ private:
+  friend class Engine;
+
+  class JobRunner;
+
+  EngineJob() noexcept;
+
+  std::condition_variable cond_;
+  bool done_ = false;
+  Engine::EventHandler handler_;
+  uint64_t id_ = 0;
+  std::atomic_bool interrupted_{false};
+  mutable std::mutex mutex_;
+  std::unique_ptr<Nettest> nettest_;
+  Settings settings_;
+  // Declared last, such that it's destroyed before what it references.
+  std::unique_ptr<JobRunner> runner_;
+};
+
+// Implementation section
+// ``````````````````````
+// This is a single header library. In some use cases you may want to split
+// the interface and implementation using LIBNETTEST2_NO_INLINE_IMPL.
+#ifndef LIBNETTEST2_NO_INLINE_IMPL
+
+// Errors
+// ``````
+
+const char *libnettest2_strerror(Errors n) noexcept {
+#define XX(e_) case Errors::e_: return #e_;
+  switch (n) {
+    LIBNETTEST2_ENUM_OWN_ERRORS(XX)
+  }
+#undef XX
+  return "invalid_argument";
+}
+
+// JSON parsing of settings
+// ````````````````````````
+
+// describe_pointer<T> and DESCRIBE_POINTER are helpers designed to allow
+// us to tell the user the expected type of a variable.
+template <typename Type> struct describe_pointer;
+
+using StringStringMap = std::map<std::string, std::string>;
+
+#define DESCRIBE_POINTER(T, V)                   \
+  template <>                                    \
+  struct describe_pointer<T> {                   \
+    static constexpr const char *type_name = V;  \
+  }
+
+DESCRIBE_POINTER(bool, "bool");
+DESCRIBE_POINTER(StringStringMap, "std::map<std::string, std::string>");
+DESCRIBE_POINTER(std::vector<std::string>, "std::vector<std::string>");
+DESCRIBE_POINTER(std::string, "std::string");
+DESCRIBE_POINTER(uint16_t, "uint16_t");
+DESCRIBE_POINTER(uint32_t, "uint32_t");
+
+#undef DESCRIBE_POINTER  // Tidy
+
+template <typename Type>
+std::string out_of_range_error_gen(
+    const std::string &ptr, Type minimum, Type maximum) noexcept {
+  std::stringstream ss;
+  ss << "invalid_settings_error: cannot validate variable accessed using "
+     << "'" << ptr << "' because the value is out of range (The "
+     << "minimum acceptable value is " << minimum << " while the maximum "
+     << "acceptable value is " << maximum << ")";
+  return ss.str();
+}
+
+static std::string format_error_gen(const std::string &ptr) noexcept {
+  std::stringstream ss;
+  ss << "invalid_settings_error: cannot validate variable accessed using "
+     << "'" << ptr << "' because the variable should be an integer "
+     << "but you actually provided a floating point number";
+  return ss.str();
+}
+
+template <typename Type>
+std::string conversion_error_gen(const std::string &ptr,
+                                 const nlohmann::json &entry) noexcept {
+  std::stringstream ss;
+  ss << "invalid_settings_error: cannot convert variable accessed using "
+     << "'" << ptr << "' as JSON pointer from JSON type '"
+     << entry.type_name() << "' to C++ type '"
+     << describe_pointer<Type>::type_name << "'";
+  return ss.str();
+}
+
+// The settings_get() overloads convert |entry|, accessed using the |ptr|
+// JSON pointer, to the type of |value|. We check the JSON type before
+// converting, such that the conversion cannot throw.
+
+static bool settings_get(const nlohmann::json &entry, const std::string &ptr,
+                         std::string *value, std::string *err,
+                         std::string *) noexcept {
+  if (!entry.is_string()) {
+    *err = conversion_error_gen<std::string>(ptr, entry);
     return false;
   }
-  if (!doc.at("name").is_string()) {
-    *err = "invalid_settings_error: 'name' entry is not a string";
+  *value = entry.get<std::string>();
+  return true;
+}
+
+static bool settings_get(const nlohmann::json &entry, const std::string &ptr,
+                         std::vector<std::string> *value, std::string *err,
+                         std::string *) noexcept {
+  auto valid = entry.is_array();
+  for (auto it = entry.begin(); valid && it != entry.end(); ++it) {
+    valid = it->is_string();
+  }
+  if (!valid) {
+    *err = conversion_error_gen<std::vector<std::string>>(ptr, entry);
     return false;
   }
-  //
-  // MAYBE_GET allows to get a maximum-range variable. We have specific macros
-  // to take care of variables with a reduced range (e.g. uint16_t). The reason
-  // why there are such specific macros is that nlohmann::json will truncate
-  // values when casting from a wider to a smaller range. So, to avoid any kind
-  // of issue, integers can only be read with explicit macros.
-  //
-  // Additionally, for some time we'll keep a layer of backwards compatibility
-  // with which we can treat numbers as booleans. This is necessary because
-  // up until MK v0.9.0-alpha.9 we were using integers as booleans.
-  //
-#define MAYBE_GET(path, variable)                                       \
-  do {                                                                  \
-    static_assert(std::is_same<std::add_pointer<double>::type,          \
-                               decltype(variable)>::value ||            \
-                      std::is_same<std::add_pointer<                    \
-                                       std::map<std::string,            \
-                                                std::string>>::type,    \
-                                   decltype(variable)>::value ||        \
-                      std::is_same<std::add_pointer<                    \
-                                       std::vector<std::string>>::type, \
-                                   decltype(variable)>::value ||        \
-                      std::is_same<std::add_pointer<std::string>::type, \
-                                   decltype(variable)>::value,          \
-                  "MAYBE_GET() passed an invalid argument");            \
-    if (!json_maybe_get(doc, path, variable, err)) {                    \
-      return false;                                                     \
-    }                                                                   \
-  } while (0)
-  //
-  // MAYBE_GET_BOOL is a backwards compatible layer designed to allow
-  // to interpret numbers as booleans. If parsing a boolean fails, it
-  // tries to parse a double and treats the double as boolean by setting
-  // the result to false if it's 0.0 and to true otherwise.
-  //
-#define MAYBE_GET_BOOL(path, variable)                            \
-  do {                                                            \
-    static_assert(std::is_same<std::add_pointer<bool>::type,      \
-                               decltype(variable)>::value,        \
-                  "MAYBE_GET_BOOL() passed an invalid argument"); \
-    if (!json_maybe_get(doc, path, variable, err)) {              \
-      double scratch = {};                                        \
-      std::string errx;                                           \
-      if (!json_maybe_get(doc, path, &scratch, &errx)) {          \
-        return false;                                             \
-      }                                                           \
-      *err = "";  /* Forget about error, we sorted it out */      \
-      {                                                           \
-        std::stringstream ss;                                     \
-        ss << "Found number variable at '" << path << "' and "    \
-           << "treating it as boolean. This is for backward "     \
-           << "compatibility with MK <= 0.9.0-alpha.9 where we "  \
-           << "did not allow boolean variables. Change your "     \
-           << "code to use boolean to get rid of this warning. "  \
-           << "Be aware that we will remove this backward "       \
-           << "compatibility hack in the future, so change your " \
-           << "code today to avoid your app breaking sometime "   \
-           << "in the future. Please!";                           \
-        *warn = ss.str();                                         \
-      }                                                           \
-      *variable = (scratch != 0.0);                               \
-    }                                                             \
-  } while (0)
-  //
-  // MAYBE_GET_UINT8 is specifically designed for uint8_t.
-  //
-#define MAYBE_GET_UINT8(path, variable)                            \
-  do {                                                             \
-    static_assert(std::is_same<std::add_pointer<uint8_t>::type,    \
-                               decltype(variable)>::value,         \
-                  "MAYBE_GET_UINT8() passed an invalid argument"); \
-    double scratch = {};                                           \
-    if (!json_maybe_get(doc, path, &scratch, err)) {               \
-      return false;                                                \
-    }                                                              \
-    double unused = {};                                            \
-    if (modf(scratch, &unused) != 0.0) {                           \
-      *err = format_error_gen(path);                               \
-      return false;                                                \
-    }                                                              \
-    if (scratch < 0.0 || scratch > UINT8_MAX) {                    \
-      *err = out_of_range_error_gen(path, 0, UINT8_MAX);           \
-      return false;                                                \
-    }                                                              \
-    *variable = (uint8_t)scratch;                                  \
-  } while (0)
-  //
-  // MAYBE_GET_UINT16 is specifically designed for uint16_t.
-  //
-#define MAYBE_GET_UINT16(path, variable)                            \
-  do {                                                              \
-    static_assert(std::is_same<std::add_pointer<uint16_t>::type,    \
-                               decltype(variable)>::value,          \
-                  "MAYBE_GET_UINT16() passed an invalid argument"); \
-    double scratch = {};                                            \
-    if (!json_maybe_get(doc, path, &scratch, err)) {                \
-      return false;                                                 \
-    }                                                               \
-    double unused = {};                                             \
-    if (modf(scratch, &unused) != 0.0) {                            \
-      *err = format_error_gen(path);                                \
-      return false;                                                 \
-    }                                                               \
-    if (scratch < 0.0 || scratch > UINT16_MAX) {                    \
-      *err = out_of_range_error_gen(path, 0, UINT16_MAX);           \
-      return false;                                                 \
-    }                                                               \
-    *variable = (uint16_t)scratch;                                  \
-  } while (0)
-  //
-  MAYBE_GET("/annotations", &settings->annotations);
-  MAYBE_GET("/inputs", &settings->inputs);
-  MAYBE_GET("/input_filepaths", &settings->input_filepaths);
-  MAYBE_GET("/log_filepath", &settings->log_filepath);
-  {
-    std::string s;
-    MAYBE_GET("/log_level", &s);
-    if (s == "") {
-      // NOTHING
-    } else if (s == "QUIET") {
-      settings->log_level = LogLevel::log_quiet;
-    } else if (s == "ERR") {
-      settings->log_level = LogLevel::log_err;
-    } else if (s == "WARNING") {
-      settings->log_level = LogLevel::log_warning;
-    } else if (s == "INFO") {
-      settings->log_level = LogLevel::log_info;
-    } else if (s == "DEBUG") {
-      settings->log_level = LogLevel::log_debug;
-    } else if (s == "DEBUG2") {
-      settings->log_level = LogLevel::log_debug2;
-    } else {
-      std::stringstream ss;
-      ss << "invalid_settings_error: cannot convert variable accessed using "
-         << "'/log_level' as JSON pointer to a C++ enumeration containing "
-         << "one of: QUIET, ERR, WARNING, INFO, DEBUG, DEBUG2";
-      *err = ss.str();
+  *value = entry.get<std::vector<std::string>>();
+  return true;
+}
+
+static bool settings_get(const nlohmann::json &entry, const std::string &ptr,
+                         StringStringMap *value, std::string *err,
+                         std::string *) noexcept {
+  auto valid = entry.is_object();
+  for (auto it = entry.begin(); valid && it != entry.end(); ++it) {
+    valid = it->is_string();
+  }
+  if (!valid) {
+    *err = conversion_error_gen<StringStringMap>(ptr, entry);
+    return false;
+  }
+  *value = entry.get<StringStringMap>();
+  return true;
+}
+
+// For some time we'll keep a layer of backwards compatibility with which we
+// can treat numbers as booleans. This is necessary because up until MK
+// v0.9.0-alpha.9 we were using integers as booleans.
+static bool settings_get(const nlohmann::json &entry, const std::string &ptr,
+                         bool *value, std::string *err,
+                         std::string *warn) noexcept {
+  if (entry.is_boolean()) {
+    *value = entry.get<bool>();
+    return true;
+  }
+  if (!entry.is_number()) {
+    *err = conversion_error_gen<bool>(ptr, entry);
+    return false;
+  }
+  std::stringstream ss;
+  ss << "Found number variable at '" << ptr << "' and "
+     << "treating it as boolean. This is for backward "
+     << "compatibility with MK <= 0.9.0-alpha.9 where we "
+     << "did not allow boolean variables. Change your "
+     << "code to use boolean to get rid of this warning. "
+     << "Be aware that we will remove this backward "
+     << "compatibility hack in the future, so change your "
+     << "code today to avoid your app breaking sometime "
+     << "in the future. Please!";
+  *warn = ss.str();
+  *value = (entry.get<double>() != 0.0);
+  return true;
+}
+
+// Integers are read as doubles and then validated. The reason why we don't
+// convert directly is that nlohmann::json will truncate values when casting
+// from a wider to a smaller range.
+template <typename Type>
+bool settings_get_integer(const nlohmann::json &entry, const std::string &ptr,
+                          Type *value, std::string *err) noexcept {
+  if (!entry.is_number()) {
+    *err = conversion_error_gen<Type>(ptr, entry);
+    return false;
+  }
+  auto scratch = entry.get<double>();
+  double unused = {};
+  if (modf(scratch, &unused) != 0.0) {
+    *err = format_error_gen(ptr);
+    return false;
+  }
+  constexpr auto maximum = std::numeric_limits<Type>::max();
+  if (scratch < 0.0 || scratch > maximum) {
+    *err = out_of_range_error_gen<uint64_t>(ptr, 0, maximum);
+    return false;
+  }
+  *value = (Type)scratch;
+  return true;
+}
+
+static bool settings_get(const nlohmann::json &entry, const std::string &ptr,
+                         uint16_t *value, std::string *err,
+                         std::string *) noexcept {
+  return settings_get_integer(entry, ptr, value, err);
+}
+
+static bool settings_get(const nlohmann::json &entry, const std::string &ptr,
+                         uint32_t *value, std::string *err,
+                         std::string *) noexcept {
+  return settings_get_integer(entry, ptr, value, err);
+}
+
+// Note: the user passes us a string and we map such string into the
+// values of the LogLevel enumeration.
+static bool settings_get(const nlohmann::json &entry, const std::string &ptr,
+                         LogLevel *value, std::string *err,
+                         std::string *warn) noexcept {
+  std::string s;
+  if (!settings_get(entry, ptr, &s, err, warn)) {
+    return false;
+  }
+  if (s == "") {
+    // NOTHING
+  } else if (s == "QUIET") {
+    *value = LogLevel::log_quiet;
+  } else if (s == "ERR") {
+    *value = LogLevel::log_err;
+  } else if (s == "WARNING") {
+    *value = LogLevel::log_warning;
+  } else if (s == "INFO") {
+    *value = LogLevel::log_info;
+  } else if (s == "DEBUG") {
+    *value = LogLevel::log_debug;
+  } else if (s == "DEBUG2") {
+    *value = LogLevel::log_debug2;
+  } else {
+    std::stringstream ss;
+    ss << "invalid_settings_error: cannot convert variable accessed using "
+       << "'" << ptr << "' as JSON pointer to a C++ enumeration containing "
+       << "one of: QUIET, ERR, WARNING, INFO, DEBUG, DEBUG2";
+    *err = ss.str();
+    return false;
+  }
+  return true;
+}
+
+template <typename Type, Type Settings::*member>
+bool parse_settings_field(const nlohmann::json &entry, const std::string &ptr,
+                          Settings *settings, std::string *err,
+                          std::string *warn) noexcept {
+  return settings_get(entry, ptr, &(settings->*member), err, warn);
+}
+
+template <typename Type, Type Settings::*member>
+void dump_settings_field(const Settings &settings,
+                         nlohmann::json *entry) noexcept {
+  *entry = settings.*member;
+}
+
+// SettingsField describes the field of Settings called |name| in JSON. We use
+// |parse| to set the field and, for the options, |dump| to get its value. If
+// |in_options| is true, the field is saved into the options of measurements,
+// which happens when it has not the default value. We don't save the fields
+// that could identify the user or that are only meaningful on the device.
+class SettingsField {
+ public:
+  const char *name;
+  bool (*parse)(const nlohmann::json &entry, const std::string &ptr,
+                Settings *settings, std::string *err, std::string *warn);
+  void (*dump)(const Settings &settings, nlohmann::json *entry);
+  bool in_options;
+};
+
+#define XX(name)                                                         \
+  SettingsField {                                                        \
+    #name, &parse_settings_field<decltype(Settings::name), &Settings::name>, \
+        nullptr, false                                                   \
+  }
+
+// The fields at the top level of the JSON, sorted by name.
+static constexpr SettingsField settings_fields[] = {
+    XX(annotations),
+    XX(input_filepaths),
+    XX(inputs),
+    XX(log_filepath),
+    XX(log_level),
+    XX(name),
+    XX(output_filepath),
+};
+
+#undef XX
+#define XX(name, in_options)                                             \
+  SettingsField {                                                        \
+    #name, &parse_settings_field<decltype(Settings::name), &Settings::name>, \
+        &dump_settings_field<decltype(Settings::name), &Settings::name>, \
+        in_options                                                       \
+  }
+
+// The fields inside the 'options' sub-dictionary, sorted by name.
+static constexpr SettingsField settings_option_fields[] = {
+    XX(adaptive_parallelism, true),
+    XX(all_endpoints, true),
+    XX(bouncer_base_url, true),
+    XX(ca_bundle_path, false),
+    XX(collector_base_url, true),
+    XX(discovery_cache_path, false),
+    XX(discovery_cache_ttl, true),
+    XX(engine_name, false),
+    XX(engine_version, false),
+    XX(engine_version_full, false),
+    XX(geoip_asn_path, false),
+    XX(geoip_country_path, false),
+    XX(http_compression, true),
+    XX(input_seed, true),
+    XX(max_runtime, true),
+    XX(metrics_interval, true),
+    XX(no_asn_lookup, true),
+    XX(no_bouncer, true),
+    XX(no_cc_lookup, true),
+    XX(no_collector, true),
+    XX(no_file_report, true),
+    XX(no_ip_lookup, true),
+    XX(no_resolver_lookup, true),
+    XX(parallelism, true),
+    XX(platform, false),
+    XX(port, true),
+    XX(probe_asn, false),
+    XX(probe_cc, false),
+    XX(probe_ip, false),
+    XX(probe_network_name, false),
+    XX(randomize_input, true),
+    XX(save_real_probe_asn, true),
+    XX(save_real_probe_cc, true),
+    XX(save_real_probe_ip, true),
+    XX(save_real_resolver_ip, true),
+    XX(server, true),
+    XX(shard_count, true),
+    XX(shard_index, true),
+    XX(software_name, false),
+    XX(software_version, false),
+    XX(spool_path, false),
+    XX(submission_batch_size, true),
+    XX(submission_batch_timeout, true),
+};
+
+#undef XX
+
+static constexpr bool settings_name_less(const char *a,
+                                         const char *b) noexcept {
+  return (*a == *b) ? (*a != '\0' && settings_name_less(a + 1, b + 1))
+                    : ((unsigned char)*a < (unsigned char)*b);
+}
+
+static constexpr bool settings_fields_sorted(const SettingsField *fields,
+                                             size_t count) noexcept {
+  return count < 2 || (settings_name_less(fields[0].name, fields[1].name) &&
+                       settings_fields_sorted(fields + 1, count - 1));
+}
+
+static_assert(settings_fields_sorted(
+                  settings_fields,
+                  sizeof(settings_fields) / sizeof(settings_fields[0])),
+              "settings_fields is not sorted");
+static_assert(settings_fields_sorted(
+                  settings_option_fields,
+                  sizeof(settings_option_fields) /
+                      sizeof(settings_option_fields[0])),
+              "settings_option_fields is not sorted");
+
+// find_settings_field() returns the field called |name| among the |count|
+// |fields|, or nullptr if there is no such field.
+static const SettingsField *find_settings_field(const SettingsField *fields,
+                                                size_t count,
+                                                const std::string &name) noexcept {
+  auto end = fields + count;
+  auto it = std::lower_bound(
+      fields, end, name, [](const SettingsField &field, const std::string &s) {
+        return strcmp(field.name, s.c_str()) < 0;
+      });
+  return (it != end && name == it->name) ? it : nullptr;
+}
+
+// parse_settings_fields() parses all the keys of |object| that are |fields|
+// into |settings|, in a single pass. Keys that are not fields are ignored.
+static bool parse_settings_fields(const nlohmann::json &object,
+                                  const std::string &prefix,
+                                  const SettingsField *fields, size_t count,
+                                  Settings *settings, std::string *err,
+                                  std::string *warn) noexcept {
+  for (auto it = object.begin(); it != object.end(); ++it) {
+    auto field = find_settings_field(fields, count, it.key());
+    if (field == nullptr) continue;
+    if (!field->parse(it.value(), prefix + it.key(), settings, err, warn)) {
       return false;
     }
   }
-  MAYBE_GET("/name", &settings->name);
-  MAYBE_GET("/output_filepath", &settings->output_filepath);
-  //
-  MAYBE_GET_BOOL("/options/all_endpoints", &settings->all_endpoints);
-  MAYBE_GET("/options/bouncer_base_url", &settings->bouncer_base_url);
-  MAYBE_GET("/options/ca_bundle_path", &settings->ca_bundle_path);
-  MAYBE_GET("/options/collector_base_url", &settings->collector_base_url);
-  MAYBE_GET("/options/engine_name", &settings->engine_name);
-  MAYBE_GET("/options/engine_version", &settings->engine_version);
-  MAYBE_GET("/options/engine_version_full", &settings->engine_version_full);
-  MAYBE_GET("/options/geoip_asn_path", &settings->geoip_asn_path);
-  MAYBE_GET("/options/geoip_country_path", &settings->geoip_country_path);
-  MAYBE_GET_UINT16("/options/max_runtime", &settings->max_runtime);
-  MAYBE_GET_BOOL("/options/no_asn_lookup", &settings->no_asn_lookup);
-  MAYBE_GET_BOOL("/options/no_bouncer", &settings->no_bouncer);
-  MAYBE_GET_BOOL("/options/no_cc_lookup", &settings->no_cc_lookup);
-  MAYBE_GET_BOOL("/options/no_collector", &settings->no_collector);
-  MAYBE_GET_BOOL("/options/no_file_report", &settings->no_file_report);
-  MAYBE_GET_BOOL("/options/no_ip_lookup", &settings->no_ip_lookup);
-  MAYBE_GET_BOOL("/options/no_resolver_lookup", &settings->no_resolver_lookup);
-  MAYBE_GET_UINT8("/options/parallelism", &settings->parallelism);
-  MAYBE_GET("/options/platform", &settings->platform);
-  MAYBE_GET_UINT16("/options/port", &settings->port);
-  MAYBE_GET("/options/probe_ip", &settings->probe_ip);
-  MAYBE_GET("/options/probe_asn", &settings->probe_asn);
-  MAYBE_GET("/options/probe_network_name", &settings->probe_network_name);
-  MAYBE_GET("/options/probe_cc", &settings->probe_cc);
-  MAYBE_GET_BOOL("/options/randomize_input", &settings->randomize_input);
-  MAYBE_GET_BOOL("/options/save_real_probe_asn", &settings->save_real_probe_asn);
-  MAYBE_GET_BOOL("/options/save_real_probe_ip", &settings->save_real_probe_ip);
-  MAYBE_GET_BOOL("/options/save_real_probe_cc", &settings->save_real_probe_cc);
-  MAYBE_GET_BOOL("/options/save_real_resolver_ip", &settings->save_real_resolver_ip);
-  MAYBE_GET("/options/server", &settings->server);
-  MAYBE_GET("/options/software_name", &settings->software_name);
-  MAYBE_GET("/options/software_version", &settings->software_version);
-#undef MAYBE_GET
-#undef MAYBE_GET_UINT8
-#undef MAYBE_GET_UINT16
   return true;
 }
 
+bool parse_settings(std::string str, Settings *settings,
+                    std::string *err, std::string *warn) noexcept {
+  if (settings == nullptr || err == nullptr) {
+    return false;
+  }
+  // Note: warn is currently only used by the feature allowing a app to pass
+  // us a number to be treated like a boolean value.
+  if (warn == nullptr) {
+    return false;
+  }
+  nlohmann::json doc;
+  try {
+    doc = nlohmann::json::parse(str);
+  } catch (const std::exception &) {
+    *err = "json_parse_error";
+    return false;
+  }
+  if (!doc.is_object()) {
+    *err = "invalid_settings_error: JSON document is not an object";
+    return false;
+  }
+  auto options = doc.find("options");
+  if (options == doc.end()) {
+    *err = "invalid_settings_error: missing 'options' entry";
+    return false;
+  }
+  if (!options->is_object()) {
+    *err = "invalid_settings_error: 'options' entry is not an object";
+    return false;
+  }
+  auto name = doc.find("name");
+  if (name == doc.end()) {
+    *err = "invalid_settings_error: missing 'name' entry";
+    return false;
+  }
+  if (!name->is_string()) {
+    *err = "invalid_settings_error: 'name' entry is not a string";
+    return false;
+  }
+  // Note: the fields that are not in the JSON keep their current value.
+  if (!parse_settings_fields(
+          doc, "/", settings_fields,
+          sizeof(settings_fields) / sizeof(settings_fields[0]), settings,
+          err, warn) ||
+      !parse_settings_fields(
+          *options, "/options/", settings_option_fields,
+          sizeof(settings_option_fields) / sizeof(settings_option_fields[0]),
+          settings, err, warn)) {
+    return false;
+  }
+  // We check the shards once we have parsed both fields, since they may
+  // appear in any order. Note that zero and one both mean no sharding.
+  if (settings->shard_count > 1 &&
+      settings->shard_index >= settings->shard_count) {
+    *err = out_of_range_error_gen<uint64_t>(
+        "/options/shard_index", 0, settings->shard_count - 1);
+    return false;
+  }
+  return true;
+}
+
+// settings_to_options() returns the options of the measurement, i.e. the
+// fields of |settings| for which SettingsField::in_options is true and whose
+// value is not the default one, as "<name>=<JSON value>" strings.
+static nlohmann::json settings_to_options(const Settings &settings) noexcept {
+  nlohmann::json options = nlohmann::json::array();
+  Settings defaults;
+  for (auto &field : settings_option_fields) {
+    if (!field.in_options) continue;
+    nlohmann::json value;
+    nlohmann::json default_value;
+    field.dump(settings, &value);
+    field.dump(defaults, &default_value);
+    if (value != default_value) {
+      options.push_back(std::string{field.name} + "=" + value.dump());
+    }
+  }
+  return options;
+}
+
+// Random numbers
+// ``````````````
+
+// random_engine() returns a per-thread engine seeded from std::random_device,
+// so that we don't need to access the system CSPRNG every time we need a
+// random number. The numbers are used to shuffle inputs and to generate the
+// measurement IDs, neither of which needs to be unpredictable.
+static std::mt19937_64 &random_engine() noexcept {
+  class SeededEngine {
+   public:
+    SeededEngine() noexcept {
+      std::random_device random_device;
+      std::seed_seq seed{random_device(), random_device(), random_device(),
+                         random_device(), random_device(), random_device(),
+                         random_device(), random_device()};
+      engine.seed(seed);
+    }
+    std::mt19937_64 engine;
+  };
+  static thread_local SeededEngine seeded;
+  return seeded.engine;
+}
+
 // UUID4 code
 // ``````````
 // Derivative work of r-lyeh/sole@c61c49f10d. We include this code inline
-// because we don't need this code in other parts of MK.
+// because we don't need this code in other parts of MK. Altered to use the
+// per-thread random_engine() and a table based formatter.
 /*-
  * Portions Copyright (c) 2015 r-lyeh (https://github.com/r-lyeh)
  *
@@ -721,39 +2316,41 @@ namespace sole {
 
 class uuid {
   public:
+    static constexpr size_t str_size = 36;
     std::string str();
+    void str(char *buf);  // Writes exactly str_size chars
     uint64_t ab;
     uint64_t cd;
 };
 
 uuid uuid4();
 
-std::string uuid::str() {
-  std::stringstream ss;
-  ss << std::hex << std::nouppercase << std::setfill('0');
-
-  uint32_t a = (ab >> 32);
-  uint32_t b = (ab & 0xFFFFFFFF);
-  uint32_t c = (cd >> 32);
-  uint32_t d = (cd & 0xFFFFFFFF);
-
-  ss << std::setw(8) << (a) << '-';
-  ss << std::setw(4) << (b >> 16) << '-';
-  ss << std::setw(4) << (b & 0xFFFF) << '-';
-  ss << std::setw(4) << (c >> 16) << '-';
-  ss << std::setw(4) << (c & 0xFFFF);
-  ss << std::setw(8) << d;
+void uuid::str(char *buf) {
+  static const char digits[] = "0123456789abcdef";
+  // Format is 8-4-4-4-12 hex digits, most significant first.
+  size_t pos = 0;
+  for (int nibble = 0; nibble < 32; ++nibble) {
+    if (nibble == 8 || nibble == 12 || nibble == 16 || nibble == 20) {
+      buf[pos++] = '-';
+    }
+    uint64_t word = (nibble < 16) ? ab : cd;
+    int shift = 60 - 4 * (nibble % 16);
+    buf[pos++] = digits[(word >> shift) & 0xF];
+  }
+}
 
-  return ss.str();
+std::string uuid::str() {
+  char buf[str_size];
+  str(buf);
+  return std::string(buf, str_size);
 }
 
 uuid uuid4() {
-  std::random_device rd;
-  std::uniform_int_distribution<uint64_t> dist(0, (uint64_t)(~0));
+  auto &engine = random_engine();
   uuid my;
 
-  my.ab = dist(rd);
-  my.cd = dist(rd);
+  my.ab = engine();
+  my.cd = engine();
 
   /* The version 4 UUID is meant for generating UUIDs from truly-random or
      pseudo-random numbers.
@@ -774,124 +2371,913 @@ uuid uuid4() {
   my.ab = (my.ab & 0xFFFFFFFFFFFF0FFFULL) | 0x0000000000004000ULL;
   my.cd = (my.cd & 0x3FFFFFFFFFFFFFFFULL) | 0x8000000000000000ULL;
 
-  return my;
+  return my;
+}
+
+}  // namespace sole
+
+/*
+ * Guess the platform in which we are.
+ *
+ * See: <https://sourceforge.net/p/predef/wiki/OperatingSystems/>
+ *      <http://stackoverflow.com/a/18729350>
+ */
+#if defined __ANDROID__
+#  define LIBNETTEST2_PLATFORM "android"
+#elif defined __linux__
+#  define LIBNETTEST2_PLATFORM "linux"
+#elif defined _WIN32
+#  define LIBNETTEST2_PLATFORM "windows"
+#elif defined __APPLE__
+#  include <TargetConditionals.h>
+#  if TARGET_OS_IPHONE
+#    define LIBNETTEST2_PLATFORM "ios"
+#  else
+#    define LIBNETTEST2_PLATFORM "macos"
+#  endif
+#else
+#  define LIBNETTEST2_PLATFORM "unknown"
+#endif
+
+#define LIBNETTEST2_EMIT_LOG(self, level, uppercase_level, statements) \
+  do {                                                                 \
+    if (self->get_log_level() >= LogLevel::log_##level) {              \
+      std::stringstream ss;                                            \
+      ss << "libnettest2: " << statements;                             \
+      auto message = ss.str();                                         \
+      Event event;                                                     \
+      event.id = EventId::log;                                         \
+      event.log_level = LogLevel::log_##level;                         \
+      event.message = &message;                                        \
+      self->emit_typed_ev(event);                                      \
+    }                                                                  \
+  } while (0)
+
+#define LIBNETTEST2_EMIT_WARNING_EX(self, statements) \
+  LIBNETTEST2_EMIT_LOG(self, warning, WARNING, statements)
+
+#define LIBNETTEST2_EMIT_INFO_EX(self, statements) \
+  LIBNETTEST2_EMIT_LOG(self, info, INFO, statements)
+
+#define LIBNETTEST2_EMIT_DEBUG_EX(self, statements) \
+  LIBNETTEST2_EMIT_LOG(self, debug, DEBUG, statements)
+
+#define LIBNETTEST2_EMIT_WARNING(statements) \
+  LIBNETTEST2_EMIT_WARNING_EX(this, statements)
+
+#define LIBNETTEST2_EMIT_INFO(statements) \
+  LIBNETTEST2_EMIT_INFO_EX(this, statements)
+
+#define LIBNETTEST2_EMIT_DEBUG(statements) \
+  LIBNETTEST2_EMIT_DEBUG_EX(this, statements)
+
+// Nettest
+// ```````
+
+std::string Nettest::name() const noexcept { return ""; }
+
+std::vector<std::string> Nettest::test_helpers() const noexcept { return {}; }
+
+std::string Nettest::version() const noexcept { return "0.0.1"; }
+
+bool Nettest::needs_input() const noexcept { return false; }
+
+bool Nettest::run(const Settings &, const NettestContext &context,
+                  std::string, nlohmann::json *, BytesInfo *) noexcept {
+  // Do nothing for two seconds, for testing
+  return context.cancellation->wait_for(std::chrono::seconds(2));
+}
+
+Nettest::~Nettest() noexcept {}
+
+// Byte accounting
+// ```````````````
+
+const char *bytes_category_name(BytesCategory category) noexcept {
+  switch (category) {
+    case BytesCategory::bouncer: return "bouncer";
+    case BytesCategory::geoip: return "geoip";
+    case BytesCategory::collector: return "collector";
+    case BytesCategory::nettest: return "nettest";
+  }
+  return "invalid_category";
+}
+
+static_assert(sizeof(BytesInfo) * num_bytes_categories <= cache_line_size,
+              "A slot of BytesCounters does not fit into a cache line");
+
+BytesCounters::BytesCounters(size_t slots) noexcept
+    : slots_{std::max<size_t>(slots, 1)} {
+  // We allocate an extra cache line such that we can align the slots.
+  storage_ = new char[(slots_ + 1) * cache_line_size];
+  auto misalignment = (uintptr_t)storage_ % cache_line_size;
+  base_ = storage_ + ((misalignment != 0) ? cache_line_size - misalignment : 0);
+  for (size_t k = 0; k < slots_ * num_bytes_categories; ++k) {
+    new (base_ + (k / num_bytes_categories) * cache_line_size +
+         (k % num_bytes_categories) * sizeof(BytesInfo)) BytesInfo{};
+  }
+}
+
+BytesCounters::~BytesCounters() noexcept {
+  for (size_t k = 0; k < slots_ * num_bytes_categories; ++k) {
+    get(k / num_bytes_categories, (BytesCategory)(k % num_bytes_categories))
+        ->~BytesInfo();
+  }
+  delete[] storage_;
+}
+
+BytesInfo *BytesCounters::get(size_t slot, BytesCategory category) noexcept {
+  return const_cast<BytesInfo *>(at(slot, category));
+}
+
+size_t BytesCounters::slots() const noexcept { return slots_; }
+
+uint64_t BytesCounters::bytes_down(BytesCategory category) const noexcept {
+  uint64_t total = 0;
+  for (size_t slot = 0; slot < slots_; ++slot) {
+    total += at(slot, category)->bytes_down.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+uint64_t BytesCounters::bytes_up(BytesCategory category) const noexcept {
+  uint64_t total = 0;
+  for (size_t slot = 0; slot < slots_; ++slot) {
+    total += at(slot, category)->bytes_up.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+uint64_t BytesCounters::total_down() const noexcept {
+  uint64_t total = 0;
+  for (size_t k = 0; k < num_bytes_categories; ++k) {
+    total += bytes_down((BytesCategory)k);
+  }
+  return total;
+}
+
+uint64_t BytesCounters::total_up() const noexcept {
+  uint64_t total = 0;
+  for (size_t k = 0; k < num_bytes_categories; ++k) {
+    total += bytes_up((BytesCategory)k);
+  }
+  return total;
+}
+
+const BytesInfo *BytesCounters::at(size_t slot, BytesCategory category) const
+    noexcept {
+  return reinterpret_cast<const BytesInfo *>(
+      base_ + (slot % slots_) * cache_line_size +
+      (size_t)category * sizeof(BytesInfo));
+}
+
+// Cancellation
+// ````````````
+
+void CancellationToken::cancel() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  cancelled_ = true;
+  cond_.notify_all();
+}
+
+bool CancellationToken::cancelled() const noexcept { return cancelled_; }
+
+bool CancellationToken::wait_for(std::chrono::milliseconds timeout) noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  return !cond_.wait_for(lock, timeout, [this]() { return cancelled_.load(); });
+}
+
+// Input sources
+// `````````````
+
+bool InputSource::next_with_position(std::string *input,
+                                     uint64_t *position) noexcept {
+  if (input == nullptr || position == nullptr) return false;
+  std::unique_lock<std::mutex> _{position_mutex_};
+  if (!next(input)) return false;
+  *position = position_++;
+  return true;
+}
+
+InputSource::~InputSource() noexcept {}
+
+// Note: we don't use std::shuffle() and std::uniform_int_distribution because
+// their results depend on the standard library implementation, while a seeded
+// mt19937_64 produces the same numbers everywhere.
+static size_t random_index(std::mt19937_64 *engine, size_t size) noexcept {
+  assert(size > 0);
+  return (size_t)((*engine)() % size);
+}
+
+VectorInputSource::VectorInputSource(const std::vector<std::string> &inputs,
+                                     bool randomize) noexcept
+    : VectorInputSource{inputs, randomize, 0, 0, 1} {}
+
+VectorInputSource::VectorInputSource(const std::vector<std::string> &inputs,
+                                     bool randomize, uint32_t seed,
+                                     uint32_t shard_index,
+                                     uint32_t shard_count) noexcept
+    : inputs_{inputs} {
+  if (shard_count > 1) {
+    for (size_t i = shard_index; i < inputs_.size(); i += shard_count) {
+      order_.push_back(i);
+    }
+    // Note: order_ being empty here would mean producing all the inputs.
+    if (order_.empty()) next_ = inputs_.size();
+  } else if (randomize) {
+    order_.resize(inputs_.size());
+    for (size_t i = 0; i < order_.size(); ++i) {
+      order_[i] = i;
+    }
+  }
+  if (randomize && order_.size() > 1) {
+    std::mt19937_64 engine{(seed != 0) ? seed : random_engine()()};
+    for (size_t i = order_.size() - 1; i > 0; --i) {
+      std::swap(order_[i], order_[random_index(&engine, i + 1)]);
+    }
+  }
+}
+
+bool VectorInputSource::next(std::string *input) noexcept {
+  uint64_t position = 0;
+  return next_with_position(input, &position);
+}
+
+bool VectorInputSource::next_with_position(std::string *input,
+                                           uint64_t *position) noexcept {
+  if (input == nullptr || position == nullptr) return false;
+  // We claim the next position using fetch_add() rather than a lock, which
+  // pairs the input with its position. The vectors are not modified after
+  // construction, so relaxed ordering is enough.
+  auto pos = next_.fetch_add(1, std::memory_order_relaxed);
+  if (pos >= (order_.empty() ? inputs_.size() : order_.size())) return false;
+  *input = inputs_[order_.empty() ? (size_t)pos : order_[(size_t)pos]];
+  *position = pos;
+  return true;
+}
+
+FileInputSource::FileInputSource(std::vector<std::string> paths) noexcept
+    : paths_{std::move(paths)} {}
+
+bool FileInputSource::next(std::string *input) noexcept {
+  if (input == nullptr) return false;
+  std::unique_lock<std::mutex> _{mutex_};
+  for (;;) {
+    if (file_.is_open() && std::getline(file_, *input)) {
+      if (!input->empty() && input->back() == '\r') {
+        input->pop_back();  // Files written on Windows
+      }
+      if (input->empty()) continue;
+      return true;
+    }
+    if (next_path_ >= paths_.size()) return false;
+    file_.close();
+    file_.clear();
+    file_.open(paths_[next_path_++]);
+  }
+}
+
+FunctionInputSource::FunctionInputSource(
+    std::function<bool(std::string *)> &&func) noexcept
+    : func_{std::move(func)} {}
+
+bool FunctionInputSource::next(std::string *input) noexcept {
+  if (input == nullptr) return false;
+  std::unique_lock<std::mutex> _{mutex_};
+  if (!done_ && !func_(input)) {
+    done_ = true;  // Don't call func_ again after it returned false
+  }
+  return !done_;
+}
+
+ChainInputSource::ChainInputSource(
+    std::vector<std::unique_ptr<InputSource>> &&sources) noexcept
+    : sources_{std::move(sources)} {}
+
+bool ChainInputSource::next(std::string *input) noexcept {
+  if (input == nullptr) return false;
+  std::unique_lock<std::mutex> _{mutex_};
+  for (; current_ < sources_.size(); ++current_) {
+    if (sources_[current_]->next(input)) return true;
+  }
+  return false;
+}
+
+ShardInputSource::ShardInputSource(std::unique_ptr<InputSource> &&source,
+                                   uint32_t shard_index, uint32_t shard_count,
+                                   uint64_t first_position) noexcept
+    : position_{first_position},
+      shard_count_{std::max<uint32_t>(shard_count, 1)},
+      shard_index_{shard_index},
+      source_{std::move(source)} {}
+
+bool ShardInputSource::next(std::string *input) noexcept {
+  if (input == nullptr) return false;
+  std::unique_lock<std::mutex> _{mutex_};
+  while (source_->next(input)) {
+    if (position_++ % shard_count_ == shard_index_) return true;
+  }
+  return false;
+}
+
+ShuffleInputSource::ShuffleInputSource(std::unique_ptr<InputSource> &&source,
+                                       size_t capacity) noexcept
+    : ShuffleInputSource{std::move(source), capacity, 0} {}
+
+ShuffleInputSource::ShuffleInputSource(std::unique_ptr<InputSource> &&source,
+                                       size_t capacity, uint32_t seed) noexcept
+    : capacity_{std::max<size_t>(capacity, 1)},
+      engine_{(seed != 0) ? seed : random_engine()()},
+      source_{std::move(source)} {}
+
+bool ShuffleInputSource::next(std::string *input) noexcept {
+  if (input == nullptr) return false;
+  std::unique_lock<std::mutex> _{mutex_};
+  if (!filled_) {
+    std::string entry;
+    while (buffer_.size() < capacity_ && source_->next(&entry)) {
+      buffer_.push_back(std::move(entry));
+    }
+    filled_ = true;
+  }
+  if (buffer_.empty()) return false;
+  auto &slot = buffer_[random_index(&engine_, buffer_.size())];
+  *input = std::move(slot);
+  if (!source_->next(&slot)) {
+    // The source is exhausted, so the buffer shrinks by one.
+    if (&slot != &buffer_.back()) {
+      slot = std::move(buffer_.back());
+    }
+    buffer_.pop_back();
+  }
+  return true;
+}
+
+// Runner API
+// ``````````
+
+Runner::Runner(const Settings &settings, Nettest &nettest) noexcept
+    : nettest_{nettest}, settings_{settings} {}
+
+Runner::~Runner() noexcept {}
+
+// Worker pool
+// ```````````
+
+void WaitGroup::add(size_t count) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  count_ += count;
+}
+
+void WaitGroup::done() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  assert(count_ > 0);
+  if (--count_ == 0) {
+    cond_.notify_all();
+  }
+}
+
+void WaitGroup::wait() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  cond_.wait(lock, [this]() { return count_ == 0; });
+}
+
+bool WaitGroup::wait_for(std::chrono::milliseconds timeout) noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  return cond_.wait_for(lock, timeout, [this]() { return count_ == 0; });
+}
+
+WorkerPool::WorkerPool() noexcept {}
+
+WorkerPool::~WorkerPool() noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    stop_ = true;
+    cond_.notify_all();
+  }
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+  for (auto &thread : exited_) {
+    thread.join();
+  }
+}
+
+void WorkerPool::submit(std::function<void()> &&task) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  // The threads that exited released the lock for good, so they don't block
+  // us for long here.
+  for (auto &thread : exited_) {
+    thread.join();
+  }
+  exited_.clear();
+  tasks_.push_back(std::move(task));
+  if (idle_ < tasks_.size()) {
+    try {
+      threads_.push_back(std::thread{[this]() noexcept { loop(); }});
+      // Account for the new thread as idle right away, otherwise we would
+      // create another thread if submit() is called before it starts running.
+      idle_ += 1;
+    } catch (const std::system_error &) {
+      // The system refuses more threads: the task stays queued until one
+      // of the existing threads is free.
+    }
+  }
+  cond_.notify_one();
+}
+
+void WorkerPool::loop() noexcept {
+  // Threads idle for this long exit, so the pool shrinks after a burst.
+  constexpr std::chrono::seconds idle_timeout{30};
+  std::unique_lock<std::mutex> lock{mutex_};
+  for (;;) {
+    if (!cond_.wait_for(lock, idle_timeout,
+                        [this]() { return stop_ || !tasks_.empty(); })) {
+      // The thread cannot join itself, so it leaves that to others.
+      auto self = std::find_if(
+          threads_.begin(), threads_.end(), [](const std::thread &thread) {
+            return thread.get_id() == std::this_thread::get_id();
+          });
+      if (self != threads_.end()) {
+        exited_.push_back(std::move(*self));
+        threads_.erase(self);
+      }
+      idle_ -= 1;
+      break;
+    }
+    if (tasks_.empty()) break;  // Implies stop_
+    auto task = std::move(tasks_.front());
+    tasks_.pop_front();
+    idle_ -= 1;
+    lock.unlock();
+    task();
+    lock.lock();
+    idle_ += 1;
+  }
+}
+
+// Adaptive parallelism
+// ````````````````````
+
+ConcurrencyController::ConcurrencyController(
+    size_t initial, size_t maximum) noexcept
+    : maximum_{std::max<size_t>(maximum, 1)} {
+  limit_ = std::min(std::max<size_t>(initial, 1), maximum_);
+}
+
+void ConcurrencyController::acquire() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  cond_.wait(lock, [this]() { return in_flight_ < limit_; });
+  in_flight_ += 1;
+}
+
+void ConcurrencyController::release() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  assert(in_flight_ > 0);
+  in_flight_ -= 1;
+  cond_.notify_one();
+}
+
+bool ConcurrencyController::update(double runtime, bool success) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  samples_ += 1;
+  total_runtime_ += runtime;
+  errors_ += (success) ? 0 : 1;
+  if (samples_ < limit_) {
+    return false;  // The current round is not complete yet
+  }
+  auto mean_runtime = total_runtime_ / samples_;
+  auto error_rate = (double)errors_ / samples_;
+  samples_ = 0;
+  total_runtime_ = 0.0;
+  errors_ = 0;
+  // A round is degraded if it's 50% slower than the best round, or if it
+  // has an error rate at least ten percentage points worse.
+  constexpr double runtime_tolerance = 1.5;
+  constexpr double error_rate_tolerance = 0.1;
+  auto degraded = best_runtime_ > 0.0 &&
+                  (mean_runtime > best_runtime_ * runtime_tolerance ||
+                   error_rate > best_error_rate_ + error_rate_tolerance);
+  if (best_runtime_ <= 0.0 || mean_runtime < best_runtime_) {
+    best_runtime_ = mean_runtime;
+  }
+  best_error_rate_ = std::min(best_error_rate_, error_rate);
+  auto old_limit = limit_;
+  if (degraded) {
+    limit_ = std::max<size_t>(limit_ / 2, 1);
+  } else if (limit_ < maximum_) {
+    limit_ += 1;
+    cond_.notify_all();
+  }
+  return limit_ != old_limit;
+}
+
+size_t ConcurrencyController::limit() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return limit_;
+}
+
+DeadlineScheduler::DeadlineScheduler(
+    std::chrono::steady_clock::time_point begin, double budget) noexcept
+    : deadline_{begin + std::chrono::duration_cast<
+                            std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>{budget})} {}
+
+bool DeadlineScheduler::admit() noexcept {
+  std::chrono::duration<double> remaining =
+      deadline_ - std::chrono::steady_clock::now();
+  auto expected = estimate();
+  return remaining.count() > 0.0 && remaining.count() >= expected;
+}
+
+void DeadlineScheduler::update(double runtime) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  // Same gains as RFC 6298, i.e. alpha = 1/8 and beta = 1/4.
+  constexpr double alpha = 0.125;
+  constexpr double beta = 0.25;
+  if (samples_++ == 0) {
+    mean_ = runtime;
+    deviation_ = runtime / 2.0;
+    return;
+  }
+  deviation_ += beta * (fabs(mean_ - runtime) - deviation_);
+  mean_ += alpha * (runtime - mean_);
+}
+
+double DeadlineScheduler::estimate() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return mean_ + 2.0 * deviation_;
+}
+
+std::chrono::steady_clock::time_point DeadlineScheduler::deadline() const
+    noexcept {
+  return deadline_;
+}
+
+// Metrics
+// ```````
+
+void LatencyHistogram::record(double seconds) noexcept {
+  auto us = (seconds > 0.0) ? (uint64_t)(seconds * 1000000.0) : 0;
+  size_t bucket = 0;
+  while (bucket < latency_histogram_buckets - 1 &&
+         us > ((uint64_t)1 << bucket)) {
+    bucket += 1;
+  }
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  sum_us_.fetch_add(us, std::memory_order_relaxed);
+  auto max = max_us_.load(std::memory_order_relaxed);
+  while (us > max && !max_us_.compare_exchange_weak(
+                         max, us, std::memory_order_relaxed)) {
+    // Retry with the value written by another thread
+  }
+  // We increment the count last, such that readers seeing it also see most
+  // recorded latencies, although we don't need them to be exact.
+  count_.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t LatencyHistogram::count() const noexcept {
+  return count_.load(std::memory_order_acquire);
+}
+
+double LatencyHistogram::sum() const noexcept {
+  return sum_us_.load(std::memory_order_relaxed) / 1000000.0;
 }
 
-}  // namespace sole
+double LatencyHistogram::max() const noexcept {
+  return max_us_.load(std::memory_order_relaxed) / 1000000.0;
+}
 
-/*
- * Guess the platform in which we are.
- *
- * See: <https://sourceforge.net/p/predef/wiki/OperatingSystems/>
- *      <http://stackoverflow.com/a/18729350>
- */
-#if defined __ANDROID__
-#  define LIBNETTEST2_PLATFORM "android"
-#elif defined __linux__
-#  define LIBNETTEST2_PLATFORM "linux"
-#elif defined _WIN32
-#  define LIBNETTEST2_PLATFORM "windows"
-#elif defined __APPLE__
-#  include <TargetConditionals.h>
-#  if TARGET_OS_IPHONE
-#    define LIBNETTEST2_PLATFORM "ios"
-#  else
-#    define LIBNETTEST2_PLATFORM "macos"
-#  endif
-#else
-#  define LIBNETTEST2_PLATFORM "unknown"
-#endif
+double LatencyHistogram::quantile(double q) const noexcept {
+  uint64_t counts[latency_histogram_buckets];
+  uint64_t total = 0;
+  for (size_t k = 0; k < latency_histogram_buckets; ++k) {
+    counts[k] = buckets_[k].load(std::memory_order_relaxed);
+    total += counts[k];
+  }
+  if (total == 0) return 0.0;
+  auto rank = (uint64_t)ceil(std::min(std::max(q, 0.0), 1.0) * total);
+  uint64_t seen = 0;
+  for (size_t k = 0; k < latency_histogram_buckets - 1; ++k) {
+    seen += counts[k];
+    if (seen >= rank && seen > 0) {
+      // The upper bound of the bucket cannot exceed the longest latency.
+      return std::min((double)((uint64_t)1 << k) / 1000000.0, max());
+    }
+  }
+  return max();
+}
 
-#define LIBNETTEST2_EMIT_LOG(self, level, uppercase_level, statements) \
-  do {                                                                 \
-    if (self->get_log_level() >= LogLevel::log_##level) {              \
-      std::stringstream ss;                                            \
-      ss << "libnettest2: " << statements;                             \
-      nlohmann::json value;                                            \
-      value["log_level"] = #uppercase_level;                           \
-      value["message"] = ss.str();                                     \
-      self->emit_ev("log", std::move(value));                          \
-    }                                                                  \
-  } while (0)
+const char *phase_name(Phase phase) noexcept {
+  switch (phase) {
+    case Phase::bouncer: return "bouncer";
+    case Phase::ip_lookup: return "ip_lookup";
+    case Phase::asn_lookup: return "asn_lookup";
+    case Phase::cc_lookup: return "cc_lookup";
+    case Phase::resolver_lookup: return "resolver_lookup";
+    case Phase::open_report: return "open_report";
+    case Phase::nettest_run: return "nettest_run";
+    case Phase::serialization: return "serialization";
+    case Phase::update_report: return "update_report";
+    case Phase::close_report: return "close_report";
+  }
+  return "invalid_phase";
+}
 
-#define LIBNETTEST2_EMIT_WARNING_EX(self, statements) \
-  LIBNETTEST2_EMIT_LOG(self, warning, WARNING, statements)
+LatencyHistogram &RunnerMetrics::phase(Phase phase) noexcept {
+  return phases[(size_t)phase];
+}
 
-#define LIBNETTEST2_EMIT_INFO_EX(self, statements) \
-  LIBNETTEST2_EMIT_LOG(self, info, INFO, statements)
+const LatencyHistogram &RunnerMetrics::phase(Phase phase) const noexcept {
+  return phases[(size_t)phase];
+}
 
-#define LIBNETTEST2_EMIT_DEBUG_EX(self, statements) \
-  LIBNETTEST2_EMIT_LOG(self, debug, DEBUG, statements)
+void RunnerMetrics::record(
+    Phase phase, std::chrono::steady_clock::time_point start) noexcept {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  this->phase(phase).record(elapsed.count());
+}
 
-#define LIBNETTEST2_EMIT_WARNING(statements) \
-  LIBNETTEST2_EMIT_WARNING_EX(this, statements)
+void to_json(nlohmann::json &j, const RunnerMetrics &metrics) noexcept {
+  j = nlohmann::json::object();
+  for (size_t k = 0; k < num_phases; ++k) {
+    auto &histogram = metrics.phases[k];
+    auto count = histogram.count();
+    j["latency"][phase_name((Phase)k)] = {
+        {"count", count},
+        {"mean", (count > 0) ? histogram.sum() / count : 0.0},
+        {"p50", histogram.quantile(0.5)},
+        {"p90", histogram.quantile(0.9)},
+        {"p99", histogram.quantile(0.99)},
+        {"max", histogram.max()},
+    };
+  }
+  j["counters"] = {
+      {"measurements", metrics.measurements.load()},
+      {"measurement_failures", metrics.measurement_failures.load()},
+      {"submissions", metrics.submissions.load()},
+      {"submission_failures", metrics.submission_failures.load()},
+      {"submission_retries", metrics.submission_retries.load()},
+  };
+  auto workers = metrics.workers.load();
+  auto busy_workers = metrics.busy_workers.load();
+  j["queue_depth"] = metrics.queue_depth.load();
+  j["workers"] = workers;
+  j["busy_workers"] = busy_workers;
+  j["utilization"] = (workers > 0) ? (double)busy_workers / workers : 0.0;
+}
 
-#define LIBNETTEST2_EMIT_INFO(statements) \
-  LIBNETTEST2_EMIT_INFO_EX(this, statements)
+// Event sink
+// ``````````
 
-#define LIBNETTEST2_EMIT_DEBUG(statements) \
-  LIBNETTEST2_EMIT_DEBUG_EX(this, statements)
+EventSink::EventSink(std::ostream &out, size_t capacity) noexcept
+    : out_{out} {
+  uint64_t size = 2;
+  while (size < capacity && size < ((uint64_t)1 << 20)) {
+    size <<= 1;
+  }
+  mask_ = size - 1;
+  cells_.reset(new Cell[(size_t)size]);
+  for (uint64_t i = 0; i < size; ++i) {
+    cells_[(size_t)i].sequence.store(i, std::memory_order_relaxed);
+  }
+  thread_ = std::thread{[this]() noexcept { loop(); }};
+}
 
-// Nettest
-// ```````
+EventSink &EventSink::global() noexcept {
+  constexpr size_t default_capacity = 4096;
+  static EventSink sink{std::clog, default_capacity};
+  return sink;
+}
 
-std::string Nettest::name() const noexcept { return ""; }
+// The ring buffer is Dmitry Vyukov's bounded MPMC queue: the sequence of each
+// cell tells whether it is ready to be written (sequence == position) or to
+// be read (sequence == position + 1) at a given queue position.
+
+bool EventSink::try_push(std::string *line) noexcept {
+  auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+  for (;;) {
+    auto &cell = cells_[(size_t)(pos & mask_)];
+    auto seq = cell.sequence.load(std::memory_order_acquire);
+    auto diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        cell.line = std::move(*line);
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;  // The ring buffer is full
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+}
 
-std::vector<std::string> Nettest::test_helpers() const noexcept { return {}; }
+bool EventSink::try_pop(std::string *line) noexcept {
+  auto &cell = cells_[(size_t)(dequeue_pos_ & mask_)];
+  auto seq = cell.sequence.load(std::memory_order_acquire);
+  if (seq != dequeue_pos_ + 1) {
+    return false;  // The ring buffer is empty
+  }
+  *line = std::move(cell.line);
+  cell.line.clear();
+  cell.sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+  dequeue_pos_ += 1;
+  return true;
+}
 
-std::string Nettest::version() const noexcept { return "0.0.1"; }
+void EventSink::push(std::string &&line) noexcept {
+  if (!try_push(&line)) {
+    // Note: the timeout bounds the delay if we miss the wakeup because the
+    // consumer makes room after we fail but before it sees us waiting, like
+    // the consumer itself does when waiting for events.
+    constexpr std::chrono::milliseconds max_sleep{10};
+    std::unique_lock<std::mutex> lock{mutex_};
+    waiting_ += 1;
+    while (!try_push(&line)) {
+      not_full_.wait_for(lock, max_sleep);
+    }
+    waiting_ -= 1;
+  }
+  pushed_ += 1;
+  // Only take the lock when the consumer may be waiting for events.
+  if (sleeping_.load()) {
+    std::unique_lock<std::mutex> _{mutex_};
+    cond_.notify_all();
+  }
+}
 
-bool Nettest::needs_input() const noexcept { return false; }
+void EventSink::flush() noexcept {
+  auto target = pushed_.load();
+  std::unique_lock<std::mutex> lock{mutex_};
+  cond_.wait(lock, [this, target]() { return written_.load() >= target; });
+}
 
-bool Nettest::run(const Settings &, const NettestContext &,
-                  std::string, nlohmann::json *, BytesInfo *) noexcept {
-  // Do nothing for two seconds, for testing
-  std::this_thread::sleep_for(std::chrono::seconds(2));
-  return true;
+void EventSink::loop() noexcept {
+  constexpr size_t max_batch = 256;
+  constexpr std::chrono::milliseconds max_sleep{10};
+  std::string line;
+  for (;;) {
+    size_t count = 0;
+    while (count < max_batch && try_pop(&line)) {
+      out_ << line << "\n";
+      count += 1;
+    }
+    if (count > 0) {
+      written_ += count;
+      // Only take the lock when producers may be waiting for room.
+      if (waiting_.load() > 0) {
+        std::unique_lock<std::mutex> _{mutex_};
+        not_full_.notify_all();
+      }
+      continue;
+    }
+    out_.flush();
+    std::unique_lock<std::mutex> lock{mutex_};
+    cond_.notify_all();  // Wake up the threads waiting in flush()
+    if (stop_) {
+      break;
+    }
+    // Note: the timeout bounds the delay if we miss a wakeup because an
+    // event is pushed after we emptied the buffer but before we set the
+    // sleeping flag. We check the ring buffer again after setting it.
+    sleeping_ = true;
+    if (cells_[(size_t)(dequeue_pos_ & mask_)].sequence.load(
+            std::memory_order_acquire) != dequeue_pos_ + 1) {
+      cond_.wait_for(lock, max_sleep);
+    }
+    sleeping_ = false;
+  }
 }
 
-Nettest::~Nettest() noexcept {}
+EventSink::~EventSink() noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    stop_ = true;
+    cond_.notify_all();
+  }
+  thread_.join();
+}
 
-// Runner API
-// ``````````
+// Runner scheduling
+// `````````````````
 
-Runner::Runner(const Settings &settings, Nettest &nettest) noexcept
-    : nettest_{nettest}, settings_{settings} {}
+RunnerScheduler::RunnerScheduler(size_t max_active, bool fifo) noexcept
+    : fifo_{fifo}, max_active_{std::max<size_t>(max_active, 1)} {}
 
-Runner::~Runner() noexcept {}
+std::shared_ptr<RunnerScheduler> RunnerScheduler::global() noexcept {
+  // Note: historically we have been running a single test at a time, and we
+  // cannot guarantee FIFO queuing, hence we keep doing that by default.
+  static auto scheduler = std::make_shared<RunnerScheduler>(1, false);
+  return scheduler;
+}
 
-static std::mutex &global_mutex() noexcept {
-  static std::mutex mtx;
-  return mtx;
+void RunnerScheduler::acquire() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  if (!fifo_) {
+    cond_.wait(lock, [this]() { return active_ < max_active_; });
+    active_ += 1;
+    return;
+  }
+  auto ticket = next_ticket_++;
+  cond_.wait(lock, [this, ticket]() {
+    return ticket == serving_ && active_ < max_active_;
+  });
+  serving_ += 1;
+  active_ += 1;
+  // Wake up the next Runner in line, which may be admitted as well.
+  cond_.notify_all();
 }
 
-static std::string format_system_clock_now() noexcept {
+void RunnerScheduler::release() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  assert(active_ > 0);
+  active_ -= 1;
+  cond_.notify_all();
+}
+
+RunnerScheduler::~RunnerScheduler() noexcept {}
+
+constexpr size_t system_clock_now_size = 19;  // strlen("2006-01-02 15:04:05")
+
+// format_system_clock_now() writes the current time using the OONI format,
+// i.e. "%Y-%m-%d %H:%M:%S" in UTC, as exactly system_clock_now_size chars
+// into |buf|. Since it is called for every measurement, it caches the result
+// per thread and only formats the time again when the second changes.
+static void format_system_clock_now(char *buf) noexcept {
   // Implementation note: to avoid using the C standard library that has
   // given us many headaches on Windows because of parameter validation we
-  // go for a fully C++11 solution based on <chrono> and on the C++11
-  // HowardInnant/date library, which will be available as part of the
-  // C++ standard library starting from C++20.
+  // go for a fully C++11 solution based on <chrono> and on the algorithms
+  // of the C++11 HowardInnant/date library, which will be available as part
+  // of the C++ standard library starting from C++20.
   //
   // Explanation of the algorithm:
   //
-  // 1. get the current system time
-  // 2. round the time point obtained in the previous step to an integral
-  //    number of seconds since the EPOCH used by the system clock
-  // 3. create a system clock time point from the integral number of seconds
-  // 4. convert the previous result to string using HowardInnant/date
-  // 5. if there is a decimal component (there should be one given how the
-  //    library we use works) remove it, because OONI doesn't like it
+  // 1. get the current system time as an integral number of seconds since
+  //    the EPOCH used by the system clock, which drops the fractionary
+  //    seconds OONI doesn't like
+  // 2. if the second is the one we have cached, we're done
+  // 3. otherwise, split the time into days and time of the day, convert the
+  //    days to the civil date using the algorithm by HowardInnant, which is
+  //    also used by his date library, and write the digits
   //
-  // (There was another way to deal with fractionary seconds, i.e. using '%OS',
-  //  but this solution seems better to me because it's less obscure.)
+  // See <http://howardhinnant.github.io/date_algorithms.html#civil_from_days>.
+  class Cache {
+   public:
+    int64_t seconds = -1;
+    char buf[system_clock_now_size] = {};
+  };
+  static thread_local Cache cache;
   using namespace std::chrono;
-  constexpr auto fmt = "%Y-%m-%d %H:%M:%S";
-  auto sys_point = system_clock::now();                                    // 1
-  auto as_seconds = duration_cast<seconds>(sys_point.time_since_epoch());  // 2
-  auto back_as_sys_point = system_clock::time_point(as_seconds);           // 3
-  auto s = date::format(fmt, back_as_sys_point);                           // 4
-  if (s.find(".") != std::string::npos) s = s.substr(0, s.find("."));      // 5
-  return s;
+  auto as_seconds = duration_cast<seconds>(
+      system_clock::now().time_since_epoch());                             // 1
+  if (as_seconds.count() != cache.seconds) {                               // 2
+    int64_t secs = as_seconds.count();                                     // 3
+    int64_t days = secs / 86400;
+    int64_t tod = secs % 86400;
+    if (tod < 0) {
+      tod += 86400;
+      days -= 1;
+    }
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t doe = days - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int64_t day = doy - (153 * mp + 2) / 5 + 1;
+    int64_t month = mp < 10 ? mp + 3 : mp - 9;
+    int64_t year = yoe + era * 400 + (month <= 2);
+    auto put = [](char *p, unsigned value, int width) noexcept {
+      for (int k = width - 1; k >= 0; --k) {
+        p[k] = (char)('0' + value % 10);
+        value /= 10;
+      }
+    };
+    auto p = cache.buf;
+    put(p, (unsigned)year, 4);
+    p[4] = '-';
+    put(p + 5, (unsigned)month, 2);
+    p[7] = '-';
+    put(p + 8, (unsigned)day, 2);
+    p[10] = ' ';
+    put(p + 11, (unsigned)(tod / 3600), 2);
+    p[13] = ':';
+    put(p + 14, (unsigned)(tod / 60 % 60), 2);
+    p[16] = ':';
+    put(p + 17, (unsigned)(tod % 60), 2);
+    cache.seconds = as_seconds.count();
+  }
+  memcpy(buf, cache.buf, system_clock_now_size);
+}
+
+static std::string format_system_clock_now() noexcept {
+  char buf[system_clock_now_size];
+  format_system_clock_now(buf);
+  return std::string(buf, system_clock_now_size);
 }
 
 static void to_json(nlohmann::json &j, const ErrContext &ec) noexcept {
@@ -901,15 +3287,166 @@ static void to_json(nlohmann::json &j, const ErrContext &ec) noexcept {
                      {"reason", ec.reason}};
 }
 
+// runtime_budget() returns the seconds that the measurements of a nettest
+// may take, i.e. its max_runtime minus the time we keep for closing the
+// report, which is one second, or a tenth of max_runtime when it's shorter.
+static double runtime_budget(const Settings &settings) noexcept {
+  constexpr double close_report_margin = 1.0;
+  double max_runtime = settings.max_runtime;
+  return max_runtime - std::min(close_report_margin, max_runtime / 10.0);
+}
+
+// replace_report_id() replaces the report ID |from| with |to| in |json_str|,
+// which is a measurement, such that we can submit it to another report.
+static void replace_report_id(std::string *json_str, const std::string &from,
+                              const std::string &to) noexcept {
+  if (from == to) return;
+  auto needle = "\"report_id\":\"" + from + "\"";
+  auto pos = json_str->find(needle);
+  if (pos != std::string::npos) {
+    json_str->replace(pos, needle.size(), "\"report_id\":\"" + to + "\"");
+  }
+}
+
 bool Runner::run() noexcept {
-  BytesInfo info{};
+  constexpr uint16_t default_parallelism = 3;
+  constexpr uint16_t default_max_adaptive_parallelism = 64;
+  uint16_t parallelism = ((nettest_.needs_input() == false)  //
+                              ? (uint16_t)1
+                              : ((settings_.parallelism > 0)  //
+                                     ? settings_.parallelism
+                                     : (settings_.adaptive_parallelism
+                                            ? default_max_adaptive_parallelism
+                                            : default_parallelism)));
+  // Each worker is a thread, so we bound their number, and there is no point
+  // in having more workers than inputs, when we know how many they are.
+  constexpr uint16_t max_parallelism = 256;
+  parallelism = std::min(parallelism, max_parallelism);
+  if (!input_source_ && settings_.input_filepaths.empty() &&
+      !settings_.inputs.empty()) {
+    auto num_inputs = settings_.inputs.size();
+    if (settings_.shard_count > 1) {
+      num_inputs = (num_inputs + settings_.shard_count - 1) /
+                   settings_.shard_count;
+    }
+    parallelism = (uint16_t)std::min<size_t>(parallelism, num_inputs);
+  }
+  // We don't need as many uploaders as workers when the parallelism is
+  // large, since uploading is generally faster than measuring.
+  constexpr uint16_t max_uploaders = 32;
+  uint16_t num_uploaders = std::min(parallelism, max_uploaders);
+  // Each thread exchanging data has its own slot of byte counters: the main
+  // thread, the discovery operations, the resubmitter, the nettest workers
+  // and the uploaders, in this order.
+  constexpr size_t main_slot = 0;
+  constexpr size_t geoip_slot = 1;
+  constexpr size_t resolver_slot = 2;
+  constexpr size_t resubmitter_slot = 3;
+  constexpr size_t first_worker_slot = 4;
+  size_t first_uploader_slot = first_worker_slot + parallelism;
+  BytesCounters bytes{first_uploader_slot + num_uploaders};
   emit_ev("status.queued", nlohmann::json::object());
-  // The following guarantees that just a single test may be active at any
-  // given time. Note that we cannot guarantee FIFO queuing.
-  std::unique_lock<std::mutex> _{global_mutex()};
+  // The scheduler decides how many tests may be active at any given time
+  // and whether they are admitted in FIFO order. We hold the slot until run()
+  // returns, emitting the final events included.
+  class SchedulerSlot {
+   public:
+    explicit SchedulerSlot(std::shared_ptr<RunnerScheduler> s) noexcept
+        : scheduler{std::move(s)} {
+      scheduler->acquire();
+    }
+    ~SchedulerSlot() noexcept { scheduler->release(); }
+    std::shared_ptr<RunnerScheduler> scheduler;
+  };
+  SchedulerSlot slot{(scheduler_) ? scheduler_ : RunnerScheduler::global()};
+  // The Runner may be reused after a previous run, hence we reset its state.
+  // A previous run may have cancelled the token, so we use a new one, with
+  // atomic operations because interrupt() may concurrently use the token.
+  draining_ = false;
+  deadline_expired_ = false;
   NettestContext ctx;
+  ctx.cancellation = std::make_shared<CancellationToken>();
+  std::atomic_store(&cancellation_, ctx.cancellation);
+  if (interrupted_) {
+    ctx.cancellation->cancel();  // interrupt() came before this run
+  }
   emit_ev("status.started", nlohmann::json::object());
-  {
+  // finish() emits the final event of the run and returns from run().
+  auto finish = [this, &bytes]() noexcept {
+    // TODO(bassosimone): decide whether it makes sense to have an overall
+    // precise error code in this context (it seems not so easy). For now just
+    // always report success, which is what also legacy MK code does.
+    nlohmann::json bytes_by_category;
+    for (size_t k = 0; k < num_bytes_categories; ++k) {
+      auto category = (BytesCategory)k;
+      bytes_by_category[bytes_category_name(category)] = {
+          {"bytes_down", bytes.bytes_down(category)},
+          {"bytes_up", bytes.bytes_up(category)}};
+    }
+    emit_ev("status.end", {{"failure", ""},
+                           {"bytes", std::move(bytes_by_category)},
+                           {"downloaded_kb", bytes.total_down() / 1024.0},
+                           {"uploaded_kb", bytes.total_up() / 1024.0}});
+    // An interrupt() applies to a single run.
+    interrupted_ = false;
+    // The default on_event() writes the events from another thread, so we
+    // wait for them to be written, such that they all precede our return.
+    if (event_sink_used_) {
+      auto sink = (event_sink_) ? event_sink_.get() : &EventSink::global();
+      sink->flush();
+    }
+    return true;
+  };
+  // We check the shard before the discovery, otherwise we would open a
+  // report that stays empty. Note that parse_settings() also checks it.
+  if (settings_.shard_count > 1 &&
+      settings_.shard_index >= settings_.shard_count) {
+    LIBNETTEST2_EMIT_WARNING("run: shard_index is out of range");
+    return finish();
+  }
+  // Probe discovery: querying the bouncer, looking up the probe IP (and then
+  // the ASN and CC, which depend on it), and looking up the resolver IP are
+  // independent operations, hence we run them concurrently. Each operation
+  // only writes its own fields of ctx and records its own failures, which
+  // we emit from this thread, once the operation is complete, such that the
+  // order of the events is the same as in the sequential implementation.
+  if (!worker_pool_) {
+    worker_pool_ = std::make_shared<WorkerPool>();
+  }
+  if (!discovery_cache_ && !settings_.discovery_cache_path.empty()) {
+    discovery_cache_ =
+        std::make_shared<DiscoveryCache>(settings_.discovery_cache_path);
+  }
+  std::mutex metrics_mutex;
+  std::condition_variable metrics_cond;
+  bool metrics_stop = false;
+  WaitGroup metrics_done;
+  if (settings_.metrics_interval > 0) {
+    metrics_done.add(1);
+    worker_pool_->submit([this, &metrics_cond, &metrics_done, &metrics_mutex,
+                          &metrics_stop]() noexcept {
+      std::chrono::seconds interval{settings_.metrics_interval};
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock{metrics_mutex};
+          if (metrics_cond.wait_for(lock, interval,
+                                    [&]() { return metrics_stop; })) {
+            break;
+          }
+        }
+        emit_ev("status.metrics", metrics_);
+      }
+      metrics_done.done();
+    });
+  }
+  class LookupResult {
+   public:
+    bool failed = false;
+    ErrContext err;
+  };
+  WaitGroup bouncer_done;
+  bouncer_done.add(1);
+  worker_pool_->submit([this, &bouncer_done, &bytes, &ctx]() noexcept {
     // TODO(bassosimone): the original code has a per-nettest flag that allows
     // a specific nettest to completely ignore the bouncer. However, that is
     // not super smart because we cannot get fresh collector info. This comment
@@ -917,9 +3454,15 @@ bool Runner::run() noexcept {
     // flag from this reimplementation of the nettest workflow.
     if (!settings_.no_bouncer) {
       ErrContext err{};
-      if (!query_bouncer(nettest_.name(), nettest_.test_helpers(),
-                         nettest_.version(), &ctx.collectors,
-                         &ctx.test_helpers, &info, &err)) {
+      auto start = std::chrono::steady_clock::now();
+      auto ok = query_bouncer_cached(nettest_.name(), nettest_.test_helpers(),
+                                     nettest_.version(), &ctx.collectors,
+                                     &ctx.test_helpers,
+                                     bytes.get(main_slot,
+                                               BytesCategory::bouncer),
+                                     &err);
+      metrics_.record(Phase::bouncer, start);
+      if (!ok) {
         LIBNETTEST2_EMIT_WARNING("run: query_bouncer() failed");
         // TODO(bassosimone): shouldn't we introduce failure.query_bouncer?
         //
@@ -928,29 +3471,52 @@ bool Runner::run() noexcept {
         //
         // FALLTHROUGH
       }
+      // We rank the collectors only if we're going to choose one of them. We
+      // rank them along with the test helpers, so we pay one probe round.
+      std::map<std::string, std::vector<EndpointInfo> *> lists;
+      if (!settings_.no_collector && settings_.collector_base_url.empty()) {
+        lists["collectors"] = &ctx.collectors;
+      }
+      for (auto &pair : ctx.test_helpers) {
+        lists["test_helpers " + pair.first] = &pair.second;
+      }
+      std::map<std::string, bool> reachable;
+      if (!rank_endpoints_cached(lists, &reachable,
+                                 bytes.get(main_slot,
+                                           BytesCategory::bouncer))) {
+        LIBNETTEST2_EMIT_WARNING("run: rank_endpoints() failed");
+      }
+      for (auto &pair : reachable) {
+        if (!pair.second) {
+          LIBNETTEST2_EMIT_WARNING("run: cannot connect to any of the "
+                                   << pair.first);
+        }
+      }
     }
-  }
-  emit_ev("status.progress", {{"percentage", 0.1},
-                              {"message", "contact bouncer"}});
+    bouncer_done.done();
+  });
   // Design note: the no_ip_lookup (and similar variables) control whether
   // we perform the lookup. Orthogonally, the save_real_probe_ip (and similar
   // variables) control whether we copy the information obtained with such
   // lookup (or a dummy value if it was not performed) into the report.
-  {
+  LookupResult ip_result, asn_result, cc_result;
+  WaitGroup geoip_done;
+  geoip_done.add(1);
+  worker_pool_->submit([this, &asn_result, &bytes, &cc_result, &ctx,
+                        &geoip_done, &ip_result]() noexcept {
     if (settings_.probe_ip == "") {
       // TODO(bassosimone): this is consistent with the existing behaviour
       // and we should update the spec before changing the code in here.
       ctx.probe_ip = "127.0.0.1";
       if (!settings_.no_ip_lookup) {
-        ErrContext err{};
-        if (!lookup_ip(&ctx.probe_ip, &info, &err)) {
+        auto start = std::chrono::steady_clock::now();
+        auto ok = lookup_ip_cached(
+            &ctx.probe_ip, bytes.get(geoip_slot, BytesCategory::geoip),
+            &ip_result.err);
+        metrics_.record(Phase::ip_lookup, start);
+        if (!ok) {
           LIBNETTEST2_EMIT_WARNING("run: lookup_ip() failed");
-          // TODO(bassosimone): this failure event is not consistent with
-          // the specification, so we should probably simplify it.
-          emit_ev("failure.ip_lookup", {
-              {"failure", "library_error"},
-              {"library_error_context", err},
-          });
+          ip_result.failed = true;
         } else {
           LIBNETTEST2_EMIT_INFO("Your public IP address: " << ctx.probe_ip);
         }
@@ -965,8 +3531,7 @@ bool Runner::run() noexcept {
     // TODO(bassosimone): we need to make sure that we pass down the stack
     // the probe_ip to allow for scrubbing. In the original code, that
     // was passed down using an internal 'real_probe_ip_' setting.
-  }
-  {
+    //
     // Implementation detail: if probe_asn is empty then we will also overwrite
     // the value inside of probe_network_name even if it's non-empty.
     if (settings_.probe_asn == "") {
@@ -974,14 +3539,14 @@ bool Runner::run() noexcept {
       // and we should update the spec before changing the code in here.
       ctx.probe_asn = "AS0";
       if (!settings_.no_asn_lookup) {
-        ErrContext err{};
-        if (!lookup_asn(settings_.geoip_asn_path, ctx.probe_ip, &ctx.probe_asn,
-                        &ctx.probe_network_name, &err)) {
+        auto start = std::chrono::steady_clock::now();
+        auto ok = lookup_asn(settings_.geoip_asn_path, ctx.probe_ip,
+                             &ctx.probe_asn, &ctx.probe_network_name,
+                             &asn_result.err);
+        metrics_.record(Phase::asn_lookup, start);
+        if (!ok) {
           LIBNETTEST2_EMIT_WARNING("run: lookup_asn() failed");
-          emit_ev("failure.asn_lookup", {
-              {"failure", "library_error"},
-              {"library_error_context", err},
-          });
+          asn_result.failed = true;
         } else {
           LIBNETTEST2_EMIT_INFO("Your ISP number: " << ctx.probe_asn);
           LIBNETTEST2_EMIT_DEBUG("Your ISP name: " << ctx.probe_network_name);
@@ -991,21 +3556,18 @@ bool Runner::run() noexcept {
       ctx.probe_network_name = settings_.probe_network_name;
       ctx.probe_asn = settings_.probe_asn;
     }
-  }
-  {
     if (settings_.probe_cc == "") {
       // TODO(bassosimone): this is consistent with the existing behaviour
       // and we should update the spec before changing the code in here.
       ctx.probe_cc = "ZZ";
       if (!settings_.no_cc_lookup) {
-        ErrContext err{};
-        if (!lookup_cc(settings_.geoip_country_path, ctx.probe_ip,
-                       &ctx.probe_cc, &err)) {
+        auto start = std::chrono::steady_clock::now();
+        auto ok = lookup_cc(settings_.geoip_country_path, ctx.probe_ip,
+                            &ctx.probe_cc, &cc_result.err);
+        metrics_.record(Phase::cc_lookup, start);
+        if (!ok) {
           LIBNETTEST2_EMIT_WARNING("run: lookup_cc() failed");
-          emit_ev("failure.cc_lookup", {
-              {"failure", "library_error"},
-              {"library_error_context", err},
-          });
+          cc_result.failed = true;
         } else {
           LIBNETTEST2_EMIT_INFO("Your country: " << ctx.probe_cc);
         }
@@ -1013,6 +3575,50 @@ bool Runner::run() noexcept {
     } else {
       ctx.probe_cc = settings_.probe_cc;
     }
+    geoip_done.done();
+  });
+  LookupResult resolver_result;
+  WaitGroup resolver_done;
+  resolver_done.add(1);
+  worker_pool_->submit([this, &bytes, &ctx, &resolver_done,
+                        &resolver_result]() noexcept {
+    if (!settings_.no_resolver_lookup) {
+      auto start = std::chrono::steady_clock::now();
+      auto ok = lookup_resolver_ip(
+          &ctx.resolver_ip, bytes.get(resolver_slot, BytesCategory::geoip),
+          &resolver_result.err);
+      metrics_.record(Phase::resolver_lookup, start);
+      if (!ok) {
+        LIBNETTEST2_EMIT_WARNING("run: lookup_resolver_ip() failed");
+        resolver_result.failed = true;
+      }
+    }
+    LIBNETTEST2_EMIT_DEBUG("resolver_ip: " << ctx.resolver_ip);
+    resolver_done.done();
+  });
+  bouncer_done.wait();
+  emit_ev("status.progress", {{"percentage", 0.1},
+                              {"message", "contact bouncer"}});
+  geoip_done.wait();
+  if (ip_result.failed) {
+    // TODO(bassosimone): this failure event is not consistent with
+    // the specification, so we should probably simplify it.
+    emit_ev("failure.ip_lookup", {
+        {"failure", "library_error"},
+        {"library_error_context", ip_result.err},
+    });
+  }
+  if (asn_result.failed) {
+    emit_ev("failure.asn_lookup", {
+        {"failure", "library_error"},
+        {"library_error_context", asn_result.err},
+    });
+  }
+  if (cc_result.failed) {
+    emit_ev("failure.cc_lookup", {
+        {"failure", "library_error"},
+        {"library_error_context", cc_result.err},
+    });
   }
   emit_ev("status.progress", {{"percentage", 0.2},
                               {"message", "geoip lookup"}});
@@ -1026,51 +3632,80 @@ bool Runner::run() noexcept {
                                      {"probe_ip", ctx.probe_ip},
                                      {"probe_network_name", ctx.probe_network_name},
                                  });
-  {
-    if (!settings_.no_resolver_lookup) {
-      ErrContext err{};
-      if (!lookup_resolver_ip(&ctx.resolver_ip, &info, &err)) {
-        LIBNETTEST2_EMIT_WARNING("run: lookup_resolver_ip() failed");
-        emit_ev("failure.resolver_lookup", {
-            {"failure", "library_error"},
-            {"library_error_context", err},
-        });
-      }
-    }
-    LIBNETTEST2_EMIT_DEBUG("resolver_ip: " << ctx.resolver_ip);
+  resolver_done.wait();
+  if (resolver_result.failed) {
+    emit_ev("failure.resolver_lookup", {
+        {"failure", "library_error"},
+        {"library_error_context", resolver_result.err},
+    });
   }
   emit_ev("status.progress", {{"percentage", 0.3},
                               {"message", "resolver lookup"}});
   emit_ev("status.resolver_lookup", {{"resolver_ip", ctx.resolver_ip}});
   auto test_start_time = format_system_clock_now();
   std::string collector_base_url;
+  // The discovered collectors we can use, ranked by rank_endpoints(). We
+  // open a report with the best one and, when it fails, we fail over to the
+  // next one, with which we open another report. We don't support Tor yet,
+  // therefore we cannot use onion collectors.
+  std::unique_ptr<EndpointSelector> collectors;
   if (!settings_.no_collector) {
     if (settings_.collector_base_url == "") {
-      // TODO(bassosimone): here the algorithm for selecting a collector
-      // is very basic but mirrors the one in MK. We should probably make
-      // the code better to use cloudfronted and/or Tor if needed.
+      std::vector<EndpointInfo> usable;
       for (auto &epnt : ctx.collectors) {
-        if (epnt.type == endpoint_type_https) {
-          LIBNETTEST2_EMIT_INFO("Using discovered collector: " << epnt.address);
-          collector_base_url = epnt.address;
-          break;
+        if (epnt.type == endpoint_type_https ||
+            epnt.type == endpoint_type_cloudfront) {
+          usable.push_back(epnt);
         }
       }
+      // Note: a failover completes before another one starts, hence the
+      // function opening reports doesn't run concurrently with itself. The
+      // function owns the error of the last open, because failovers run
+      // in the uploaders, after this scope is gone, and we only read it
+      // below, once the first open() is over.
+      auto last_err = std::make_shared<ErrContext>();
+      collectors.reset(new EndpointSelector{
+          std::move(usable),
+          [this, &bytes, &ctx, last_err, &test_start_time](
+              const EndpointInfo &epnt, std::string *report_id) noexcept {
+            LIBNETTEST2_EMIT_INFO("Using discovered collector: "
+                                  << epnt.address);
+            LIBNETTEST2_EMIT_INFO("Opening report; please be patient...");
+            ErrContext err{};
+            auto start = std::chrono::steady_clock::now();
+            auto ok = open_report(
+                epnt.address, test_start_time, ctx, report_id,
+                bytes.get(main_slot, BytesCategory::collector), &err);
+            metrics_.record(Phase::open_report, start);
+            *last_err = std::move(err);
+            if (!ok) {
+              LIBNETTEST2_EMIT_WARNING("run: open_report() failed: "
+                                       << last_err->reason);
+              return false;
+            }
+            LIBNETTEST2_EMIT_INFO("Report ID: " << *report_id);
+            emit_ev("status.report_create", {{"report_id", *report_id}});
+            return true;
+          }});
+      // Set it before opening, such that we connect to fronts if needed.
+      collectors_ = collectors.get();
+      ReportTarget target;
       // TODO(bassosimone): the original code bailed in case there was
       // no collector while here we continue running the nettest. I wonder
       // what is the correct behaviour.
-      LIBNETTEST2_EMIT_INFO("Opening report; please be patient...");
-      ErrContext err{};
-      if (!open_report(collector_base_url, test_start_time, ctx,
-                       &ctx.report_id, &info, &err)) {
-        LIBNETTEST2_EMIT_WARNING("run: open_report() failed");
+      if (!collectors->open(&target)) {
+        auto err = *last_err;
+        if (ctx.collectors.empty()) {
+          LIBNETTEST2_EMIT_WARNING("run: no discovered collector");
+          err.reason = "no_collector_error";
+        }
         emit_ev("failure.report_create", {
             {"failure", "library_error"},
             {"library_error_context", err},
         });
       } else {
-        LIBNETTEST2_EMIT_INFO("Report ID: " << ctx.report_id);
-        emit_ev("status.report_create", {{"report_id", ctx.report_id}});
+        collector_base_url = target.url;
+        ctx.report_id = target.report_id;
       }
     } else {
       collector_base_url = settings_.collector_base_url;
@@ -1078,117 +3713,371 @@ bool Runner::run() noexcept {
   }
   emit_ev("status.progress", {{"percentage", 0.4}, {"message", "open report"}});
   do {
-    // TODO(bassosimone): the original code here would read files from the
-    // file system and fill their content into the inputs vector. Do we want
-    // to replicate this functionality here? Most likely.
-    if (nettest_.needs_input() && settings_.inputs.empty()) {
+    if (nettest_.needs_input() && settings_.inputs.empty() &&
+        settings_.input_filepaths.empty() && !input_source_) {
       LIBNETTEST2_EMIT_WARNING("run: no input provided");
       break;
     }
-    // Note: the specification modifies settings_.inputs in place but here
-    // settings_ are immutable, so we actually fill a inputs vector using
-    // the settings_ when we expect input. Otherwise we ignore settings_.inputs.
-    std::vector<std::string> inputs;
-    if (nettest_.needs_input()) {
-      inputs.insert(inputs.end(), settings_.inputs.begin(),
-                    settings_.inputs.end());
-    } else {
-      if (!settings_.inputs.empty()) {
+    // Note: the specification modifies settings_.inputs in place, reading
+    // into it the content of settings_.input_filepaths, but here settings_
+    // are immutable, so we instead create a source from which the workers
+    // pull the inputs when we expect input. Otherwise we ignore the inputs.
+    std::vector<std::string> no_inputs{""};  // just one entry
+    std::shared_ptr<InputSource> input_source;
+    if (!nettest_.needs_input()) {
+      if (!settings_.inputs.empty() || !settings_.input_filepaths.empty() ||
+          input_source_) {
         LIBNETTEST2_EMIT_WARNING("run: got unexpected input; ignoring it");
         // Note: ignoring settings_.inputs in this case
       }
-      inputs.push_back("");  // just one entry
-    }
-    if (settings_.randomize_input) {
-      std::random_device random_device;
-      std::mt19937 mt19937{random_device()};
-      std::shuffle(inputs.begin(), inputs.end(), mt19937);
+      input_source.reset(new VectorInputSource{no_inputs, false});
+    } else if (input_source_) {
+      input_source = std::move(input_source_);
+    } else {
+      std::vector<std::unique_ptr<InputSource>> sources;
+      if (!settings_.inputs.empty()) {
+        sources.emplace_back(new VectorInputSource{
+            settings_.inputs, settings_.randomize_input, settings_.input_seed,
+            settings_.shard_index, settings_.shard_count});
+      }
+      if (!settings_.input_filepaths.empty()) {
+        for (auto &path : settings_.input_filepaths) {
+          if (!std::ifstream{path}.good()) {
+            LIBNETTEST2_EMIT_WARNING("run: cannot open input file: " << path);
+          }
+        }
+        std::unique_ptr<InputSource> files{
+            new FileInputSource{settings_.input_filepaths}};
+        if (settings_.shard_count > 1) {
+          // The positions of the lines follow the ones of settings_.inputs.
+          files.reset(new ShardInputSource{
+              std::move(files), settings_.shard_index, settings_.shard_count,
+              settings_.inputs.size()});
+        }
+        if (settings_.randomize_input) {
+          // Input files may be huge, so we cannot shuffle them in memory.
+          constexpr size_t shuffle_capacity = 1 << 16;
+          files.reset(new ShuffleInputSource{
+              std::move(files), shuffle_capacity, settings_.input_seed});
+        }
+        sources.push_back(std::move(files));
+      }
+      input_source.reset(new ChainInputSource{std::move(sources)});
     }
     // Implementation note: here we create a bunch of constant variables for
     // the lambda to access shared stuff in a thread safe way
-    constexpr uint8_t default_parallelism = 3;
-    uint8_t parallelism = ((nettest_.needs_input() == false)  //
-                                     ? (uint8_t)1
-                                     : ((settings_.parallelism > 0)  //
-                                            ? settings_.parallelism
-                                            : default_parallelism));
-    std::atomic<uint8_t> active{0};
+    // With adaptive parallelism, the controller decides how many workers can
+    // run, and we start them as its limit grows, up to the parallelism.
+    std::unique_ptr<ConcurrencyController> concurrency;
+    if (settings_.adaptive_parallelism && parallelism > 1) {
+      concurrency.reset(new ConcurrencyController{
+          std::min(default_parallelism, parallelism), parallelism});
+      concurrency_ = concurrency.get();
+    }
+    // Measurements are submitted by dedicated threads such that the nettest
+    // workers can continue measuring while a slow collector is busy.
+    std::unique_ptr<SubmissionQueue> submission_queue;
+    WaitGroup uploaders;
+    if (!settings_.no_collector && !ctx.report_id.empty()) {
+      constexpr size_t submissions_per_uploader = 16;
+      submission_queue.reset(new SubmissionQueue{
+          std::max<size_t>(submissions_per_uploader,
+                           settings_.submission_batch_size) * num_uploaders});
+      submission_queue_ = submission_queue.get();
+      for (uint16_t j = 0; j < num_uploaders; ++j) {
+        SubmissionQueue *queue = submission_queue.get();
+        const Runner *cthis = this;
+        const NettestContext *pctx = &ctx;
+        const std::string *pcollector_base_url = &collector_base_url;
+        auto pinfo = bytes.get(first_uploader_slot + j,
+                               BytesCategory::collector);
+        size_t batch_size = (settings_.submission_batch_size > 1)
+                                ? settings_.submission_batch_size
+                                : 1;
+        std::chrono::milliseconds batch_timeout{
+            settings_.submission_batch_timeout};
+        WaitGroup *puploaders = &uploaders;
+        uploaders.add(1);
+        worker_pool_->submit([=]() noexcept {
+          std::vector<Submission> batch;
+          while (queue->pop_batch(&batch, batch_size, batch_timeout)) {
+            cthis->metrics_.queue_depth -= (int64_t)batch.size();
+            cthis->submit_measurements(*pctx, *pcollector_base_url,
+                                       std::move(batch), pinfo);
+            batch.clear();
+          }
+          puploaders->done();
+        });
+      }
+    }
+    // With a spool, we save the measurements before submitting them and a
+    // background task periodically resubmits those whose submission failed,
+    // using an exponential backoff, until the report is closed.
+    std::unique_ptr<Spool> spool;
+    std::mutex resubmitter_mutex;
+    std::condition_variable resubmitter_cond;
+    bool resubmitter_stop = false;
+    WaitGroup resubmitter;
+    if (submission_queue && !settings_.spool_path.empty()) {
+      spool.reset(new Spool{settings_.spool_path});
+      ErrContext err{};
+      if (!spool->open(&err)) {
+        LIBNETTEST2_EMIT_WARNING("run: cannot open spool: " << err.reason);
+        spool.reset();
+      } else {
+        LIBNETTEST2_EMIT_DEBUG("run: measurements in spool: "
+                               << spool->pending());
+        spool_ = spool.get();
+        resubmitter.add(1);
+        worker_pool_->submit([this, &bytes, &collector_base_url, &ctx,
+                              &resubmitter, &resubmitter_cond,
+                              &resubmitter_mutex, &resubmitter_stop]() noexcept {
+          constexpr std::chrono::seconds min_backoff{1};
+          constexpr std::chrono::seconds max_backoff{60};
+          std::chrono::seconds backoff = min_backoff;
+          bool stopping = false;
+          while (!stopping) {
+            {
+              std::unique_lock<std::mutex> lock{resubmitter_mutex};
+              (void)resubmitter_cond.wait_for(lock, backoff, [&]() {
+                return resubmitter_stop;
+              });
+              // We make one last attempt before the report is closed.
+              stopping = resubmitter_stop;
+            }
+            // The reports of previous runs have been closed, hence we submit
+            // their measurements into the current report, provided that they
+            // were measured by the same nettest.
+            bool failed = false;
+            for (auto &report_id : spool_->report_ids()) {
+              auto current = (report_id == ctx.report_id);
+              for (auto idx : spool_->failed_indexes(report_id)) {
+                std::string str;
+                if (!spool_->read(report_id, idx, &str)) continue;
+                if (!current) {
+                  std::string test_name;
+                  try {
+                    test_name = nlohmann::json::parse(str)
+                                    .at("test_name")
+                                    .get<std::string>();
+                  } catch (const std::exception &) {
+                    // Leave it in the spool for the embedder to salvage
+                  }
+                  if (test_name != nettest_.name()) continue;
+                }
+                ErrContext err{};
+                ReportTarget target;
+                report_target(ctx, collector_base_url, &target);
+                replace_report_id(&str, report_id, target.report_id);
+                metrics_.submission_retries += 1;
+                auto start = std::chrono::steady_clock::now();
+                auto ok = update_report(
+                    target.url, target.report_id, str,
+                    bytes.get(resubmitter_slot, BytesCategory::collector),
+                    &err);
+                metrics_.record(Phase::update_report, start);
+                if (!ok) {
+                  LIBNETTEST2_EMIT_DEBUG("run: resubmission failed: "
+                                         << err.reason);
+                  // We'll try again with the next collector, if any.
+                  (void)fail_over(err, &target);
+                  failed = true;
+                  break;  // Likely the collector is still unavailable
+                }
+                spool_->done(report_id, idx);
+                if (current) {
+                  emit_ev("status.measurement_resubmission", {{"idx", idx}});
+                } else {
+                  emit_ev("status.measurement_resubmission",
+                          {{"idx", idx}, {"report_id", report_id}});
+                }
+              }
+              if (failed) break;
+            }
+            backoff = (failed) ? std::min(backoff * 2, max_backoff)
+                               : min_backoff;
+          }
+          resubmitter.done();
+        });
+      }
+    }
+    WaitGroup workers;
     auto begin = std::chrono::steady_clock::now();
     const std::chrono::time_point<std::chrono::steady_clock> &cbegin = begin;
+    // We only start the measurements expected to complete within the budget
+    // and we cancel those still running when it's over (see below).
+    DeadlineScheduler deadline{begin, runtime_budget(settings_)};
+    deadline_ = &deadline;
     const std::string &ccollector_base_url = collector_base_url;
     const NettestContext &cctx = ctx;
-    const std::vector<std::string> &cinputs = inputs;
+    InputSource *psource = input_source.get();
     const Runner *cthis = this;
-    std::atomic<uint64_t> i{0};
-    std::mutex mutex;
     const std::string &ctest_start_time = test_start_time;
-    auto pinfo = &info;
+    ConcurrencyController *pconcurrency = concurrency.get();
+    // The invariant part of the measurements is serialized just once.
+    std::string measurement_template;
+    if (make_measurement_template(ctx, test_start_time,
+                                  &measurement_template)) {
+      measurement_template_ = &measurement_template;
+    }
     // TODO(bassosimone): at this point, the original code was scaling
     // the progress between 0.1 and 0.8 included, so nettests assume that
     // they have the 0..1 range where actually it's smaller. We can also
     // adopt another strategy here for measuring the progress which is
     // less reliant onto the internal details of a nettest.
-    for (uint8_t j = 0; j < parallelism; ++j) {
+    // add_workers() starts workers until they are as many as the ones that
+    // may run, i.e. the limit of the controller, if any, or the parallelism.
+    // The workers call it when adaptive, since the limit may have grown.
+    std::function<void()> add_workers;
+    const std::function<void()> *padd_workers = &add_workers;
+    auto start_worker = [&](uint16_t j) noexcept {
+      auto pinfo = bytes.get(first_worker_slot + j, BytesCategory::nettest);
+      auto pcollector_info = bytes.get(first_worker_slot + j,
+                                       BytesCategory::collector);
       // Implementation note: make sure this lambda has only access to either
       // constant stuff or to stuff that it's thread safe.
       auto main = [
-        &active,               // atomic
         &cbegin,               // const ref
         &ccollector_base_url,  // const ref
         &cctx,                 // const ref
-        &cinputs,              // const ref
         &ctest_start_time,     // const ref
         &cthis,                // const pointer
-        &i,                    // atomic
-        &mutex,                // thread safe
-        pinfo                  // ptr to struct w/ only atomic fields
+        pinfo,                 // ptr to struct w/ only atomic fields
+        pcollector_info,       // ptr to struct w/ only atomic fields
+        pconcurrency,          // ptr to thread safe object (or null)
+        padd_workers,          // ptr to thread safe function
+        psource,               // ptr to thread safe object
+        &workers               // thread safe
       ]() noexcept {
-        active += 1;
-        // TODO(bassosimone): more work is required to actually interrupt
-        // "long" tests like NDT that take several seconds to complete. This
-        // is actually broken also in Measurement Kit, where we cannot stop
-        // the reactor easily because of the thread pool. So, it does not
-        // matter much that we're shipping this sub-library with the interrupt
-        // nettest functionality that is not fully functional.
+        cthis->metrics_.workers += 1;
+        // Note: interrupting "long" tests like NDT that take several seconds
+        // to complete requires them to honour the cancellation token in the
+        // context; the transfers made by us are aborted anyway.
         while (!cthis->interrupted_) {
+          if (pconcurrency != nullptr) {
+            pconcurrency->acquire();
+          }
+          std::string input;
           uint32_t idx = 0;
           {
-            std::unique_lock<std::mutex> _{mutex};
             // Implementation note: we currently limit the maximum value of
             // the index to UINT32_MAX on the grounds that in Java it's painful
             // to deal with unsigned 64 bit integers.
-            if (i > UINT32_MAX || i >= cinputs.size()) {
+            //
+            // The index of a measurement is the position of its input, which
+            // the source claims together with the input, so that an index
+            // always corresponds to the same input, regardless of how the
+            // workers interleave. For vectors, this requires no lock.
+            uint64_t next = 0;
+            auto more = psource->next_with_position(&input, &next);
+            if (!more || next > UINT32_MAX) {
+              if (pconcurrency != nullptr) {
+                pconcurrency->release();
+              }
               break;
             }
-            idx = (uint32_t)i;
-            i += 1;
+            idx = (uint32_t)next;
           }
-          if (!cthis->run_with_index32(cbegin, ctest_start_time, cinputs, cctx,
-                                       ccollector_base_url, idx, pinfo)) {
+          auto ok = cthis->run_with_input32(cbegin, ctest_start_time, input,
+                                            cctx, ccollector_base_url, idx,
+                                            pinfo, pcollector_info);
+          if (pconcurrency != nullptr) {
+            pconcurrency->release();
+            (*padd_workers)();
+          }
+          if (!ok) {
             break;
           }
         }
-        active -= 1;
+        cthis->metrics_.workers -= 1;
+        workers.done();
       };
-      std::thread thread{std::move(main)};
-      thread.detach();
+      workers.add(1);
+      worker_pool_->submit(std::move(main));
+    };
+    std::atomic<uint16_t> num_workers{0};
+    add_workers = [&]() noexcept {
+      auto wanted = (pconcurrency != nullptr)
+                        ? std::min<size_t>(pconcurrency->limit(), parallelism)
+                        : parallelism;
+      uint16_t j = num_workers;
+      while (j < wanted) {
+        // On failure, another thread started the j-th worker and j is updated.
+        if (num_workers.compare_exchange_weak(j, (uint16_t)(j + 1))) {
+          start_worker(j);
+          j += 1;
+        }
+      }
+    };
+    add_workers();
+    // At the deadline, we cancel the measurements still running. We don't
+    // do that for nettests without input, whose single measurement is the
+    // whole nettest, such that we don't throw it away.
+    if (nettest_.needs_input()) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline.deadline() - std::chrono::steady_clock::now());
+      if (!workers.wait_for(std::max(remaining, std::chrono::milliseconds(0)))) {
+        LIBNETTEST2_EMIT_INFO("run: deadline reached; cancelling measurements");
+        deadline_expired_ = true;
+        ctx.cancellation->cancel();
+        workers.wait();
+      }
+    } else {
+      workers.wait();
     }
-    while (active > 0) {
-      constexpr auto msec = 250;
-      std::this_thread::sleep_for(std::chrono::milliseconds(msec));
+    concurrency_ = nullptr;
+    deadline_ = nullptr;
+    measurement_template_ = nullptr;
+    // No measurement is in progress anymore, so we can allow transfers again
+    // even if interrupted, to fail over and to close the report.
+    draining_ = true;
+    if (submission_queue) {
+      // Let the uploaders drain the queue before closing the report.
+      submission_queue->close();
+      uploaders.wait();
+      submission_queue_ = nullptr;
+    }
+    if (spool) {
+      spool->sync();  // Make sure the last failed measurements are eligible
+      {
+        std::unique_lock<std::mutex> _{resubmitter_mutex};
+        resubmitter_stop = true;
+        resubmitter_cond.notify_all();
+      }
+      resubmitter.wait();
+      if (spool->pending() > 0) {
+        LIBNETTEST2_EMIT_WARNING("run: measurements left in spool: "
+                                 << spool->pending());
+      }
+      spool_ = nullptr;
     }
     emit_ev("status.progress", {{"percentage", 0.9},
                                 {"message", "measurement complete"}});
     if (!settings_.no_collector && !ctx.report_id.empty()) {
-      ErrContext err{};
-      if (!close_report(collector_base_url, ctx.report_id, &info, &err)) {
-        LIBNETTEST2_EMIT_WARNING("run: close_report() failed");
-        emit_ev("failure.report_close", {
-            {"failure", "library_error"},
-            {"library_error_context", err},
-        });
+      // We close all the reports we opened, one per collector we used.
+      std::vector<ReportTarget> reports;
+      if (collectors_ != nullptr) {
+        reports = collectors_->reports();
       } else {
-        emit_ev("status.report_close", {{"report_id", ctx.report_id}});
+        reports.resize(1);
+        report_target(ctx, collector_base_url, &reports[0]);
+      }
+      for (auto &target : reports) {
+        ErrContext err{};
+        auto start = std::chrono::steady_clock::now();
+        auto ok = close_report(target.url, target.report_id,
+                               bytes.get(main_slot, BytesCategory::collector),
+                               &err);
+        metrics_.record(Phase::close_report, start);
+        if (!ok) {
+          LIBNETTEST2_EMIT_WARNING("run: close_report() failed");
+          emit_ev("failure.report_close", {
+              {"failure", "library_error"},
+              {"library_error_context", err},
+          });
+        } else {
+          emit_ev("status.report_close", {{"report_id", target.report_id}});
+        }
       }
     } else if (ctx.report_id.empty()) {
       emit_ev("failure.report_close", {{"failure", "report_not_open_error"}});
@@ -1196,16 +4085,63 @@ bool Runner::run() noexcept {
     emit_ev("status.progress", {{"percentage", 1.0},
                                 {"message", "report close"}});
   } while (0);
-  // TODO(bassosimone): decide whether it makes sense to have an overall
-  // precise error code in this context (it seems not so easy). For now just
-  // always report success, which is what also legacy MK code does.
-  emit_ev("status.end", {{"failure", ""},
-                         {"downloaded_kb", info.bytes_down.load() / 1024.0},
-                         {"uploaded_kb", info.bytes_up.load() / 1024.0}});
-  return true;
+  discovery_refreshes_.wait();
+  collectors_ = nullptr;
+  if (settings_.metrics_interval > 0) {
+    {
+      std::unique_lock<std::mutex> _{metrics_mutex};
+      metrics_stop = true;
+      metrics_cond.notify_all();
+    }
+    metrics_done.wait();
+    emit_ev("status.metrics", metrics_);
+  }
+  return finish();
+}
+
+void Runner::interrupt() noexcept {
+  interrupted_ = true;
+  std::atomic_load(&cancellation_)->cancel();
+#if LIBCURL_VERSION_NUM >= 0x074400  // 7.68.0
+  // Make the multi handles notice immediately, rather than on timeout.
+  std::unique_lock<std::mutex> _{multis_mutex_};
+  for (auto multi : multis_) {
+    (void)::curl_multi_wakeup(multi);
+  }
+#endif
+}
+
+bool Runner::transfers_cancelled() const noexcept {
+  return interrupted_ && !draining_;
+}
+
+void Runner::set_worker_pool(std::shared_ptr<WorkerPool> pool) noexcept {
+  worker_pool_ = std::move(pool);
+}
+
+void Runner::set_input_source(std::shared_ptr<InputSource> source) noexcept {
+  input_source_ = std::move(source);
+}
+
+void Runner::set_event_sink(std::shared_ptr<EventSink> sink) noexcept {
+  event_sink_ = std::move(sink);
+}
+
+void Runner::set_scheduler(
+    std::shared_ptr<RunnerScheduler> scheduler) noexcept {
+  scheduler_ = std::move(scheduler);
+}
+
+const RunnerMetrics &Runner::metrics() const noexcept { return metrics_; }
+
+void Runner::set_curlx_pool(std::shared_ptr<CurlxPool> pool) noexcept {
+  if (pool) curlx_pool_ = std::move(pool);
 }
 
-void Runner::interrupt() noexcept { interrupted_ = true; }
+void Runner::set_discovery_cache(
+    std::shared_ptr<DiscoveryCache> cache) noexcept {
+  discovery_cache_ = std::move(cache);
+}
 
 LogLevel Runner::get_log_level() const noexcept { return settings_.log_level; }
 
@@ -1213,11 +4149,89 @@ LogLevel Runner::get_log_level() const noexcept { return settings_.log_level; }
 // ``````````````````````````````````````
 
 void Runner::on_event(const nlohmann::json &event) const noexcept {
-  // When running with -fsanitize=thread enable on macOS, a data race in
-  // accessing std::clog is reported. Attempt to avoid that.
-  static std::mutex no_data_race;
-  std::unique_lock<std::mutex> _{no_data_race};
-  std::clog << event.dump() << std::endl;
+  // Note: the sink writes events from a single thread, which also avoids
+  // the data race in accessing std::clog reported on macOS by TSAN.
+  std::string line;
+  try {
+    line = event.dump();
+  } catch (const std::exception &) {
+    return;  // E.g. the event contains invalid UTF-8
+  }
+  auto sink = (event_sink_) ? event_sink_.get() : &EventSink::global();
+  sink->push(std::move(line));
+  if (!event_sink_used_.load(std::memory_order_relaxed)) {
+    event_sink_used_ = true;
+  }
+}
+
+void Runner::on_typed_event(const Event &event) const noexcept {
+  // Note: nlohmann::json may throw when allocating memory.
+  try {
+    switch (event.id) {
+      case EventId::log: {
+        const char *level = "";
+        switch (event.log_level) {
+          case LogLevel::log_err: level = "ERR"; break;
+          case LogLevel::log_warning: level = "WARNING"; break;
+          case LogLevel::log_info: level = "INFO"; break;
+          case LogLevel::log_debug: level = "DEBUG"; break;
+          case LogLevel::log_debug2: level = "DEBUG2"; break;
+          case LogLevel::log_quiet: level = "QUIET"; break;
+        }
+        assert(event.message != nullptr);
+        emit_ev("log", {{"log_level", level}, {"message", *event.message}});
+        break;
+      }
+      case EventId::measurement:
+        assert(event.json_str != nullptr);
+        emit_ev("measurement",
+                {{"idx", event.idx}, {"json_str", *event.json_str}});
+        break;
+      case EventId::measurement_start:
+        assert(event.input != nullptr);
+        emit_ev("status.measurement_start",
+                {{"idx", event.idx}, {"input", *event.input}});
+        break;
+      case EventId::measurement_done: {
+        nlohmann::json value{{"idx", event.idx}};
+        if (event.bytes != nullptr) {
+          value["bytes"] = {
+              {"collector", {{"bytes_down", event.bytes->collector_down},
+                             {"bytes_up", event.bytes->collector_up}}},
+              {"nettest", {{"bytes_down", event.bytes->nettest_down},
+                           {"bytes_up", event.bytes->nettest_up}}},
+          };
+        }
+        emit_ev("status.measurement_done", std::move(value));
+        break;
+      }
+      case EventId::measurement_submission:
+        emit_ev("status.measurement_submission", {{"idx", event.idx}});
+        break;
+      case EventId::failure_measurement:
+        assert(event.failure != nullptr);
+        emit_ev("failure.measurement",
+                {{"failure", event.failure}, {"idx", event.idx}});
+        break;
+      case EventId::failure_measurement_submission:
+        assert(event.failure != nullptr);
+        if (event.err == nullptr) {
+          emit_ev("failure.measurement_submission",
+                  {{"failure", event.failure}});
+          break;
+        }
+        assert(event.json_str != nullptr);
+        emit_ev("failure.measurement_submission", {
+            {"failure", event.failure},
+            {"library_error_context", *event.err},
+            {"idx", event.idx},
+            {"json_str", *event.json_str},
+        });
+        break;
+    }
+  } catch (const std::exception &) {
+    // NOTHING
+  }
 }
 
 // Methods you generally DON'T want to override
@@ -1228,25 +4242,95 @@ void Runner::emit_ev(std::string key, nlohmann::json value) const noexcept {
   on_event({{"key", std::move(key)}, {"value", std::move(value)}});
 }
 
-bool Runner::run_with_index32(
+void Runner::emit_typed_ev(const Event &event) const noexcept {
+  on_typed_event(event);
+}
+
+void Runner::emit_measurement(uint32_t idx, const std::string &json_str) const
+    noexcept {
+  Event event;
+  event.id = EventId::measurement;
+  event.idx = idx;
+  event.json_str = &json_str;
+  emit_typed_ev(event);
+}
+
+void Runner::emit_measurement_start(uint32_t idx,
+                                    const std::string &input) const noexcept {
+  Event event;
+  event.id = EventId::measurement_start;
+  event.idx = idx;
+  event.input = &input;
+  emit_typed_ev(event);
+}
+
+void Runner::emit_measurement_done(uint32_t idx) const noexcept {
+  Event event;
+  event.id = EventId::measurement_done;
+  event.idx = idx;
+  emit_typed_ev(event);
+}
+
+void Runner::emit_measurement_done(
+    uint32_t idx, const MeasurementBytes &bytes) const noexcept {
+  Event event;
+  event.id = EventId::measurement_done;
+  event.idx = idx;
+  event.bytes = &bytes;
+  emit_typed_ev(event);
+}
+
+void Runner::emit_measurement_submission(uint32_t idx) const noexcept {
+  Event event;
+  event.id = EventId::measurement_submission;
+  event.idx = idx;
+  emit_typed_ev(event);
+}
+
+void Runner::emit_failure_measurement(uint32_t idx, const char *failure) const
+    noexcept {
+  Event event;
+  event.id = EventId::failure_measurement;
+  event.idx = idx;
+  event.failure = failure;
+  emit_typed_ev(event);
+}
+
+void Runner::emit_failure_measurement_submission(
+    uint32_t idx, const char *failure, const ErrContext *err,
+    const std::string *json_str) const noexcept {
+  Event event;
+  event.id = EventId::failure_measurement_submission;
+  event.idx = idx;
+  event.failure = failure;
+  event.err = err;
+  event.json_str = json_str;
+  emit_typed_ev(event);
+}
+
+bool Runner::run_with_input32(
     const std::chrono::time_point<std::chrono::steady_clock> &begin,
-    const std::string &test_start_time,
-    const std::vector<std::string> &inputs, const NettestContext &ctx,
-    const std::string &collector_base_url, uint32_t i,
-    BytesInfo *info) const noexcept {
-  if (info == nullptr) return false;
+    const std::string &test_start_time, const std::string &input,
+    const NettestContext &ctx, const std::string &collector_base_url,
+    uint32_t i, BytesInfo *info, BytesInfo *collector_info) const noexcept {
+  if (info == nullptr || collector_info == nullptr) return false;
   // TODO(bassosimone): the old code here emitted an event telling the user
   // more about the progress. The progress is actually better computed in the
   // in the outer thread, emitting the progress based on the ETA and/or the
   // number of entries, however, by using that strategy we will loose the
   // possibility of telling the user about the current activity.
-  {
+  if (deadline_ != nullptr) {
+    // We only start a measurement if we expect it to complete in time.
+    if (!deadline_->admit()) {
+      LIBNETTEST2_EMIT_INFO("exceeded max runtime (expected measurement "
+                            "runtime: " << deadline_->estimate() << " s)");
+      return false;
+    }
+  } else {
     auto current_time = std::chrono::steady_clock::now();
     std::chrono::duration<double> elapsed = current_time - begin;
-    // We call a nettest done when we reach 90% of the expected runtime. This
-    // accounts for possible errors and for the time for closing the report.
-    if (settings_.max_runtime >= 0 &&
-        elapsed.count() >= settings_.max_runtime * 0.9) {
+    // Without a scheduler, we call a nettest done when the budget is over.
+    if (elapsed.count() >= runtime_budget(settings_)) {
       LIBNETTEST2_EMIT_INFO("exceeded max runtime");
       return false;
     }
@@ -1255,7 +4339,136 @@ bool Runner::run_with_index32(
   // that he finds confusing to have this event when the nettest has
   // no input. I think that, if this event is omitted, then we would need
   // to omit also similar events for such test. Do we want that?
-  emit_ev("status.measurement_start", {{"idx", i}, {"input", inputs[i]}});
+  emit_measurement_start(i, input);
+  // The fields that are the same for all measurements come from a template
+  // created once per run. Normally run() creates it but we can also create
+  // it on the fly should this method be called directly.
+  std::string local_template;
+  const std::string *ptemplate = measurement_template_;
+  if (ptemplate == nullptr) {
+    if (!make_measurement_template(ctx, test_start_time, &local_template)) {
+      // Note: make_measurement_template() already emitted a warning
+      emit_measurement_done(i);
+      return true;
+    }
+    ptemplate = &local_template;
+  }
+  char id[sole::uuid::str_size];
+  sole::uuid4().str(id);
+  char measurement_start_time[system_clock_now_size];
+  format_system_clock_now(measurement_start_time);
+  nlohmann::json test_keys;
+  auto measurement_start = std::chrono::steady_clock::now();
+  // TODO(bassosimone): make sure we correctly pass downstream the probe_ip
+  // such that the consumer tests could use it to scrub the IP. Currently the
+  // nettest with this requirements is WebConnectivity.
+  //
+  // The nettest accounts the bytes into its own counters, such that we know
+  // the bytes used by each measurement, and we then add them to |info|.
+  BytesInfo nettest_info;
+  metrics_.busy_workers += 1;
+  auto rv = nettest_.run(settings_, ctx, input, &test_keys, &nettest_info);
+  metrics_.busy_workers -= 1;
+  metrics_.record(Phase::nettest_run, measurement_start);
+  MeasurementBytes bytes;
+  bytes.nettest_down = nettest_info.bytes_down;
+  bytes.nettest_up = nettest_info.bytes_up;
+  info->bytes_down += bytes.nettest_down;
+  info->bytes_up += bytes.nettest_up;
+  if (!rv && (interrupted_ || deadline_expired_)) {
+    // The measurement has likely been cut short, so we don't submit it. We
+    // still submit the measurements that succeeded, since they are over.
+    LIBNETTEST2_EMIT_INFO((interrupted_ ? "run: interrupted"
+                                        : "run: cancelled at deadline"));
+    emit_measurement_done(i, bytes);
+    return false;
+  }
+  double test_runtime = 0.0;
+  {
+    auto current_time = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = current_time - measurement_start;
+    test_runtime = elapsed.count();
+    if (deadline_ != nullptr) {
+      deadline_->update(test_runtime);
+    }
+    if (concurrency_ != nullptr && concurrency_->update(elapsed.count(), rv)) {
+      LIBNETTEST2_EMIT_DEBUG("run: adaptive parallelism: "
+                             << concurrency_->limit());
+    }
+  }
+  metrics_.measurements += 1;
+  if (!rv) {
+    // TODO(bassosimone): we should standardize the errors we emit. We can
+    // probably emit something along the lines of library_error.
+    metrics_.measurement_failures += 1;
+    emit_failure_measurement(i, "generic_error");
+  }
+  std::string str;
+  auto serialization_start = std::chrono::steady_clock::now();
+  try {
+    // We fill the resolver_ip after the measurement. Doing that before may
+    // allow the nettest to overwrite the client_resolver field set by us.
+    test_keys["client_resolver"] = settings_.save_real_resolver_ip
+                                       ? ctx.resolver_ip
+                                       : "";
+    auto serialized_test_keys = test_keys.dump();
+    str.reserve(ptemplate->size() + serialized_test_keys.size() +
+                input.size() + 256);
+    str += *ptemplate;
+    str += ",\"id\":";
+    // Note: the UUID consists of hex digits and dashes only.
+    str += '"';
+    str.append(id, sizeof(id));
+    str += '"';
+    // TODO(bassosimone): when the input is the empty string, we should
+    // actually make sure to emit `null` in the JSON rather than the empty
+    // string. This is perhaps also a great suggestion regarding tests that
+    // do not take input even though IIRC we already specified that case.
+    str += ",\"input\":";
+    str += nlohmann::json(input).dump();
+    str += ",\"measurement_start_time\":";
+    // Note: the timestamp consists of digits and separators only.
+    str += '"';
+    str.append(measurement_start_time, sizeof(measurement_start_time));
+    str += '"';
+    str += ",\"test_keys\":";
+    str += serialized_test_keys;
+    str += ",\"test_runtime\":";
+    str += nlohmann::json(test_runtime).dump();
+    str += "}";
+  } catch (const std::exception &e) {
+    LIBNETTEST2_EMIT_WARNING("run: cannot serialize JSON: " << e.what());
+    // TODO(bassosimone): This is MK passing us an invalid JSON. Should we
+    // submit something nonetheless as a form of telemetry? This is something
+    // I should probably discuss with @hellais and/or @darkk.
+    emit_measurement_done(i, bytes);
+    return true;
+  }
+  metrics_.record(Phase::serialization, serialization_start);
+  if (spool_ != nullptr) {
+    spool_->add(ctx.report_id, i, str);
+  }
+  if (submission_queue_ != nullptr) {
+    Submission submission;
+    submission.idx = i;
+    submission.json_str = std::move(str);
+    submission.bytes = bytes;
+    metrics_.queue_depth += 1;
+    if (submission_queue_->push(submission)) {
+      return true;  // The uploader will emit the remaining events
+    }
+    metrics_.queue_depth -= 1;
+    str = std::move(submission.json_str);  // Queue closed: submit ourself
+  }
+  submit_measurement(ctx, collector_base_url, i, std::move(str), bytes,
+                     collector_info);
+  return true;
+}
+
+bool Runner::make_measurement_template(const NettestContext &ctx,
+                                       const std::string &test_start_time,
+                                       std::string *result) const noexcept {
+  if (result == nullptr) return false;
   nlohmann::json measurement;
   // TODO(bassosimone):
   //
@@ -1279,19 +4492,17 @@ bool Runner::run_with_index32(
       settings_.save_real_probe_asn
           ? ctx.probe_network_name
           : "";
-  measurement["id"] = sole::uuid4().str();
-  measurement["input"] = inputs[i];
-  // TODO(bassosimone): when the input is the empty string, we should actually
-  // make sure to emit `null` in the JSON rather than the empty string. This
-  // is perhaps also a great suggestion regarding tests that do not take input
-  // even though IIRC we already specified that specific case.
+  if (settings_.shard_count > 1) {
+    // Note: like other annotations, these are strings (see above).
+    measurement["annotations"]["shard_count"] =
+        std::to_string(settings_.shard_count);
+    measurement["annotations"]["shard_index"] =
+        std::to_string(settings_.shard_index);
+  }
   measurement["input_hashes"] = nlohmann::json::array();
-  measurement["measurement_start_time"] = format_system_clock_now();
-  // TODO(bassosimone): the following was actually also a bug of the code
-  // in MK where we were not able to serialize options. We MAY want to add
-  // support for this feature (could options leak information though?). I
-  // think this is a good topic to discuss with @hellais.
-  measurement["options"] = nlohmann::json::array();
+  // Note: to avoid leaking information, we only serialize the options that
+  // cannot identify the user (see settings_option_fields).
+  measurement["options"] = settings_to_options(settings_);
   measurement["probe_asn"] = settings_.save_real_probe_asn ? ctx.probe_asn : "";
   measurement["probe_cc"] = settings_.save_real_probe_cc ? ctx.probe_cc : "";
   // TODO(bassosimone): this was not implemented in MK. Do we want to
@@ -1343,71 +4554,554 @@ bool Runner::run_with_index32(
   measurement["test_name"] = nettest_.name();
   measurement["test_start_time"] = test_start_time;
   measurement["test_version"] = nettest_.version();
-  nlohmann::json test_keys;
-  auto measurement_start = std::chrono::steady_clock::now();
-  // TODO(bassosimone): make sure we correctly pass downstream the probe_ip
-  // such that the consumer tests could use it to scrub the IP. Currently the
-  // nettest with this requirements is WebConnectivity.
-  auto rv = nettest_.run(settings_, ctx, inputs[i], &test_keys, info);
-  {
-    auto current_time = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed = current_time - measurement_start;
-    measurement["test_runtime"] = elapsed.count();
-  }
-  // We fill the resolver_ip after the measurement. Doing that before may allow
-  // the nettest to overwrite the client_resolver field set by us.
-  measurement["test_keys"] = test_keys;
-  measurement["test_keys"]["client_resolver"] = settings_.save_real_resolver_ip
-                                                ? ctx.resolver_ip
-                                                : "";
-  if (!rv) {
-    // TODO(bassosimone): we should standardize the errors we emit. We can
-    // probably emit something along the lines of library_error.
-    emit_ev("failure.measurement", {
-        {"failure", "generic_error"},
-        {"idx", i},
-    });
+  try {
+    *result = measurement.dump();
+  } catch (const std::exception &e) {
+    LIBNETTEST2_EMIT_WARNING("run: cannot serialize JSON: " << e.what());
+    return false;
+  }
+  // Remove the closing brace so the caller can append the remaining fields.
+  assert(!result->empty() && result->back() == '}');
+  result->pop_back();
+  return true;
+}
+
+void Runner::report_target(const NettestContext &ctx,
+                           const std::string &collector_base_url,
+                           ReportTarget *target) const noexcept {
+  if (target == nullptr) return;
+  if (collectors_ != nullptr && collectors_->current(target)) return;
+  target->index = 0;
+  target->url = collector_base_url;
+  target->report_id = ctx.report_id;
+}
+
+bool Runner::fail_over(const ErrContext &err,
+                       ReportTarget *target) const noexcept {
+  if (target == nullptr || collectors_ == nullptr || transfers_cancelled()) {
+    return false;
+  }
+  // An HTTP error means that the collector is up but did not like the
+  // request, hence another collector would likely not like it either.
+  if (err.library_name != "libcurl" || err.code == CURLE_OK ||
+      err.code == CURLE_HTTP_RETURNED_ERROR) {
+    return false;
+  }
+  auto failed = target->url;
+  if (!collectors_->failover(target)) {
+    LIBNETTEST2_EMIT_WARNING("run: no collector left to fail over to");
+    return false;
+  }
+  LIBNETTEST2_EMIT_INFO("Collector " << failed << " failed; using "
+                        << target->url);
+  return true;
+}
+
+void Runner::submit_measurement(const NettestContext &ctx,
+                                const std::string &collector_base_url,
+                                uint32_t i, std::string str,
+                                MeasurementBytes bytes,
+                                BytesInfo *info) const noexcept {
+  if (info == nullptr) return;
+  if (!settings_.no_collector && !ctx.report_id.empty()) {
+    ErrContext err{};
+    BytesInfo collector_info;
+    ReportTarget target;
+    report_target(ctx, collector_base_url, &target);
+    replace_report_id(&str, ctx.report_id, target.report_id);
+    // Implementation note: as you probably have noticed, this library does
+    // not write anything on the disk, except for the spool when configured
+    // (see Settings::spool_path). The caller however may want to do that
+    // when there's need to do so, by overriding event handlers.
+    auto start = std::chrono::steady_clock::now();
+    auto ok = update_report(target.url, target.report_id, str,
+                            &collector_info, &err);
+    for (auto from = target.report_id; !ok && fail_over(err, &target);
+         from = target.report_id) {
+      replace_report_id(&str, from, target.report_id);
+      err = ErrContext{};
+      ok = update_report(target.url, target.report_id, str, &collector_info,
+                         &err);
+    }
+    metrics_.record(Phase::update_report, start);
+    bytes.collector_down = collector_info.bytes_down;
+    bytes.collector_up = collector_info.bytes_up;
+    info->bytes_down += bytes.collector_down;
+    info->bytes_up += bytes.collector_up;
+    metrics_.submissions += 1;
+    if (!ok) {
+      LIBNETTEST2_EMIT_WARNING("run: update_report() failed");
+      metrics_.submission_failures += 1;
+      if (spool_ != nullptr) spool_->failed(ctx.report_id, i);
+      emit_failure_measurement_submission(i, "library_error", &err, &str);
+    } else {
+      if (spool_ != nullptr) spool_->done(ctx.report_id, i);
+      emit_measurement_submission(i);
+    }
+  } else if (ctx.report_id.empty()) {
+    emit_failure_measurement_submission(i, "report_not_open_error", nullptr,
+                                        nullptr);
+  }
+  // According to several discussions with @lorenzoPrimi, it is much better
+  // for this event to be emitted AFTER submitting the report.
+  emit_measurement(i, str);
+  emit_measurement_done(i, bytes);
+}
+
+void Runner::submit_measurements(const NettestContext &ctx,
+                                 const std::string &collector_base_url,
+                                 std::vector<Submission> batch,
+                                 BytesInfo *info) const noexcept {
+  if (info == nullptr) return;
+  if (batch.size() == 1 || settings_.no_collector || ctx.report_id.empty()) {
+    for (auto &submission : batch) {
+      submit_measurement(ctx, collector_base_url, submission.idx,
+                         std::move(submission.json_str), submission.bytes,
+                         info);
+    }
+    return;
+  }
+  std::vector<ErrContext> errs;
+  ReportTarget target;
+  report_target(ctx, collector_base_url, &target);
+  for (auto &submission : batch) {
+    replace_report_id(&submission.json_str, ctx.report_id, target.report_id);
+  }
+  auto start = std::chrono::steady_clock::now();
+  auto ok = update_report_many(target.url, target.report_id, &batch, &errs,
+                               info);
+  errs.resize(batch.size());  // Just in case it's not the expected size
+  // When we fail over, we submit again only the failed measurements.
+  auto first_failure = [&errs]() -> size_t {
+    size_t k = 0;
+    while (k < errs.size() && errs[k].code == 0) ++k;
+    return k;
+  };
+  auto from = target.report_id;
+  for (auto failed = first_failure();
+       failed < errs.size() && fail_over(errs[failed], &target);
+       failed = first_failure()) {
+    std::vector<Submission> retries;
+    std::vector<size_t> indexes;
+    for (size_t k = 0; k < batch.size(); ++k) {
+      if (errs[k].code == 0) continue;
+      replace_report_id(&batch[k].json_str, from, target.report_id);
+      retries.push_back(std::move(batch[k]));
+      indexes.push_back(k);
+    }
+    from = target.report_id;
+    std::vector<ErrContext> retry_errs;
+    ok = update_report_many(target.url, target.report_id, &retries,
+                            &retry_errs, info);
+    retry_errs.resize(retries.size());
+    for (size_t r = 0; r < retries.size(); ++r) {
+      batch[indexes[r]] = std::move(retries[r]);
+      errs[indexes[r]] = std::move(retry_errs[r]);
+    }
+  }
+  metrics_.record(Phase::update_report, start);
+  if (!ok) {
+    LIBNETTEST2_EMIT_WARNING("run: update_report_many() failed");
+  }
+  for (size_t k = 0; k < batch.size(); ++k) {
+    auto i = batch[k].idx;
+    auto &str = batch[k].json_str;
+    metrics_.submissions += 1;
+    if (errs[k].code != 0) {
+      metrics_.submission_failures += 1;
+      if (spool_ != nullptr) spool_->failed(ctx.report_id, i);
+      emit_failure_measurement_submission(i, "library_error", &errs[k], &str);
+    } else {
+      if (spool_ != nullptr) spool_->done(ctx.report_id, i);
+      emit_measurement_submission(i);
+    }
+    emit_measurement(i, str);
+    emit_measurement_done(i, batch[k].bytes);
   }
+}
+
+// Measurement submission
+// ``````````````````````
+
+SubmissionQueue::SubmissionQueue(size_t capacity) noexcept
+    : capacity_{(capacity > 0) ? capacity : 1} {}
+
+bool SubmissionQueue::push(Submission &submission) noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  cond_.wait(lock, [this]() { return closed_ || queue_.size() < capacity_; });
+  if (closed_) return false;
+  queue_.push_back(std::move(submission));
+  cond_.notify_all();
+  return true;
+}
+
+bool SubmissionQueue::pop(Submission *submission) noexcept {
+  if (submission == nullptr) return false;
+  std::unique_lock<std::mutex> lock{mutex_};
+  cond_.wait(lock, [this]() { return closed_ || !queue_.empty(); });
+  if (queue_.empty()) return false;  // Implies closed_
+  *submission = std::move(queue_.front());
+  queue_.pop_front();
+  cond_.notify_all();
+  return true;
+}
+
+bool SubmissionQueue::pop_batch(std::vector<Submission> *batch, size_t count,
+                                std::chrono::milliseconds timeout) noexcept {
+  if (batch == nullptr) return false;
+  std::unique_lock<std::mutex> lock{mutex_};
+  cond_.wait(lock, [this]() { return closed_ || !queue_.empty(); });
+  if (queue_.empty()) return false;  // Implies closed_
+  auto deadline = std::chrono::steady_clock::now() + timeout;
   do {
-    std::string str;
-    try {
-      str = measurement.dump();
-    } catch (const std::exception &e) {
-      LIBNETTEST2_EMIT_WARNING("run: cannot serialize JSON: " << e.what());
-      // TODO(bassosimone): This is MK passing us an invalid JSON. Should we
-      // submit something nonetheless as a form of telemetry? This is something
-      // I should probably discuss with @hellais and/or @darkk.
-      break;
+    while (!queue_.empty() && batch->size() < count) {
+      batch->push_back(std::move(queue_.front()));
+      queue_.pop_front();
     }
-    if (!settings_.no_collector && !ctx.report_id.empty()) {
-      ErrContext err{};
-      // Implementation note: as you probably have noticed, this library does
-      // not write anything on the disk. The caller however may want to do that
-      // when there's need to do so, by overriding event handlers.
-      if (!update_report(collector_base_url, ctx.report_id, str, info, &err)) {
-        LIBNETTEST2_EMIT_WARNING("run: update_report() failed");
-        emit_ev("failure.measurement_submission", {
-            {"failure", "library_error"},
-            {"library_error_context", err},
-            {"idx", i},
-            {"json_str", str},
-        });
-      } else {
-        emit_ev("status.measurement_submission", {{"idx", i}});
+    cond_.notify_all();
+  } while (batch->size() < count &&
+           cond_.wait_until(lock, deadline, [this]() {
+             return closed_ || !queue_.empty();
+           }) &&
+           !queue_.empty());
+  return true;
+}
+
+void SubmissionQueue::close() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  closed_ = true;
+  cond_.notify_all();
+}
+
+// Temporary files
+// ```````````````
+
+// unique_tmp_path() returns the path of a temporary file, next to |path|,
+// that no other thread or process is writing, such that we can write it
+// and then atomically rename it to |path|.
+static std::string unique_tmp_path(const std::string &path) noexcept {
+#ifdef _WIN32
+  auto pid = (long)::_getpid();
+#else
+  auto pid = (long)::getpid();
+#endif
+  // Note: the random number distinguishes the threads of this process.
+  return path + "." + std::to_string(pid) + "." +
+         std::to_string(random_engine()()) + ".tmp";
+}
+
+// Submission spool
+// ````````````````
+
+static std::string spool_prefix(const std::string &report_id, uint32_t idx) {
+  std::string prefix = "{\"idx\":";
+  prefix += std::to_string(idx);
+  prefix += ",\"report_id\":";
+  prefix += nlohmann::json(report_id).dump();
+  prefix += ",\"measurement\":";
+  return prefix;
+}
+
+Spool::Spool(std::string path) noexcept : path_{std::move(path)} {}
+
+bool Spool::open(ErrContext *err) noexcept {
+  if (err == nullptr) return false;
+  std::unique_lock<std::mutex> _{mutex_};
+  if (file_ != nullptr) {
+    err->reason = "spool_already_open";
+    return false;
+  }
+  // Rewriting the file would invalidate the offsets of the records of another
+  // Spool using it, and a Spool removes the file once it has no records.
+  if (!lock_file_locked(err)) return false;
+  // We rewrite the spool keeping only the measurements not submitted yet,
+  // which also drops a partial line left over by a crash. Since the markers
+  // come after the measurements, we first load the lines and then write
+  // those that have not been marked as submitted.
+  std::vector<std::string> lines;
+  std::map<std::string, std::map<uint32_t, size_t>> index;
+  {
+    std::ifstream file{path_, std::ios::binary};
+    std::string line;
+    while (std::getline(file, line)) {
+      try {
+        auto entry = nlohmann::json::parse(line);
+        auto report_id = entry.at("report_id").get<std::string>();
+        auto idx = entry.at("idx").get<uint32_t>();
+        if (entry.count("done") > 0) {
+          index[report_id].erase(idx);
+          continue;
+        }
+        if (entry.count("measurement") == 0) continue;
+        index[report_id][idx] = lines.size();
+        lines.push_back(std::move(line));
+      } catch (const std::exception &) {
+        // Skip the line, e.g. a partial line at the end of the file
       }
-    } else if (ctx.report_id.empty()) {
-      emit_ev("failure.measurement_submission", {{
-          "failure", "report_not_open_error"
-      }});
     }
-    // According to several discussions with @lorenzoPrimi, it is much better
-    // for this event to be emitted AFTER submitting the report.
-    emit_ev("measurement", {{"idx", i}, {"json_str", std::move(str)}});
-  } while (0);
-  emit_ev("status.measurement_done", {{"idx", i}});
+  }
+  std::string tmpname = path_ + ".tmp";
+  FILE *file = ::fopen(tmpname.data(), "wb");
+  if (file == nullptr) {
+    unlock_file_locked();
+    err->reason = "spool_open_error";
+    return false;
+  }
+  uint64_t offset = 0;
+  bool ok = true;
+  for (auto &report : index) {
+    for (auto &pair : report.second) {
+      auto &line = lines[pair.second];
+      Record record;
+      record.failed = true;  // From previous runs, hence never submitted
+      record.length = line.size();
+      record.offset = offset;
+      records_[report.first][pair.first] = record;
+      offset += line.size() + 1;
+      ok = ok && ::fwrite(line.data(), 1, line.size(), file) == line.size() &&
+           ::fputc('\n', file) != EOF;
+    }
+  }
+  ok = ::fflush(file) == 0 && ok;
+  ::fclose(file);
+#ifdef _WIN32
+  // Windows does not allow rename() to replace an existing file.
+  (void)::remove(path_.data());
+#endif
+  if (!ok || ::rename(tmpname.data(), path_.data()) != 0) {
+    records_.clear();
+    unlock_file_locked();
+    err->reason = "spool_write_error";
+    return false;
+  }
+  file_ = ::fopen(path_.data(), "ab");
+  if (file_ == nullptr) {
+    records_.clear();
+    unlock_file_locked();
+    err->reason = "spool_open_error";
+    return false;
+  }
+  synced_ = offset;
+  thread_ = std::thread{[this]() noexcept { loop(); }};
+  return true;
+}
+
+bool Spool::lock_file_locked(ErrContext *err) noexcept {
+  // Note: we never remove the lock file, otherwise a Spool could lock the
+  // removed file while another one locks the file created after it.
+  std::string lockname = path_ + ".lock";
+#ifdef _WIN32
+  // Denying sharing makes opening fail while another Spool has it open.
+  if (::_sopen_s(&lock_fd_, lockname.data(), _O_CREAT | _O_RDWR, _SH_DENYRW,
+                 _S_IREAD | _S_IWRITE) != 0) {
+    lock_fd_ = -1;
+    err->reason = (errno == EACCES) ? "spool_busy_error" : "spool_open_error";
+    return false;
+  }
+#else
+  lock_fd_ = ::open(lockname.data(), O_CREAT | O_RDWR, 0600);
+  if (lock_fd_ == -1) {
+    err->reason = "spool_open_error";
+    return false;
+  }
+  // Note: unlike fcntl() locks, flock() locks conflict also when they are
+  // taken by the same process, so they also exclude the Runners sharing it.
+  if (::flock(lock_fd_, LOCK_EX | LOCK_NB) != 0) {
+    unlock_file_locked();
+    err->reason = "spool_busy_error";
+    return false;
+  }
+#endif
+  return true;
+}
+
+void Spool::unlock_file_locked() noexcept {
+  if (lock_fd_ == -1) return;
+  // Closing the file releases the lock.
+#ifdef _WIN32
+  (void)::_close(lock_fd_);
+#else
+  (void)::close(lock_fd_);
+#endif
+  lock_fd_ = -1;
+}
+
+void Spool::append_locked(std::string line) noexcept {
+  buffer_ += line;
+  buffer_ += "\n";
+  // We don't wake up the writer for each entry, so that it syncs the file
+  // once per batch, unless we are buffering a lot of data.
+  constexpr size_t max_buffer = 1 << 20;
+  if (buffer_.size() >= max_buffer) cond_.notify_all();
+}
+
+void Spool::add(const std::string &report_id, uint32_t idx,
+                const std::string &json_str) noexcept {
+  std::string line;
+  try {
+    line = spool_prefix(report_id, idx);
+    line.reserve(line.size() + json_str.size() + 1);
+    line += json_str;
+    line += "}";
+  } catch (const std::exception &) {
+    return;
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  if (file_ == nullptr) return;
+  Record record;
+  record.length = line.size();
+  record.offset = synced_ + buffer_.size();
+  records_[report_id][idx] = record;
+  append_locked(std::move(line));
+}
+
+void Spool::done(const std::string &report_id, uint32_t idx) noexcept {
+  std::string line;
+  try {
+    line = "{\"done\":true,\"idx\":";
+    line += std::to_string(idx);
+    line += ",\"report_id\":";
+    line += nlohmann::json(report_id).dump();
+    line += "}";
+  } catch (const std::exception &) {
+    return;
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  if (file_ == nullptr) return;
+  auto report = records_.find(report_id);
+  if (report == records_.end() || report->second.erase(idx) == 0) return;
+  if (report->second.empty()) records_.erase(report);
+  append_locked(std::move(line));
+}
+
+void Spool::failed(const std::string &report_id, uint32_t idx) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  auto report = records_.find(report_id);
+  if (report == records_.end()) return;
+  auto record = report->second.find(idx);
+  if (record != report->second.end()) record->second.failed = true;
+}
+
+std::vector<uint32_t> Spool::failed_indexes(
+    const std::string &report_id) noexcept {
+  std::vector<uint32_t> indexes;
+  std::unique_lock<std::mutex> _{mutex_};
+  auto report = records_.find(report_id);
+  if (report == records_.end()) return indexes;
+  for (auto &pair : report->second) {
+    auto &record = pair.second;
+    if (record.failed && record.offset + record.length <= synced_) {
+      indexes.push_back(pair.first);
+    }
+  }
+  return indexes;
+}
+
+std::vector<std::string> Spool::report_ids() noexcept {
+  std::vector<std::string> ids;
+  std::unique_lock<std::mutex> _{mutex_};
+  for (auto &report : records_) {
+    ids.push_back(report.first);
+  }
+  return ids;
+}
+
+bool Spool::read(const std::string &report_id, uint32_t idx,
+                 std::string *json_str) noexcept {
+  if (json_str == nullptr) return false;
+  Record record;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    auto report = records_.find(report_id);
+    if (report == records_.end()) return false;
+    auto it = report->second.find(idx);
+    if (it == report->second.end()) return false;
+    record = it->second;
+    if (record.offset + record.length > synced_) return false;
+  }
+  // Note: the file is append only, so the record cannot change under us.
+  try {
+    std::ifstream file{path_, std::ios::binary};
+    std::string line((size_t)record.length, '\0');
+    if (!file.seekg((std::streamoff)record.offset) ||
+        !file.read(&line[0], (std::streamsize)line.size())) {
+      return false;
+    }
+    auto prefix = spool_prefix(report_id, idx);
+    if (line.size() <= prefix.size() ||
+        line.compare(0, prefix.size(), prefix) != 0 || line.back() != '}') {
+      return false;
+    }
+    *json_str = line.substr(prefix.size(), line.size() - prefix.size() - 1);
+  } catch (const std::exception &) {
+    return false;
+  }
   return true;
 }
 
+size_t Spool::pending() noexcept {
+  size_t count = 0;
+  std::unique_lock<std::mutex> _{mutex_};
+  for (auto &report : records_) {
+    count += report.second.size();
+  }
+  return count;
+}
+
+void Spool::sync() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  if (file_ == nullptr) return;
+  auto target = synced_ + buffer_.size();
+  sync_requested_ = true;
+  cond_.notify_all();
+  cond_.wait(lock, [this, target]() { return synced_ >= target || stop_; });
+}
+
+void Spool::loop() noexcept {
+  constexpr std::chrono::milliseconds sync_interval{100};
+  std::unique_lock<std::mutex> lock{mutex_};
+  for (;;) {
+    (void)cond_.wait_for(lock, sync_interval, [this]() {
+      return stop_ || sync_requested_ || buffer_.size() >= (1 << 20);
+    });
+    if (!buffer_.empty()) {
+      std::string data;
+      std::swap(data, buffer_);
+      lock.unlock();
+      // Note: if writing fails we keep going, since there is not much else
+      // we can do, and the measurements are still submitted anyway.
+      (void)::fwrite(data.data(), 1, data.size(), file_);
+      (void)::fflush(file_);
+#ifdef _WIN32
+      (void)::_commit(::_fileno(file_));
+#else
+      (void)::fsync(::fileno(file_));
+#endif
+      lock.lock();
+      synced_ += data.size();
+    }
+    sync_requested_ = false;
+    cond_.notify_all();  // Wake up the threads waiting in sync()
+    if (stop_ && buffer_.empty()) break;
+  }
+}
+
+Spool::~Spool() noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    stop_ = true;
+    cond_.notify_all();
+  }
+  if (thread_.joinable()) thread_.join();
+  if (file_ != nullptr) {
+    ::fclose(file_);
+    // All measurements have been submitted, so we don't need the file. We
+    // still hold the lock, hence no other Spool is using it.
+    if (records_.empty()) (void)::remove(path_.data());
+  }
+  unlock_file_locked();
+}
+
 // TODO(bassosimone): we should _probably_ make this configurable. One way to
 // do that MAY be to use the net/timeout setting.
 constexpr long curl_timeout = 5;
@@ -1580,6 +5274,311 @@ bool Runner::query_bouncer(std::string nettest_name,
         << " front='" << info.front << "'");
     }
   }
+  // Nettests cannot run without their helpers, so make this visible.
+  for (auto &name : nettest_helper_names) {
+    if (test_helpers->count(name) <= 0 || (*test_helpers)[name].empty()) {
+      LIBNETTEST2_EMIT_WARNING("query_bouncer: missing test helper: " << name);
+    }
+  }
+  return true;
+}
+
+// Discovery cache
+// ```````````````
+
+static std::mutex &discovery_cache_mutex() noexcept {
+  static std::mutex mtx;
+  return mtx;
+}
+
+static int64_t discovery_cache_now() noexcept {
+  return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+DiscoveryCache::DiscoveryCache(std::string path) noexcept
+    : path_{std::move(path)} {}
+
+bool DiscoveryCache::get(const std::string &key, int64_t ttl,
+                         nlohmann::json *value, bool *fresh) noexcept {
+  if (value == nullptr || fresh == nullptr) return false;
+  std::unique_lock<std::mutex> _{discovery_cache_mutex()};
+  try {
+    if (!loaded_) {
+      loaded_ = true;
+      std::ifstream file{path_};
+      if (!path_.empty() && file.good()) doc_ = nlohmann::json::parse(file);
+    }
+    auto &entry = doc_.at(key);
+    int64_t stored = entry.at("time");
+    *value = entry.at("value");
+    *fresh = (discovery_cache_now() - stored) < ttl;
+  } catch (const std::exception &) {
+    return false;
+  }
+  return true;
+}
+
+bool DiscoveryCache::put(const std::string &key,
+                         nlohmann::json value) noexcept {
+  std::unique_lock<std::mutex> _{discovery_cache_mutex()};
+  try {
+    nlohmann::json doc = nlohmann::json::object();
+    if (path_.empty()) {
+      if (doc_.is_object()) doc = std::move(doc_);
+      doc[key] = {{"time", discovery_cache_now()}, {"value", std::move(value)}};
+      doc_ = std::move(doc);
+      loaded_ = true;
+      return true;
+    }
+    {
+      // We merge with the file, which others may have written meanwhile.
+      std::ifstream file{path_};
+      if (file.good()) {
+        try {
+          doc = nlohmann::json::parse(file);
+        } catch (const std::exception &) {
+          // Overwrite a corrupt cache
+        }
+      }
+      if (!doc.is_object()) doc = nlohmann::json::object();
+    }
+    doc[key] = {{"time", discovery_cache_now()}, {"value", std::move(value)}};
+    // Note: the name is unique such that concurrent writers, possibly in
+    // other processes, don't truncate each other's temporary file.
+    std::string tmpname = unique_tmp_path(path_);
+    {
+      std::ofstream file{tmpname};
+      file << doc.dump();
+      if (!file.good()) {
+        file.close();
+        (void)::remove(tmpname.data());
+        return false;
+      }
+    }
+    doc_ = std::move(doc);
+    loaded_ = true;
+#ifdef _WIN32
+    // Windows does not allow rename() to replace an existing file.
+    (void)::remove(path_.data());
+#endif
+    if (::rename(tmpname.data(), path_.data()) != 0) {
+      (void)::remove(tmpname.data());
+      return false;
+    }
+  } catch (const std::exception &) {
+    return false;
+  }
+  return true;
+}
+
+static nlohmann::json endpoints_to_json(
+    const std::vector<EndpointInfo> &endpoints) {
+  nlohmann::json array = nlohmann::json::array();
+  for (auto &epnt : endpoints) {
+    array.push_back({{"type", epnt.type},
+                     {"address", epnt.address},
+                     {"front", epnt.front}});
+  }
+  return array;
+}
+
+static std::vector<EndpointInfo> endpoints_from_json(
+    const nlohmann::json &array) {
+  std::vector<EndpointInfo> endpoints;
+  for (auto &entry : array) {
+    EndpointInfo epnt;
+    epnt.type = entry.at("type");
+    epnt.address = entry.at("address");
+    epnt.front = entry.at("front");
+    endpoints.push_back(std::move(epnt));
+  }
+  return endpoints;
+}
+
+std::shared_ptr<DiscoveryCache> Runner::discovery_cache() const noexcept {
+  return discovery_cache_;
+}
+
+static int64_t discovery_cache_ttl(const Settings &settings) noexcept {
+  constexpr int64_t default_ttl = 3600;
+  return (settings.discovery_cache_ttl > 0) ? settings.discovery_cache_ttl
+                                            : default_ttl;
+}
+
+bool Runner::query_bouncer_cached(
+    std::string nettest_name, std::vector<std::string> nettest_helper_names,
+    std::string nettest_version, std::vector<EndpointInfo> *collectors,
+    std::map<std::string, std::vector<EndpointInfo>> *test_helpers,
+    BytesInfo *info, ErrContext *err) noexcept {
+  auto cache = discovery_cache();
+  if (!cache) {
+    return query_bouncer(std::move(nettest_name),
+                         std::move(nettest_helper_names),
+                         std::move(nettest_version), collectors, test_helpers,
+                         info, err);
+  }
+  if (collectors == nullptr || test_helpers == nullptr ||
+      info == nullptr || err == nullptr) {
+    LIBNETTEST2_EMIT_WARNING("query_bouncer_cached: passed null pointers");
+    return false;
+  }
+  // The bouncer response depends on the bouncer and on the nettest.
+  std::string key = "bouncer " + without_final_slash(
+      settings_.bouncer_base_url) + " " + nettest_name + " " + nettest_version;
+  for (auto &name : nettest_helper_names) {
+    key += " " + name;
+  }
+  auto store = [cache, this, key](
+      const std::vector<EndpointInfo> &collectors,
+      const std::map<std::string, std::vector<EndpointInfo>> &test_helpers) {
+    try {
+      nlohmann::json value;
+      value["collectors"] = endpoints_to_json(collectors);
+      value["test_helpers"] = nlohmann::json::object();
+      for (auto &pair : test_helpers) {
+        value["test_helpers"][pair.first] = endpoints_to_json(pair.second);
+      }
+      if (!cache->put(key, std::move(value))) {
+        LIBNETTEST2_EMIT_WARNING("query_bouncer_cached: cannot write cache");
+      }
+    } catch (const std::exception &exc) {
+      LIBNETTEST2_EMIT_WARNING("query_bouncer_cached: " << exc.what());
+    }
+  };
+  nlohmann::json value;
+  auto fresh = false;
+  if (cache->get(key, discovery_cache_ttl(settings_), &value, &fresh)) {
+    try {
+      *collectors = endpoints_from_json(value.at("collectors"));
+      test_helpers->clear();
+#ifdef NLOHMANN_JSON_VERSION_MAJOR  // >= v3.0.0
+      for (auto &entry : value.at("test_helpers").items()) {
+#else
+      for (auto &entry : nlohmann::json::iterator_wrapper(value.at("test_helpers"))) {
+#endif
+        (*test_helpers)[entry.key()] = endpoints_from_json(entry.value());
+      }
+      LIBNETTEST2_EMIT_INFO("Using cached bouncer response"
+                            << ((fresh) ? "" : " (refreshing it)"));
+      if (!fresh) {
+        discovery_refreshes_.add(1);
+        worker_pool_->submit([
+          info, key, nettest_helper_names, nettest_name, nettest_version,
+          store, this
+        ]() noexcept {
+          std::vector<EndpointInfo> collectors;
+          std::map<std::string, std::vector<EndpointInfo>> test_helpers;
+          ErrContext err{};
+          if (query_bouncer(nettest_name, nettest_helper_names,
+                            nettest_version, &collectors, &test_helpers,
+                            info, &err)) {
+            store(collectors, test_helpers);
+          }
+          discovery_refreshes_.done();
+        });
+      }
+      return true;
+    } catch (const std::exception &exc) {
+      LIBNETTEST2_EMIT_WARNING("query_bouncer_cached: invalid cache entry: "
+                               << exc.what());
+      // FALLTHROUGH
+    }
+  }
+  if (!query_bouncer(std::move(nettest_name), std::move(nettest_helper_names),
+                     std::move(nettest_version), collectors, test_helpers,
+                     info, err)) {
+    return false;
+  }
+  store(*collectors, *test_helpers);
+  return true;
+}
+
+// route_source_ip() returns the local address we would use to reach the
+// Internet, or an empty string if we cannot know it, e.g. when offline. Note
+// that connecting a UDP socket sends nothing, it just selects the route.
+static std::string route_source_ip() noexcept {
+  for (auto target : {"8.8.8.8", "2001:4860:4860::8888"}) {
+    addrinfo hints{};
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *rp = nullptr;
+    if (::getaddrinfo(target, "53", &hints, &rp) != 0) continue;
+    std::string address;
+    auto fd = ::socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+#ifdef _WIN32
+    if (fd != INVALID_SOCKET) {
+#else
+    if (fd != -1) {
+#endif
+      sockaddr_storage ss{};
+      socklen_t sslen = sizeof(ss);
+      char host[NI_MAXHOST];
+      if (::connect(fd, rp->ai_addr, (socklen_t)rp->ai_addrlen) == 0 &&
+          ::getsockname(fd, (sockaddr *)&ss, &sslen) == 0 &&
+          ::getnameinfo((sockaddr *)&ss, sslen, host, sizeof(host), nullptr, 0,
+                        NI_NUMERICHOST) == 0) {
+        address = host;
+      }
+#ifdef _WIN32
+      (void)::closesocket(fd);
+#else
+      (void)::close(fd);
+#endif
+    }
+    ::freeaddrinfo(rp);
+    if (!address.empty()) return address;
+  }
+  return "";
+}
+
+bool Runner::lookup_ip_cached(std::string *ip, BytesInfo *info,
+                              ErrContext *err) noexcept {
+  auto cache = discovery_cache();
+  if (!cache) {
+    return lookup_ip(ip, info, err);
+  }
+  if (ip == nullptr || info == nullptr || err == nullptr) {
+    LIBNETTEST2_EMIT_WARNING("lookup_ip_cached: passed null pointers");
+    return false;
+  }
+  // The probe IP depends on the network we're using, hence we key it by the
+  // local address, which usually changes along with the network.
+  auto key = "probe_ip " + route_source_ip();
+  auto store = [cache, key, this](const std::string &ip) {
+    if (!cache->put(key, ip)) {
+      LIBNETTEST2_EMIT_WARNING("lookup_ip_cached: cannot write cache");
+    }
+  };
+  // Since a wrong probe IP means a wrong ASN and CC for the whole report, we
+  // only use a stale entry for a while, otherwise we look up the IP again.
+  auto ttl = discovery_cache_ttl(settings_);
+  nlohmann::json value;
+  auto fresh = false;
+  auto usable = false;
+  if (cache->get(key, 2 * ttl, &value, &usable) && usable &&
+      cache->get(key, ttl, &value, &fresh) && value.is_string()) {
+    *ip = value.get<std::string>();
+    LIBNETTEST2_EMIT_INFO("Using cached probe IP"
+                          << ((fresh) ? "" : " (refreshing it)"));
+    if (!fresh) {
+      discovery_refreshes_.add(1);
+      worker_pool_->submit([info, store, this]() noexcept {
+        std::string ip;
+        ErrContext err{};
+        if (lookup_ip(&ip, info, &err)) {
+          store(ip);
+        }
+        discovery_refreshes_.done();
+      });
+    }
+    return true;
+  }
+  if (!lookup_ip(ip, info, err)) {
+    return false;
+  }
+  store(*ip);
   return true;
 }
 
@@ -1703,9 +5702,6 @@ bool Runner::open_report(const std::string &collector_base_url,
   // fail in case the collector URL is empty.
   //
   // TODO(bassosimone): to match the functionality currently in MK, here we
-  // should implement talking to a domain fronted collector.
-  //
-  // TODO(bassosimone): to match the functionality currently in MK, here we
   // should return an error if the entry does not look like valid.
   url += "/report";
   LIBNETTEST2_EMIT_DEBUG("open_report: URL: " << url);
@@ -1728,40 +5724,80 @@ bool Runner::open_report(const std::string &collector_base_url,
   return true;
 }
 
+// An update report request is an envelope wrapping the JSON measurement. We
+// send it in pieces, so that the measurement is neither copied nor escaped.
+constexpr const char report_entry_prefix[] = "{\"content\":";
+constexpr const char report_entry_suffix[] = ",\"format\":\"json\"}";
+
+static void report_entry_body(const std::string &json_str,
+                              Runner::CurlxBody *body) noexcept {
+  body->pieces.clear();
+  body->pieces.emplace_back(report_entry_prefix,
+                            sizeof(report_entry_prefix) - 1);
+  body->pieces.emplace_back(json_str.data(), json_str.size());
+  body->pieces.emplace_back(report_entry_suffix,
+                            sizeof(report_entry_suffix) - 1);
+}
+
 bool Runner::update_report(const std::string &collector_base_url,
                            const std::string &report_id,
                            const std::string &json_str,
                            BytesInfo *info,
                            ErrContext *err) const noexcept {
   if (info == nullptr || err == nullptr) return false;
-  std::string responsebody;
   std::string url = without_final_slash(collector_base_url);
   url += "/report/";
   url += report_id;
-  nlohmann::json message;
-  message["content"] = json_str;
-  message["format"] = "json";
-  std::string requestbody;
-  try {
-    requestbody = message.dump();
-  } catch (const std::exception &exc) {
-    LIBNETTEST2_EMIT_WARNING("update_report: cannot serialize request");
-    err->reason = 1;
-    err->library_name = "nlohmann/json";
-    err->library_version = nlohmann_json_version();
-    err->reason = exc.what();
-    return false;
-  }
-  LIBNETTEST2_EMIT_DEBUG("update_report: JSON request: " << requestbody);
+  LIBNETTEST2_EMIT_DEBUG("update_report: JSON measurement: " << json_str);
   LIBNETTEST2_EMIT_DEBUG("update_report: URL: " << url);
-  if (!curlx_post_json(std::move(url), std::move(requestbody), curl_timeout,
-                       &responsebody, info, err)) {
+  std::vector<CurlxRequest> requests(1);
+  requests[0].url = std::move(url);
+  report_entry_body(json_str, &requests[0].body);
+  if (!curlx_multi_post_json(&requests, curl_timeout, info)) {
+    *err = std::move(requests[0].err);
     return false;
   }
-  LIBNETTEST2_EMIT_DEBUG("update_report: JSON reply: " << responsebody);
+  LIBNETTEST2_EMIT_DEBUG("update_report: JSON reply: "
+                         << requests[0].responsebody);
   return true;
 }
 
+bool Runner::update_report_many(const std::string &collector_base_url,
+                                const std::string &report_id,
+                                std::vector<Submission> *batch,
+                                std::vector<ErrContext> *errs,
+                                BytesInfo *info) const noexcept {
+  if (batch == nullptr || errs == nullptr || info == nullptr) return false;
+  errs->clear();
+  errs->resize(batch->size());
+  std::string url = without_final_slash(collector_base_url);
+  url += "/report/";
+  url += report_id;
+  LIBNETTEST2_EMIT_DEBUG("update_report_many: URL: " << url);
+  LIBNETTEST2_EMIT_DEBUG("update_report_many: count: " << batch->size());
+  std::vector<CurlxRequest> requests(batch->size());
+  for (size_t k = 0; k < batch->size(); ++k) {
+    requests[k].url = url;
+    report_entry_body((*batch)[k].json_str, &requests[k].body);
+  }
+  auto rv = true;
+  (void)curlx_multi_post_json(&requests, curl_timeout, info);
+  for (size_t r = 0; r < requests.size(); ++r) {
+    (*batch)[r].bytes.collector_down += requests[r].bytes_down;
+    (*batch)[r].bytes.collector_up += requests[r].bytes_up;
+    auto &err = (*errs)[r];
+    if (!requests[r].ok) {
+      err = std::move(requests[r].err);
+      rv = false;
+      continue;
+    }
+    LIBNETTEST2_EMIT_DEBUG("update_report_many: JSON reply: "
+                           << requests[r].responsebody);
+    err.code = 0;
+  }
+  return rv;
+}
+
 bool Runner::close_report(const std::string &collector_base_url,
                           const std::string &report_id,
                           BytesInfo *info,
@@ -1779,6 +5815,315 @@ bool Runner::close_report(const std::string &collector_base_url,
   return true;
 }
 
+// Endpoint selection
+// ``````````````````
+
+// endpoint_authority() returns the host name in the URL |address|, followed
+// by the port, if any, i.e. the value of the Host header for |address|.
+static std::string endpoint_authority(const std::string &address) noexcept {
+  auto begin = address.find("://");
+  begin = (begin != std::string::npos) ? begin + 3 : 0;
+  auto end = address.find_first_of("/?#", begin);
+  return address.substr(begin, (end != std::string::npos) ? end - begin
+                                                          : std::string::npos);
+}
+
+EndpointSelector::EndpointSelector(
+    std::vector<EndpointInfo> ranked, OpenFunc open) noexcept
+    : endpoints_{std::move(ranked)}, report_ids_(endpoints_.size()),
+      open_{std::move(open)}, current_{endpoints_.size()} {}
+
+bool EndpointSelector::open(ReportTarget *target) noexcept {
+  if (target == nullptr) return false;
+  std::unique_lock<std::mutex> _{failover_mutex_};
+  return open_from(0, target);
+}
+
+bool EndpointSelector::current(ReportTarget *target) const noexcept {
+  if (target == nullptr) return false;
+  std::unique_lock<std::mutex> _{mutex_};
+  return this->target(current_, target);
+}
+
+bool EndpointSelector::failover(ReportTarget *target) noexcept {
+  if (target == nullptr) return false;
+  std::unique_lock<std::mutex> _{failover_mutex_};
+  {
+    // Another thread may have already failed over while we waited.
+    std::unique_lock<std::mutex> _{mutex_};
+    if (current_ != target->index) return this->target(current_, target);
+  }
+  return open_from(target->index + 1, target);
+}
+
+std::vector<ReportTarget> EndpointSelector::reports() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  std::vector<ReportTarget> reports;
+  for (size_t i = 0; i < endpoints_.size(); ++i) {
+    ReportTarget target;
+    if (!report_ids_[i].empty() && this->target(i, &target)) {
+      reports.push_back(std::move(target));
+    }
+  }
+  return reports;
+}
+
+bool EndpointSelector::front(const std::string &url, std::string *fronted,
+                             std::string *host) const noexcept {
+  if (fronted == nullptr || host == nullptr) return false;
+  for (auto &epnt : endpoints_) {
+    if (epnt.type != endpoint_type_cloudfront || epnt.front.empty()) continue;
+    auto base = without_final_slash(epnt.address);
+    if (url.compare(0, base.size(), base) != 0 ||
+        (url.size() != base.size() && url[base.size()] != '/')) {
+      continue;
+    }
+    // The front is usually a host name, but we also accept a URL.
+    auto front = without_final_slash(epnt.front);
+    if (front.find("://") == std::string::npos) front = "https://" + front;
+    *fronted = front + url.substr(base.size());
+    *host = endpoint_authority(epnt.address);
+    return true;
+  }
+  return false;
+}
+
+bool EndpointSelector::open_from(size_t index, ReportTarget *target) noexcept {
+  // Note: while we're opening, the other threads keep using the collector
+  // in use, hence we only update current_ once we know the outcome.
+  for (; open_ && index < endpoints_.size(); ++index) {
+    std::string report_id;
+    if (open_(endpoints_[index], &report_id)) {
+      std::unique_lock<std::mutex> _{mutex_};
+      report_ids_[index] = std::move(report_id);
+      current_ = index;
+      return this->target(current_, target);
+    }
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  current_ = endpoints_.size();
+  return false;
+}
+
+bool EndpointSelector::target(size_t index,
+                              ReportTarget *target) const noexcept {
+  if (index >= endpoints_.size()) return false;
+  target->index = index;
+  target->url = endpoints_[index].address;
+  target->report_id = report_ids_[index];
+  return true;
+}
+
+bool Runner::rank_endpoints(
+    const std::vector<std::vector<EndpointInfo> *> &lists,
+    std::vector<bool> *reachable, BytesInfo *info) noexcept {
+  if (reachable == nullptr || info == nullptr) return false;
+  for (auto endpoints : lists) {
+    if (endpoints == nullptr) return false;
+  }
+  reachable->assign(lists.size(), false);
+  UniqueCurlxMulti multi;
+  multi.reset(curlx_pool_->borrow_multi());
+  if (!multi) {
+    LIBNETTEST2_EMIT_WARNING("rank_endpoints: cannot borrow handle");
+    return false;
+  }
+  {
+    std::unique_lock<std::mutex> _{multis_mutex_};
+    multis_.push_back(multi.get());
+  }
+  class Probe {
+   public:
+    UniqueCurlx handle;
+    EndpointInfo endpoint;
+    double latency = -1.0;  // Negative means we could not connect
+    bool probed = false;
+  };
+  // We don't borrow from the pool because we don't want cURL to keep the
+  // connections, which we only use for measuring their latency. Note that
+  // we size all the vectors upfront, because CURLOPT_PRIVATE points to the
+  // probes, hence they must not move until we are done.
+  std::vector<std::vector<Probe>> probes(lists.size());
+  for (size_t j = 0; j < lists.size(); ++j) {
+    // We only use the selector to know the fronts of cloudfronted ones.
+    EndpointSelector selector{*lists[j], nullptr};
+    probes[j].resize(lists[j]->size());
+    for (size_t i = 0; i < lists[j]->size(); ++i) {
+      auto &probe = probes[j][i];
+      probe.endpoint = std::move((*lists[j])[i]);
+      if (probe.endpoint.type != endpoint_type_https &&
+          probe.endpoint.type != endpoint_type_cloudfront) {
+        continue;
+      }
+      // For cloudfronted endpoints, we measure connecting to the front, which
+      // is the path our requests take (see curlx_setup_front()).
+      auto url = probe.endpoint.address;
+      std::string fronted, host;
+      if (selector.front(url, &fronted, &host)) url = std::move(fronted);
+      constexpr long probe_timeout = 3;
+      probe.handle.reset(::curl_easy_init());
+      if (!probe.handle ||
+          ::curl_easy_setopt(probe.handle.get(), CURLOPT_URL, url.data()) !=
+              CURLE_OK ||
+          ::curl_easy_setopt(probe.handle.get(), CURLOPT_CONNECT_ONLY, 1L) !=
+              CURLE_OK ||
+          ::curl_easy_setopt(probe.handle.get(), CURLOPT_TIMEOUT,
+                             probe_timeout) != CURLE_OK ||
+          ::curl_easy_setopt(probe.handle.get(), CURLOPT_PRIVATE, &probe) !=
+              CURLE_OK) {
+        LIBNETTEST2_EMIT_WARNING("rank_endpoints: cannot setup probe");
+        probe.handle.reset();
+        continue;
+      }
+      if (::curl_multi_add_handle(multi.get(), probe.handle.get()) !=
+          CURLM_OK) {
+        LIBNETTEST2_EMIT_WARNING(
+            "rank_endpoints: curl_multi_add_handle() failed");
+        probe.handle.reset();
+        continue;
+      }
+      probe.probed = true;
+    }
+  }
+  int running = 0;
+  do {
+    auto mcode = ::curl_multi_perform(multi.get(), &running);
+    if (mcode == CURLM_OK && running > 0 && !transfers_cancelled()) {
+      constexpr int timeout_ms = 1000;
+#if LIBCURL_VERSION_NUM >= 0x074400  // 7.68.0
+      mcode = ::curl_multi_poll(multi.get(), nullptr, 0, timeout_ms, nullptr);
+#else
+      mcode = ::curl_multi_wait(multi.get(), nullptr, 0, timeout_ms, nullptr);
+#endif
+    }
+    if (mcode != CURLM_OK) {
+      LIBNETTEST2_EMIT_WARNING("rank_endpoints: " << ::curl_multi_strerror(mcode));
+      break;
+    }
+    CURLMsg *msg = nullptr;
+    int queued = 0;
+    while ((msg = ::curl_multi_info_read(multi.get(), &queued)) != nullptr) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      Probe *probe = nullptr;
+      (void)::curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &probe);
+      if (probe == nullptr) continue;
+      if (msg->data.result != CURLE_OK) {
+        LIBNETTEST2_EMIT_DEBUG("rank_endpoints: " << probe->endpoint.address
+                               << ": " << ::curl_easy_strerror(msg->data.result));
+        continue;
+      }
+      // The time to connect includes the TLS handshake, if any.
+      double latency = 0.0;
+      if (::curl_easy_getinfo(msg->easy_handle, CURLINFO_APPCONNECT_TIME,
+                              &latency) != CURLE_OK || latency <= 0.0) {
+        (void)::curl_easy_getinfo(msg->easy_handle, CURLINFO_CONNECT_TIME,
+                                  &latency);
+      }
+      probe->latency = latency;
+      LIBNETTEST2_EMIT_DEBUG("rank_endpoints: " << probe->endpoint.address
+                             << ": " << latency * 1000.0 << " ms");
+    }
+  } while (running > 0 && !transfers_cancelled());
+  for (auto &list : probes) {
+    for (auto &probe : list) {
+      if (!probe.handle) continue;
+      curlx_account(probe.handle.get(), info);
+      (void)::curl_multi_remove_handle(multi.get(), probe.handle.get());
+    }
+  }
+  {
+    std::unique_lock<std::mutex> _{multis_mutex_};
+    multis_.erase(std::find(multis_.begin(), multis_.end(), multi.get()));
+  }
+  curlx_pool_->recycle_multi(multi.release());
+  auto rank = [](const Probe &probe) -> int {
+    return (probe.latency >= 0.0) ? 0 : (probe.probed) ? 1 : 2;
+  };
+  for (size_t j = 0; j < lists.size(); ++j) {
+    auto &list = probes[j];
+    std::stable_sort(list.begin(), list.end(),
+                     [&rank](const Probe &left, const Probe &right) {
+                       return (rank(left) != rank(right))
+                                  ? rank(left) < rank(right)
+                                  : left.latency < right.latency;
+                     });
+    for (size_t i = 0; i < list.size(); ++i) {
+      (*lists[j])[i] = std::move(list[i].endpoint);
+    }
+    (*reachable)[j] = !list.empty() && list[0].latency >= 0.0;
+  }
+  return true;
+}
+
+bool Runner::rank_endpoints_cached(
+    const std::map<std::string, std::vector<EndpointInfo> *> &lists,
+    std::map<std::string, bool> *reachable, BytesInfo *info) noexcept {
+  if (reachable == nullptr || info == nullptr) {
+    LIBNETTEST2_EMIT_WARNING("rank_endpoints_cached: passed null pointers");
+    return false;
+  }
+  reachable->clear();
+  auto cache = discovery_cache();
+  std::vector<std::string> keys;
+  std::vector<std::vector<EndpointInfo> *> stale;
+  for (auto &pair : lists) {
+    auto endpoints = pair.second;
+    if (endpoints == nullptr) {
+      LIBNETTEST2_EMIT_WARNING("rank_endpoints_cached: passed null pointers");
+      return false;
+    }
+    if (std::none_of(endpoints->begin(), endpoints->end(),
+                     [](const EndpointInfo &epnt) {
+                       return epnt.type == endpoint_type_https ||
+                              epnt.type == endpoint_type_cloudfront;
+                     })) {
+      continue;  // Nothing to probe, e.g. only onion endpoints
+    }
+    // The ranking is the list of the addresses, the best first.
+    nlohmann::json value;
+    auto fresh = false;
+    if (cache &&
+        cache->get("ranking " + pair.first, discovery_cache_ttl(settings_),
+                   &value, &fresh) &&
+        fresh && value.is_array()) {
+      // Endpoints not in the ranking, if any, come after the others.
+      auto position = [&value](const EndpointInfo &epnt) -> size_t {
+        for (size_t i = 0; i < value.size(); ++i) {
+          if (value[i].is_string() && value[i] == epnt.address) return i;
+        }
+        return value.size();
+      };
+      std::stable_sort(endpoints->begin(), endpoints->end(),
+                       [&position](const EndpointInfo &left,
+                                   const EndpointInfo &right) {
+                         return position(left) < position(right);
+                       });
+      LIBNETTEST2_EMIT_DEBUG("rank_endpoints_cached: using cached "
+                             << pair.first << " ranking");
+      (*reachable)[pair.first] = true;
+      continue;
+    }
+    keys.push_back(pair.first);
+    stale.push_back(endpoints);
+  }
+  if (stale.empty()) return true;
+  std::vector<bool> ok;
+  if (!rank_endpoints(stale, &ok, info)) return false;
+  for (size_t i = 0; i < stale.size(); ++i) {
+    (*reachable)[keys[i]] = ok[i];
+    // We don't cache a ranking where we cannot connect to any endpoint.
+    if (!cache || !ok[i]) continue;
+    nlohmann::json ranking = nlohmann::json::array();
+    for (auto &epnt : *stale[i]) {
+      ranking.push_back(epnt.address);
+    }
+    if (!cache->put("ranking " + keys[i], std::move(ranking))) {
+      LIBNETTEST2_EMIT_WARNING("rank_endpoints_cached: cannot write cache");
+    }
+  }
+  return true;
+}
+
 // MaxMindDB code
 // ``````````````
 
@@ -1794,21 +6139,16 @@ bool Runner::lookup_asn(const std::string &dbpath,
   probe_network_name->clear();
   // TODO(bassosimone): there is a great deal of duplication of basically equal
   // MMDB code here that can be solved by refactoring common code.
-  MMDB_s mmdb{};
-  auto mmdb_error = ::MMDB_open(dbpath.data(), MMDB_MODE_MMAP, &mmdb);
-  if (mmdb_error != 0) {
-    LIBNETTEST2_EMIT_WARNING("lookup_asn: " << MMDB_strerror(mmdb_error));
-    err->code = mmdb_error;
-    err->library_name = "libmaxminddb/MMDB_open";
-    err->library_version = MMDB_lib_version();
-    err->reason = MMDB_strerror(mmdb_error);
+  auto handle = MmdbCache::global().open(dbpath, err);
+  if (!handle) {
+    LIBNETTEST2_EMIT_WARNING("lookup_asn: " << err->reason);
     return false;
   }
   auto rv = false;
   do {
     auto gai_error = 0;
-    mmdb_error = 0;
-    auto record = MMDB_lookup_string(&mmdb, probe_ip.data(),
+    auto mmdb_error = 0;
+    auto record = MMDB_lookup_string(&handle->mmdb, probe_ip.data(),
                                      &gai_error, &mmdb_error);
     if (gai_error) {
       LIBNETTEST2_EMIT_WARNING("lookup_asn: " << gai_strerror(gai_error));
@@ -1885,7 +6225,6 @@ bool Runner::lookup_asn(const std::string &dbpath,
     }
     rv = true;
   } while (false);
-  MMDB_close(&mmdb);
   return rv;
 }
 
@@ -1893,21 +6232,16 @@ bool Runner::lookup_cc(const std::string &dbpath, const std::string &probe_ip,
                        std::string *cc, ErrContext *err) noexcept {
   if (cc == nullptr || err == nullptr) return false;
   cc->clear();
-  MMDB_s mmdb{};
-  auto mmdb_error = ::MMDB_open(dbpath.data(), MMDB_MODE_MMAP, &mmdb);
-  if (mmdb_error != 0) {
-    LIBNETTEST2_EMIT_WARNING("lookup_cc: " << MMDB_strerror(mmdb_error));
-    err->code = mmdb_error;
-    err->library_name = "libmaxminddb/MMDB_open";
-    err->library_version = MMDB_lib_version();
-    err->reason = MMDB_strerror(mmdb_error);
+  auto handle = MmdbCache::global().open(dbpath, err);
+  if (!handle) {
+    LIBNETTEST2_EMIT_WARNING("lookup_cc: " << err->reason);
     return false;
   }
   auto rv = false;
   do {
     auto gai_error = 0;
-    mmdb_error = 0;
-    auto record = MMDB_lookup_string(&mmdb, probe_ip.data(),
+    auto mmdb_error = 0;
+    auto record = MMDB_lookup_string(&handle->mmdb, probe_ip.data(),
                                      &gai_error, &mmdb_error);
     if (gai_error) {
       LIBNETTEST2_EMIT_WARNING("lookup_cc: " << gai_strerror(gai_error));
@@ -1961,10 +6295,63 @@ bool Runner::lookup_cc(const std::string &dbpath, const std::string &probe_ip,
     }
     rv = true;
   } while (false);
-  MMDB_close(&mmdb);
   return rv;
 }
 
+// MaxMindDB handle cache
+// ``````````````````````
+
+MmdbHandle::~MmdbHandle() noexcept {
+  if (is_open) {
+    MMDB_close(&mmdb);
+  }
+}
+
+MmdbCache &MmdbCache::global() noexcept {
+  static MmdbCache cache;
+  return cache;
+}
+
+std::shared_ptr<MmdbHandle> MmdbCache::open(
+    const std::string &dbpath, ErrContext *err) noexcept {
+  if (err == nullptr) {
+    return nullptr;
+  }
+  int64_t mtime = 0;
+  {
+    struct stat sb {};
+    if (::stat(dbpath.data(), &sb) == 0) {
+      mtime = (int64_t)sb.st_mtime;
+    }
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  auto it = handles_.find(dbpath);
+  if (it != handles_.end() && it->second->mtime == mtime) {
+    return it->second;
+  }
+  // Note: holding the lock while opening makes concurrent lookups of the
+  // same database wait for us rather than all opening it.
+  std::shared_ptr<MmdbHandle> handle{new MmdbHandle};
+  auto mmdb_error = ::MMDB_open(dbpath.data(), MMDB_MODE_MMAP, &handle->mmdb);
+  if (mmdb_error != 0) {
+    err->code = mmdb_error;
+    err->library_name = "libmaxminddb/MMDB_open";
+    err->library_version = MMDB_lib_version();
+    err->reason = MMDB_strerror(mmdb_error);
+    handles_.erase(dbpath);
+    return nullptr;
+  }
+  handle->is_open = true;
+  handle->mtime = mtime;
+  handles_[dbpath] = handle;
+  return handle;
+}
+
+void MmdbCache::reload() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  handles_.clear();
+}
+
 // cURL code
 // `````````
 
@@ -2000,43 +6387,67 @@ bool Runner::curlx_post_json(std::string url,
   }
   *responsebody = "";
   UniqueCurlx handle;
-  handle.reset(::curl_easy_init());
+  handle.reset(curlx_pool_->borrow());
   if (!handle) {
-    LIBNETTEST2_EMIT_WARNING("curlx_post_json: curl_easy_init() failed");
+    LIBNETTEST2_EMIT_WARNING("curlx_post_json: cannot borrow cURL handle");
     return false;
   }
   CurlxSlist headers;
-  // TODO(bassosimone): here we should implement support for Tor and for
-  // cloudfronted. Code doing that was implemented by @hellais into the
-  // measurement-kit/web-api-client repository. Deferred after we have a
-  // status a feature parity with MK.
+  if (!curlx_setup_post(handle.get(), requestbody, &headers) ||
+      !curlx_setup_front(handle.get(), &url, &headers)) {
+    return false;
+  }
+  auto rv = curlx_common(handle, std::move(url), timeout, responsebody,
+                         info, err);
+  // Note: recycling resets the handle options, so it won't keep pointers
+  // to headers and requestbody, which are going out of scope.
+  curlx_pool_->recycle(handle.release());
+  return rv;
+}
+
+bool Runner::curlx_setup_post(CURL *handle, const std::string &requestbody,
+                              CurlxSlist *headers) const noexcept {
+  if (handle == nullptr || headers == nullptr) return false;
+  // TODO(bassosimone): here we should implement support for Tor. Code doing
+  // that was implemented by @hellais into the measurement-kit/web-api-client
+  // repository. Deferred after we have a status a feature parity with MK.
   if (!requestbody.empty()) {
     {
-      if ((headers.slist = curl_slist_append(
-               headers.slist, "Content-Type: application/json")) == nullptr) {
-        LIBNETTEST2_EMIT_WARNING("curlx_post_json: curl_slist_append() failed");
+      if ((headers->slist = curl_slist_append(
+               headers->slist, "Content-Type: application/json")) == nullptr) {
+        LIBNETTEST2_EMIT_WARNING(
+            "curlx_setup_post: curl_slist_append() failed");
         return false;
       }
-      if (::curl_easy_setopt(handle.get(), CURLOPT_HTTPHEADER,
-                             headers.slist) != CURLE_OK) {
+      if (::curl_easy_setopt(handle, CURLOPT_HTTPHEADER,
+                             headers->slist) != CURLE_OK) {
         LIBNETTEST2_EMIT_WARNING(
-            "curlx_post_json: curl_easy_setopt(CURLOPT_HTTPHEADER) failed");
+            "curlx_setup_post: curl_easy_setopt(CURLOPT_HTTPHEADER) failed");
         return false;
       }
     }
-    if (::curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDS,
+    // Note: CURLOPT_POSTFIELDS does not copy, so requestbody must outlive
+    // the transfer. This is the case for all our callers.
+    if (::curl_easy_setopt(handle, CURLOPT_POSTFIELDS,
                            requestbody.data()) != CURLE_OK) {
       LIBNETTEST2_EMIT_WARNING(
-          "curlx_post_json: curl_easy_setopt(CURLOPT_POSTFIELDS) failed");
+          "curlx_setup_post: curl_easy_setopt(CURLOPT_POSTFIELDS) failed");
+      return false;
+    }
+  } else {
+    // Without a body, cURL would read from stdin the data to POST.
+    if (::curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, 0L) != CURLE_OK) {
+      LIBNETTEST2_EMIT_WARNING(
+          "curlx_setup_post: curl_easy_setopt(CURLOPT_POSTFIELDSIZE) failed");
       return false;
     }
   }
-  if (::curl_easy_setopt(handle.get(), CURLOPT_POST, 1) != CURLE_OK) {
+  if (::curl_easy_setopt(handle, CURLOPT_POST, 1) != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_post_json: curl_easy_setopt(CURLOPT_POST) failed");
+        "curlx_setup_post: curl_easy_setopt(CURLOPT_POST) failed");
     return false;
   }
-  return curlx_common(handle, std::move(url), timeout, responsebody, info, err);
+  return true;
 }
 
 bool Runner::curlx_get(std::string url,
@@ -2049,19 +6460,26 @@ bool Runner::curlx_get(std::string url,
   }
   *responsebody = "";
   UniqueCurlx handle;
-  handle.reset(::curl_easy_init());
+  handle.reset(curlx_pool_->borrow());
   if (!handle) {
-    LIBNETTEST2_EMIT_WARNING("curlx_get: curl_easy_init() failed");
+    LIBNETTEST2_EMIT_WARNING("curlx_get: cannot borrow cURL handle");
+    return false;
+  }
+  CurlxSlist headers;
+  if (!curlx_setup_front(handle.get(), &url, &headers)) {
     return false;
   }
-  return curlx_common(handle, std::move(url), timeout, responsebody, info, err);
+  auto rv = curlx_common(handle, std::move(url), timeout, responsebody,
+                         info, err);
+  curlx_pool_->recycle(handle.release());
+  return rv;
 }
 
 }  // namespace libnettest2
 }  // namespace measurement_kit
 extern "C" {
 
-static size_t libnettest2_curl_stringstream_callback(
+static size_t libnettest2_curl_sink_callback(
     char *ptr, size_t size, size_t nmemb, void *userdata) noexcept {
   if (nmemb <= 0) {
     return 0;  // This means "no body"
@@ -2070,9 +6488,23 @@ static size_t libnettest2_curl_stringstream_callback(
     assert(false);  // Also catches case where size is zero
     return 0;
   }
-  auto realsiz = size * nmemb;  // Overflow not possible (see above)
-  auto ss = static_cast<std::stringstream *>(userdata);
-  (*ss) << std::string{ptr, realsiz};
+  auto realsiz = size * nmemb;  // Overflow not possible (see above)
+  using namespace measurement_kit::libnettest2;
+  auto sw = static_cast<Runner::CurlxSinkWrapper *>(userdata);
+  if (!sw->started) {
+    sw->started = true;
+    // Note: by the time cURL passes us the body, it has already parsed the
+    // headers, hence it already knows the Content-Length, if any.
+    curl_off_t length = -1;
+    if (::curl_easy_getinfo(sw->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                            &length) == CURLE_OK &&
+        length > 0) {
+      sw->sink->reserve((uint64_t)length);
+    }
+  }
+  if (!sw->sink->append(ptr, realsiz)) {
+    return 0;  // Causes cURL to fail with CURLE_WRITE_ERROR
+  }
   // From fwrite(3): "[the return value] equals the number of bytes
   // written _only_ when `size` equals `1`". See also
   // https://sourceware.org/git/?p=glibc.git;a=blob;f=libio/iofwrite.c;h=800341b7da546e5b7fd2005c5536f4c90037f50d;hb=HEAD#l29
@@ -2168,67 +6600,327 @@ static int libnettest2_curl_debugfn(CURL *handle,
   return 0;
 }
 
+static size_t libnettest2_curl_body_read_callback(
+    char *buffer, size_t size, size_t nitems, void *userdata) noexcept {
+  if (size != 0 && nitems > SIZE_MAX / size) {
+    assert(false);
+    return CURL_READFUNC_ABORT;
+  }
+  using namespace measurement_kit::libnettest2;
+  auto body = static_cast<Runner::CurlxBody *>(userdata);
+  auto avail = size * nitems;  // Overflow not possible (see above)
+  size_t total = 0;
+  while (avail > 0 && body->current < body->pieces.size()) {
+    auto &piece = body->pieces[body->current];
+    auto count = std::min(avail, piece.second - body->offset);
+    memcpy(buffer + total, piece.first + body->offset, count);
+    total += count;
+    avail -= count;
+    body->offset += count;
+    if (body->offset >= piece.second) {
+      body->current += 1;
+      body->offset = 0;
+    }
+  }
+  return total;  // Zero means we're done
+}
+
+static int libnettest2_curl_body_seek_callback(
+    void *userdata, curl_off_t offset, int origin) noexcept {
+  // cURL only seeks from the beginning, to resend a body, e.g., when a reused
+  // connection turns out to be closed.
+  if (origin != SEEK_SET || offset < 0) return CURL_SEEKFUNC_CANTSEEK;
+  using namespace measurement_kit::libnettest2;
+  auto body = static_cast<Runner::CurlxBody *>(userdata);
+  body->current = 0;
+  body->offset = 0;
+  auto remaining = (uint64_t)offset;
+  while (body->current < body->pieces.size() &&
+         remaining >= body->pieces[body->current].second) {
+    remaining -= body->pieces[body->current].second;
+    body->current += 1;
+  }
+  if (remaining > 0) {
+    if (body->current >= body->pieces.size()) return CURL_SEEKFUNC_FAIL;
+    body->offset = (size_t)remaining;
+  }
+  return CURL_SEEKFUNC_OK;
+}
+
+static int libnettest2_curl_xferinfo_callback(
+    void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+    curl_off_t ulnow) noexcept {
+  (void)dltotal;
+  (void)dlnow;
+  (void)ultotal;
+  (void)ulnow;
+  using namespace measurement_kit::libnettest2;
+  // Returning nonzero causes cURL to fail with CURLE_ABORTED_BY_CALLBACK.
+  return static_cast<const Runner *>(clientp)->transfers_cancelled() ? 1 : 0;
+}
+
+static void libnettest2_curl_share_lock(CURL *handle, curl_lock_data data,
+                                        curl_lock_access access,
+                                        void *userptr) {
+  (void)handle;
+  (void)access;
+  using namespace measurement_kit::libnettest2;
+  static_cast<CurlxPool *>(userptr)->lock(data);
+}
+
+static void libnettest2_curl_share_unlock(CURL *handle, curl_lock_data data,
+                                          void *userptr) {
+  (void)handle;
+  using namespace measurement_kit::libnettest2;
+  static_cast<CurlxPool *>(userptr)->unlock(data);
+}
+
 }  // extern "C"
 namespace measurement_kit {
 namespace libnettest2 {
 
-bool Runner::curlx_common(UniqueCurlx &handle,
-                          std::string url,
-                          long timeout,
-                          std::string *responsebody,
-                          BytesInfo *info,
-                          ErrContext *err) const noexcept {
-  if (responsebody == nullptr || info == nullptr || err == nullptr) {
+// cURL handle pool
+// ````````````````
+
+CurlxPool::CurlxPool() noexcept {
+  // cURL initializes itself on first use, but that is not thread safe with
+  // older versions, and pools may be created by concurrent Runners.
+  static std::once_flag curl_initialized;
+  std::call_once(curl_initialized, []() {
+    (void)::curl_global_init(CURL_GLOBAL_DEFAULT);
+  });
+  // Note: if we cannot create or configure the share object, we continue
+  // without it. We just lose the opportunity of sharing cached data.
+  share_ = ::curl_share_init();
+  if (share_ == nullptr) return;
+  if (::curl_share_setopt(share_, CURLSHOPT_LOCKFUNC,
+                          libnettest2_curl_share_lock) != CURLSHE_OK ||
+      ::curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC,
+                          libnettest2_curl_share_unlock) != CURLSHE_OK ||
+      ::curl_share_setopt(share_, CURLSHOPT_USERDATA, this) != CURLSHE_OK) {
+    ::curl_share_cleanup(share_);
+    share_ = nullptr;
+    return;
+  }
+  // Errors here are not fatal: it means this cURL does not support sharing
+  // some kind of data, and we'll simply not share it.
+  //
+  // Note: we don't share CURL_LOCK_DATA_CONNECT because cURL does not support
+  // sharing connections between concurrent threads. This is not a problem
+  // since each pooled handle keeps its own live connections.
+  (void)::curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  (void)::curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+CurlxPool::~CurlxPool() noexcept {
+  // Handles must be destroyed before the share object they are using.
+  for (auto handle : idle_multi_) {
+    ::curl_multi_cleanup(handle);
+  }
+  idle_multi_.clear();
+  for (auto handle : idle_) {
+    ::curl_easy_cleanup(handle);
+  }
+  idle_.clear();
+  if (share_ != nullptr) {
+    ::curl_share_cleanup(share_);
+  }
+}
+
+CURL *CurlxPool::borrow() noexcept {
+  CURL *handle = nullptr;
+  {
+    std::unique_lock<std::mutex> _{idle_mutex_};
+    if (!idle_.empty()) {
+      handle = idle_.back();
+      idle_.pop_back();
+    }
+  }
+  if (handle == nullptr && (handle = ::curl_easy_init()) == nullptr) {
+    return nullptr;
+  }
+  if (share_ != nullptr) {
+    // Note: curl_easy_reset() clears CURLOPT_SHARE, so set it every time.
+    (void)::curl_easy_setopt(handle, CURLOPT_SHARE, share_);
+  }
+  return handle;
+}
+
+void CurlxPool::recycle(CURL *handle) noexcept {
+  if (handle == nullptr) return;
+  // Resetting the options keeps live connections, the DNS cache and the TLS
+  // session ID cache, which is what we want to reuse.
+  ::curl_easy_reset(handle);
+  {
+    std::unique_lock<std::mutex> _{idle_mutex_};
+    if (idle_.size() < max_idle) {
+      idle_.push_back(handle);
+      return;
+    }
+  }
+  ::curl_easy_cleanup(handle);
+}
+
+CURLM *CurlxPool::borrow_multi() noexcept {
+  {
+    std::unique_lock<std::mutex> _{idle_mutex_};
+    if (!idle_multi_.empty()) {
+      auto handle = idle_multi_.back();
+      idle_multi_.pop_back();
+      return handle;
+    }
+  }
+  auto handle = ::curl_multi_init();
+  if (handle == nullptr) return nullptr;
+  // Note: if the server does not speak HTTP/2, cURL falls back to running
+  // the transfers in parallel using several HTTP/1.1 connections.
+  (void)::curl_multi_setopt(handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  return handle;
+}
+
+void CurlxPool::recycle_multi(CURLM *handle) noexcept {
+  if (handle == nullptr) return;
+  {
+    std::unique_lock<std::mutex> _{idle_mutex_};
+    if (idle_multi_.size() < max_idle) {
+      idle_multi_.push_back(handle);
+      return;
+    }
+  }
+  ::curl_multi_cleanup(handle);
+}
+
+void CurlxPool::lock(curl_lock_data data) noexcept {
+  if (data >= 0 && data < CURL_LOCK_DATA_LAST) share_mutexes_[data].lock();
+}
+
+void CurlxPool::unlock(curl_lock_data data) noexcept {
+  if (data >= 0 && data < CURL_LOCK_DATA_LAST) share_mutexes_[data].unlock();
+}
+
+
+bool Runner::curlx_setup_front(CURL *handle, std::string *url,
+                               CurlxSlist *headers) const noexcept {
+  if (handle == nullptr || url == nullptr || headers == nullptr) return false;
+  std::string fronted;
+  std::string host;
+  if (collectors_ == nullptr || !collectors_->front(*url, &fronted, &host)) {
+    return true;  // Not a cloudfronted collector
+  }
+  // This is domain fronting: we connect to the front, which is also what we
+  // name in the SNI, and the front forwards the request to the collector
+  // named by the Host header, which travels encrypted.
+  std::string header = "Host: " + host;
+  if ((headers->slist = curl_slist_append(headers->slist,
+                                          header.data())) == nullptr) {
+    LIBNETTEST2_EMIT_WARNING("curlx_setup_front: curl_slist_append() failed");
     return false;
   }
-  *responsebody = "";
-  if (::curl_easy_setopt(handle.get(), CURLOPT_URL, url.data()) != CURLE_OK) {
+  if (::curl_easy_setopt(handle, CURLOPT_HTTPHEADER,
+                         headers->slist) != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_common: curl_easy_setopt(CURLOPT_URL) failed");
+        "curlx_setup_front: curl_easy_setopt(CURLOPT_HTTPHEADER) failed");
+    return false;
+  }
+  *url = std::move(fronted);
+  return true;
+}
+
+bool Runner::curlx_setup_common(CURL *handle, const std::string &url,
+                                long timeout, CurlxSinkWrapper *sw,
+                                BytesInfoWrapper *w) const noexcept {
+  if (handle == nullptr || sw == nullptr || sw->sink == nullptr ||
+      w == nullptr) {
     return false;
   }
-  if (::curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION,
-                         libnettest2_curl_stringstream_callback) != CURLE_OK) {
+  sw->handle = handle;
+  sw->started = false;
+  if (::curl_easy_setopt(handle, CURLOPT_URL, url.data()) != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_common: curl_easy_setopt(CURLOPT_WRITEFUNCTION) failed");
+        "curlx_setup_common: curl_easy_setopt(CURLOPT_URL) failed");
     return false;
   }
-  std::stringstream ss;
-  if (::curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &ss) != CURLE_OK) {
+  if (::curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION,
+                         libnettest2_curl_sink_callback) != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_common: curl_easy_setopt(CURLOPT_WRITEDATA) failed");
+        "curlx_setup_common: curl_easy_setopt(CURLOPT_WRITEFUNCTION) failed");
     return false;
   }
-  if (::curl_easy_setopt(handle.get(), CURLOPT_TIMEOUT, timeout) != CURLE_OK) {
+  if (::curl_easy_setopt(handle, CURLOPT_WRITEDATA, sw) != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_common: curl_easy_setopt(CURLOPT_TIMEOUT) failed");
+        "curlx_setup_common: curl_easy_setopt(CURLOPT_WRITEDATA) failed");
     return false;
   }
-  if (::curl_easy_setopt(handle.get(), CURLOPT_DEBUGFUNCTION,
-                         libnettest2_curl_debugfn) != CURLE_OK) {
+  if (::curl_easy_setopt(handle, CURLOPT_TIMEOUT, timeout) != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_common: curl_easy_setopt(CURLOPT_DEBUGFUNCTION) failed");
+        "curlx_setup_common: curl_easy_setopt(CURLOPT_TIMEOUT) failed");
     return false;
   }
-  BytesInfoWrapper w;
-  w.owner = this;
-  w.info = info;
-  if (::curl_easy_setopt(handle.get(), CURLOPT_DEBUGDATA, &w) != CURLE_OK) {
+  // See curlx_account() for how we count the bytes when not debugging.
+  if (get_log_level() >= LogLevel::log_debug) {
+    if (::curl_easy_setopt(handle, CURLOPT_DEBUGFUNCTION,
+                           libnettest2_curl_debugfn) != CURLE_OK) {
+      LIBNETTEST2_EMIT_WARNING(
+          "curlx_setup_common: curl_easy_setopt(CURLOPT_DEBUGFUNCTION) failed");
+      return false;
+    }
+    if (::curl_easy_setopt(handle, CURLOPT_DEBUGDATA, w) != CURLE_OK) {
+      LIBNETTEST2_EMIT_WARNING(
+          "curlx_setup_common: curl_easy_setopt(CURLOPT_DEBUGDATA) failed");
+      return false;
+    }
+    if (::curl_easy_setopt(handle, CURLOPT_VERBOSE, 1L) != CURLE_OK) {
+      LIBNETTEST2_EMIT_WARNING(
+          "curlx_setup_common: curl_easy_setopt(CURLOPT_VERBOSE) failed");
+      return false;
+    }
+  }
+  if (::curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L) != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_common: curl_easy_setopt(CURLOPT_DEBUGDATA) failed");
+        "curlx_setup_common: curl_easy_setopt(CURLOPT_FAILONERROR) failed");
     return false;
   }
-  if (::curl_easy_setopt(handle.get(), CURLOPT_VERBOSE, 1L) != CURLE_OK) {
+  // cURL calls the transfer info callback frequently while a transfer is in
+  // progress, which allows us to abort it when interrupted.
+  if (::curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION,
+                         libnettest2_curl_xferinfo_callback) != CURLE_OK ||
+      ::curl_easy_setopt(handle, CURLOPT_XFERINFODATA, this) != CURLE_OK ||
+      ::curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L) != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_common: curl_easy_setopt(CURLOPT_VERBOSE) failed");
+        "curlx_setup_common: curl_easy_setopt(CURLOPT_XFERINFOFUNCTION) failed");
     return false;
   }
-  if (::curl_easy_setopt(handle.get(), CURLOPT_FAILONERROR, 1L) != CURLE_OK) {
+  // The empty string means all the encodings supported by this cURL.
+  if (settings_.http_compression &&
+      ::curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "") != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING(
-        "curlx_common: curl_easy_setopt(CURLOPT_FAILONERROR) failed");
+        "curlx_setup_common: curl_easy_setopt(CURLOPT_ACCEPT_ENCODING) failed");
+    return false;
+  }
+  return true;
+}
+
+bool Runner::curlx_common(UniqueCurlx &handle,
+                          std::string url,
+                          long timeout,
+                          std::string *responsebody,
+                          BytesInfo *info,
+                          ErrContext *err) const noexcept {
+  if (responsebody == nullptr || info == nullptr || err == nullptr) {
+    return false;
+  }
+  responsebody->clear();
+  CurlxStringSink sink{responsebody};
+  CurlxSinkWrapper sw;
+  sw.sink = &sink;
+  BytesInfoWrapper w;
+  w.owner = this;
+  w.info = info;
+  if (!curlx_setup_common(handle.get(), url, timeout, &sw, &w)) {
     return false;
   }
   auto curle = ::curl_easy_perform(handle.get());
+  curlx_account(handle.get(), info);
   if (curle != CURLE_OK) {
     LIBNETTEST2_EMIT_WARNING("curlx_common: curl_easy_perform() failed");
     // Here's a reasonable assumption: in general the most likely cURL API that
@@ -2239,10 +6931,559 @@ bool Runner::curlx_common(UniqueCurlx &handle,
     err->reason = ::curl_easy_strerror(curle);
     return false;
   }
-  *responsebody = ss.str();
   return true;
 }
 
+void Runner::curlx_account(CURL *handle, BytesInfo *info) const noexcept {
+  if (handle == nullptr || info == nullptr) return;
+  if (get_log_level() >= LogLevel::log_debug) {
+    return;  // libnettest2_curl_debugfn() has already counted the bytes
+  }
+  // Note: this does not include the TLS overhead, which the debug callback
+  // counts, so it slightly underestimates the bytes on the wire.
+  curl_off_t body_up = 0;
+  curl_off_t body_down = 0;
+  long request_size = 0;
+  long headers_down = 0;
+  (void)::curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &body_up);
+  (void)::curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &body_down);
+  (void)::curl_easy_getinfo(handle, CURLINFO_REQUEST_SIZE, &request_size);
+  (void)::curl_easy_getinfo(handle, CURLINFO_HEADER_SIZE, &headers_down);
+  // The request size includes the body we sent, at least with HTTP/1.1, so
+  // don't add the two or we double count. Hence we use the larger value.
+  info->bytes_up += (uint64_t)std::max<curl_off_t>(
+      std::max<curl_off_t>(body_up, (curl_off_t)request_size), 0);
+  info->bytes_down += (uint64_t)std::max<curl_off_t>(body_down, 0) +
+                      (uint64_t)std::max<long>(headers_down, 0);
+}
+
+void Runner::CurlxSink::reserve(uint64_t size) noexcept { (void)size; }
+
+Runner::CurlxSink::~CurlxSink() noexcept {}
+
+Runner::CurlxStringSink::CurlxStringSink(std::string *body) noexcept
+    : body_{body} {}
+
+void Runner::CurlxStringSink::reserve(uint64_t size) noexcept {
+  // Don't trust the server to tell us a reasonable size.
+  constexpr uint64_t max_reserve = 1 << 26;
+  if (body_ == nullptr || size > max_reserve) return;
+  try {
+    body_->reserve(body_->size() + (size_t)size);
+  } catch (const std::exception &) {
+    // Not fatal: the string will just grow as needed
+  }
+}
+
+bool Runner::CurlxStringSink::append(const char *data, size_t count) noexcept {
+  if (body_ == nullptr) return false;
+  try {
+    body_->append(data, count);
+  } catch (const std::exception &) {
+    return false;
+  }
+  return true;
+}
+
+bool Runner::curlx_setup_post_body(CURL *handle, CurlxBody *body,
+                                   CurlxSlist *headers) const noexcept {
+  if (handle == nullptr || body == nullptr || headers == nullptr) return false;
+  curl_off_t size = 0;
+  for (auto &piece : body->pieces) {
+    size += (curl_off_t)piece.second;
+  }
+  body->current = 0;
+  body->offset = 0;
+  // Note: with a body read using a callback and no "Expect:" header, cURL
+  // would ask for "100 Continue" and wait for the server's reply.
+  if ((headers->slist = curl_slist_append(
+           headers->slist, "Content-Type: application/json")) == nullptr ||
+      (headers->slist = curl_slist_append(headers->slist, "Expect:")) ==
+          nullptr) {
+    LIBNETTEST2_EMIT_WARNING(
+        "curlx_setup_post_body: curl_slist_append() failed");
+    return false;
+  }
+  if (body->content_encoding != nullptr) {
+    std::string header = "Content-Encoding: ";
+    header += body->content_encoding;
+    if ((headers->slist = curl_slist_append(headers->slist,
+                                            header.data())) == nullptr) {
+      LIBNETTEST2_EMIT_WARNING(
+          "curlx_setup_post_body: curl_slist_append() failed");
+      return false;
+    }
+  }
+  if (::curl_easy_setopt(handle, CURLOPT_HTTPHEADER,
+                         headers->slist) != CURLE_OK) {
+    LIBNETTEST2_EMIT_WARNING(
+        "curlx_setup_post_body: curl_easy_setopt(CURLOPT_HTTPHEADER) failed");
+    return false;
+  }
+  if (::curl_easy_setopt(handle, CURLOPT_POST, 1L) != CURLE_OK) {
+    LIBNETTEST2_EMIT_WARNING(
+        "curlx_setup_post_body: curl_easy_setopt(CURLOPT_POST) failed");
+    return false;
+  }
+  if (::curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE,
+                         size) != CURLE_OK) {
+    LIBNETTEST2_EMIT_WARNING("curlx_setup_post_body: curl_easy_setopt("
+                             "CURLOPT_POSTFIELDSIZE_LARGE) failed");
+    return false;
+  }
+  if (::curl_easy_setopt(handle, CURLOPT_READFUNCTION,
+                         libnettest2_curl_body_read_callback) != CURLE_OK ||
+      ::curl_easy_setopt(handle, CURLOPT_READDATA, body) != CURLE_OK) {
+    LIBNETTEST2_EMIT_WARNING(
+        "curlx_setup_post_body: curl_easy_setopt(CURLOPT_READFUNCTION) failed");
+    return false;
+  }
+  if (::curl_easy_setopt(handle, CURLOPT_SEEKFUNCTION,
+                         libnettest2_curl_body_seek_callback) != CURLE_OK ||
+      ::curl_easy_setopt(handle, CURLOPT_SEEKDATA, body) != CURLE_OK) {
+    LIBNETTEST2_EMIT_WARNING(
+        "curlx_setup_post_body: curl_easy_setopt(CURLOPT_SEEKFUNCTION) failed");
+    return false;
+  }
+  return true;
+}
+
+void Runner::CurlxMultiDeleter::operator()(CURLM *handle) noexcept {
+  curl_multi_cleanup(handle);  // handles null gracefully
+}
+
+// Collectors are not required to accept compressed bodies, so we remember
+// the origins (i.e. scheme, host and port) of those that don't, which reply
+// with "415 Unsupported Media Type", or with "400 Bad Request" to a body that
+// they accept when not compressed, and stop compressing for them.
+
+static std::mutex &uncompressed_origins_mutex() noexcept {
+  static std::mutex mtx;
+  return mtx;
+}
+
+static std::vector<std::string> &uncompressed_origins() noexcept {
+  static std::vector<std::string> origins;
+  return origins;
+}
+
+static std::string url_origin(const std::string &url) noexcept {
+  auto pos = url.find("://");
+  pos = url.find('/', (pos == std::string::npos) ? 0 : pos + 3);
+  return url.substr(0, pos);
+}
+
+static bool accepts_compression(const std::string &url) noexcept {
+  auto origin = url_origin(url);
+  std::unique_lock<std::mutex> _{uncompressed_origins_mutex()};
+  auto &origins = uncompressed_origins();
+  return std::find(origins.begin(), origins.end(), origin) == origins.end();
+}
+
+static void reject_compression(const std::string &url) noexcept {
+  auto origin = url_origin(url);
+  std::unique_lock<std::mutex> _{uncompressed_origins_mutex()};
+  auto &origins = uncompressed_origins();
+  if (std::find(origins.begin(), origins.end(), origin) == origins.end()) {
+    origins.push_back(std::move(origin));
+  }
+}
+
+#ifdef LIBNETTEST2_HAVE_ZLIB
+// gzip_body() compresses the pieces of |body| one after the other, such that
+// we never need to concatenate them, into |out|.
+static bool gzip_body(const Runner::CurlxBody &body,
+                      std::string *out) noexcept {
+  if (out == nullptr) return false;
+  z_stream zs{};
+  constexpr int gzip_window_bits = 15 + 16;  // 16 means gzip framing
+  constexpr int default_mem_level = 8;
+  if (::deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, gzip_window_bits,
+                     default_mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  uLong size = 0;
+  for (auto &piece : body.pieces) {
+    size += (uLong)piece.second;
+  }
+  auto ok = true;
+  try {
+    out->resize((size_t)::deflateBound(&zs, size));
+    zs.next_out = (Bytef *)&(*out)[0];
+    zs.avail_out = (uInt)out->size();
+    for (size_t i = 0; ok && i < body.pieces.size(); ++i) {
+      auto &piece = body.pieces[i];
+      auto last = (i == body.pieces.size() - 1);
+      zs.next_in = (Bytef *)piece.first;
+      zs.avail_in = (uInt)piece.second;
+      // Note: the output buffer is large enough for the whole body, hence
+      // deflate() consumes all of the input of each call.
+      auto rv = ::deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+      ok = (last) ? rv == Z_STREAM_END : rv == Z_OK;
+    }
+    out->resize((size_t)zs.total_out);
+  } catch (const std::exception &) {
+    ok = false;
+  }
+  (void)::deflateEnd(&zs);
+  return ok;
+}
+#endif
+
+void Runner::curlx_compress_body(CurlxRequest *request) const noexcept {
+  if (request == nullptr || !request->compress ||
+      !settings_.http_compression) {
+    return;
+  }
+#ifdef LIBNETTEST2_HAVE_ZLIB
+  // Compressing small bodies saves too little to be worth it.
+  constexpr size_t min_size = 1024;
+  size_t size = 0;
+  for (auto &piece : request->body.pieces) {
+    size += piece.second;
+  }
+  if (size < min_size || request->body.content_encoding != nullptr ||
+      !accepts_compression(request->url)) {
+    return;
+  }
+  if (!gzip_body(request->body, &request->encoded_body)) {
+    LIBNETTEST2_EMIT_WARNING("curlx_compress_body: gzip_body() failed");
+    request->encoded_body.clear();
+    return;
+  }
+  LIBNETTEST2_EMIT_DEBUG("curlx_compress_body: " << size << " => "
+                         << request->encoded_body.size() << " bytes");
+  request->plain_pieces = std::move(request->body.pieces);
+  request->body.pieces = {{request->encoded_body.data(),
+                           request->encoded_body.size()}};
+  request->body.content_encoding = "gzip";
+#endif
+}
+
+bool Runner::curlx_multi_post_json(std::vector<CurlxRequest> *requests,
+                                   long timeout,
+                                   BytesInfo *info) const noexcept {
+  if (requests == nullptr || info == nullptr) return false;
+  UniqueCurlxMulti multi;
+  multi.reset(curlx_pool_->borrow_multi());
+  if (!multi) {
+    LIBNETTEST2_EMIT_WARNING("curlx_multi_post_json: cannot borrow handle");
+    return false;
+  }
+  {
+    std::unique_lock<std::mutex> _{multis_mutex_};
+    multis_.push_back(multi.get());
+  }
+  class Transfer {
+   public:
+    UniqueCurlx handle;
+    CurlxSlist headers;
+    std::string url;  // Where we send the request (see curlx_setup_front())
+    std::unique_ptr<CurlxStringSink> sink;
+    CurlxSinkWrapper sw;
+    BytesInfoWrapper w;
+    BytesInfo bytes;  // Such that we know the bytes used by each request
+    CurlxRequest *request = nullptr;
+  };
+  std::vector<std::unique_ptr<Transfer>> transfers;
+  for (auto &request : *requests) {
+    request.ok = false;
+    request.responsebody = "";
+    request.err = ErrContext{};
+    request.bytes_down = 0;
+    request.bytes_up = 0;
+    std::unique_ptr<Transfer> transfer{new Transfer};
+    transfer->request = &request;
+    transfer->url = request.url;
+    transfer->sink.reset(new CurlxStringSink{&request.responsebody});
+    transfer->sw.sink = transfer->sink.get();
+    transfer->w.owner = this;
+    transfer->w.info = &transfer->bytes;
+    transfer->handle.reset(curlx_pool_->borrow());
+    if (!transfer->handle) {
+      LIBNETTEST2_EMIT_WARNING("curlx_multi_post_json: cannot borrow handle");
+      continue;
+    }
+    if (!request.body.pieces.empty()) {
+      curlx_compress_body(&request);
+    }
+    auto posted = (!request.body.pieces.empty())
+                      ? curlx_setup_post_body(transfer->handle.get(),
+                                              &request.body, &transfer->headers)
+                      : curlx_setup_post(transfer->handle.get(),
+                                         request.requestbody,
+                                         &transfer->headers);
+    if (!posted ||
+        !curlx_setup_front(transfer->handle.get(), &transfer->url,
+                           &transfer->headers) ||
+        !curlx_setup_common(transfer->handle.get(), transfer->url, timeout,
+                            &transfer->sw, &transfer->w)) {
+      continue;
+    }
+    // We only use this function to submit measurements, which are over, so
+    // we don't abort these transfers when interrupted (see interrupt()).
+    (void)::curl_easy_setopt(transfer->handle.get(), CURLOPT_NOPROGRESS, 1L);
+    // Ask cURL to wait for the first connection to be established rather
+    // than opening many connections, such that we can multiplex.
+    (void)::curl_easy_setopt(transfer->handle.get(), CURLOPT_PIPEWAIT, 1L);
+    (void)::curl_easy_setopt(transfer->handle.get(), CURLOPT_HTTP_VERSION,
+                             (long)CURL_HTTP_VERSION_2TLS);
+    (void)::curl_easy_setopt(transfer->handle.get(), CURLOPT_PRIVATE,
+                             transfer.get());
+    if (::curl_multi_add_handle(multi.get(), transfer->handle.get()) !=
+        CURLM_OK) {
+      LIBNETTEST2_EMIT_WARNING(
+          "curlx_multi_post_json: curl_multi_add_handle() failed");
+      continue;
+    }
+    transfers.push_back(std::move(transfer));
+  }
+  int running = 0;
+  do {
+    auto mcode = ::curl_multi_perform(multi.get(), &running);
+    if (mcode == CURLM_OK && running > 0) {
+      constexpr int timeout_ms = 1000;
+#if LIBCURL_VERSION_NUM >= 0x074400  // 7.68.0
+      // Unlike curl_multi_wait(), curl_multi_poll() can be woken up by
+      // interrupt() using curl_multi_wakeup().
+      mcode = ::curl_multi_poll(multi.get(), nullptr, 0, timeout_ms, nullptr);
+#else
+      mcode = ::curl_multi_wait(multi.get(), nullptr, 0, timeout_ms, nullptr);
+#endif
+    }
+    if (mcode != CURLM_OK) {
+      LIBNETTEST2_EMIT_WARNING("curlx_multi_post_json: "
+                               << ::curl_multi_strerror(mcode));
+      break;
+    }
+    CURLMsg *msg = nullptr;
+    int queued = 0;
+    while ((msg = ::curl_multi_info_read(multi.get(), &queued)) != nullptr) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      Transfer *transfer = nullptr;
+      (void)::curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+      if (transfer == nullptr) continue;
+      auto curle = msg->data.result;
+      auto &request = *transfer->request;
+      if (curle == CURLE_HTTP_RETURNED_ERROR &&
+          request.body.content_encoding != nullptr) {
+        constexpr long bad_request = 400;
+        constexpr long unsupported_media_type = 415;
+        long code = 0;
+        (void)::curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
+                                  &code);
+        if (code == unsupported_media_type) {
+          LIBNETTEST2_EMIT_INFO("Collector does not accept compressed bodies");
+          reject_compression(request.url);
+        }
+        // Note: a collector that cannot decompress may also fail to parse
+        // the body, but we only know that once the plain body is accepted.
+        request.compression_rejected =
+            (code == unsupported_media_type || code == bad_request);
+      }
+      if (curle != CURLE_OK) {
+        LIBNETTEST2_EMIT_WARNING("curlx_multi_post_json: transfer failed");
+        request.err.code = curle;
+        request.err.library_name = "libcurl";
+        request.err.library_version = LIBCURL_VERSION;
+        request.err.reason = ::curl_easy_strerror(curle);
+        continue;
+      }
+      request.ok = true;
+    }
+  } while (running > 0);
+  auto rv = true;
+  for (auto &transfer : transfers) {
+    curlx_account(transfer->handle.get(), &transfer->bytes);
+    transfer->request->bytes_down = transfer->bytes.bytes_down;
+    transfer->request->bytes_up = transfer->bytes.bytes_up;
+    info->bytes_down += transfer->request->bytes_down;
+    info->bytes_up += transfer->request->bytes_up;
+    (void)::curl_multi_remove_handle(multi.get(), transfer->handle.get());
+    curlx_pool_->recycle(transfer->handle.release());
+  }
+  {
+    std::unique_lock<std::mutex> _{multis_mutex_};
+    multis_.erase(std::find(multis_.begin(), multis_.end(), multi.get()));
+  }
+  curlx_pool_->recycle_multi(multi.release());
+  // Send again without compression the bodies rejected because compressed,
+  // but not those that failed for other reasons, e.g. a timeout. Since the
+  // retries are not compressed, we will not recurse more than once.
+  std::vector<CurlxRequest> retries;
+  std::vector<CurlxRequest *> rejected;
+  for (auto &request : *requests) {
+    if (!request.ok && request.compression_rejected) {
+      CurlxRequest retry;
+      retry.url = request.url;
+      retry.body.pieces = request.plain_pieces;
+      retry.compress = false;
+      retries.push_back(std::move(retry));
+      rejected.push_back(&request);
+    }
+  }
+  if (!retries.empty()) {
+    metrics_.submission_retries += retries.size();
+    (void)curlx_multi_post_json(&retries, timeout, info);
+    for (size_t k = 0; k < retries.size(); ++k) {
+      if (retries[k].ok && accepts_compression(retries[k].url)) {
+        // I.e., it was a 400 that the plain body does not cause.
+        LIBNETTEST2_EMIT_INFO("Collector does not accept compressed bodies");
+        reject_compression(retries[k].url);
+      }
+      rejected[k]->ok = retries[k].ok;
+      rejected[k]->err = std::move(retries[k].err);
+      rejected[k]->responsebody = std::move(retries[k].responsebody);
+      rejected[k]->bytes_down += retries[k].bytes_down;
+      rejected[k]->bytes_up += retries[k].bytes_up;
+    }
+  }
+  for (auto &request : *requests) {
+    rv = rv && request.ok;
+  }
+  return rv;
+}
+
+// Engine
+// ``````
+
+// JobRunner is the Runner of a job, which delivers the events to the job.
+class EngineJob::JobRunner : public Runner {
+ public:
+  JobRunner(const Settings &settings, Nettest &nettest,
+            const EngineJob &job) noexcept;
+
+ protected:
+  void on_event(const nlohmann::json &event) const noexcept override;
+
+ private:
+  const EngineJob &job_;
+};
+
+EngineJob::JobRunner::JobRunner(const Settings &settings, Nettest &nettest,
+                                const EngineJob &job) noexcept
+    : Runner{settings, nettest}, job_{job} {}
+
+void EngineJob::JobRunner::on_event(
+    const nlohmann::json &event) const noexcept {
+  if (job_.handler_) {
+    job_.handler_(event);
+    return;
+  }
+  // Several jobs share the sink, hence we tell their events apart.
+  nlohmann::json tagged;
+  try {
+    tagged = event;
+    tagged["job"] = job_.id_;
+  } catch (const std::exception &) {
+    return;
+  }
+  Runner::on_event(tagged);
+}
+
+EngineJob::EngineJob() noexcept {}
+
+uint64_t EngineJob::id() const noexcept { return id_; }
+
+void EngineJob::interrupt() noexcept {
+  interrupted_ = true;
+  runner_->interrupt();
+}
+
+bool EngineJob::done() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return done_;
+}
+
+void EngineJob::wait() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  cond_.wait(lock, [this]() { return done_; });
+}
+
+const RunnerMetrics &EngineJob::metrics() const noexcept {
+  return runner_->metrics();
+}
+
+EngineJob::~EngineJob() noexcept {}
+
+Engine::Engine(NettestFactory factory, size_t max_active,
+               std::string discovery_cache_path,
+               std::shared_ptr<EventSink> sink) noexcept
+    : discovery_cache_{std::make_shared<DiscoveryCache>(
+          std::move(discovery_cache_path))},
+      event_sink_{std::move(sink)},
+      factory_{std::move(factory)},
+      max_active_{(max_active > 0) ? max_active : 1},
+      scheduler_{std::make_shared<RunnerScheduler>(max_active_, false)} {}
+
+std::shared_ptr<EngineJob> Engine::submit(const std::string &settings,
+                                          EventHandler handler,
+                                          std::string *err,
+                                          std::string *warn) noexcept {
+  if (err == nullptr || warn == nullptr) return nullptr;
+  std::shared_ptr<EngineJob> job{new EngineJob};
+  if (!parse_settings(settings, &job->settings_, err, warn)) return nullptr;
+  if (factory_) job->nettest_ = factory_(job->settings_.name);
+  if (!job->nettest_) {
+    *err = "invalid_settings_error: unknown nettest: '" + job->settings_.name +
+           "'";
+    return nullptr;
+  }
+  job->handler_ = std::move(handler);
+  job->runner_.reset(
+      new EngineJob::JobRunner{job->settings_, *job->nettest_, *job});
+  job->runner_->set_worker_pool(worker_pool_);
+  job->runner_->set_curlx_pool(curlx_pool_);
+  job->runner_->set_discovery_cache(discovery_cache_);
+  job->runner_->set_scheduler(scheduler_);
+  if (event_sink_) job->runner_->set_event_sink(event_sink_);
+  std::unique_lock<std::mutex> _{mutex_};
+  job->id_ = next_id_++;
+  queued_.push_back(job);
+  start();
+  return job;
+}
+
+void Engine::interrupt() noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  for (auto &job : queued_) job->interrupt();
+  for (auto &job : running_) job->interrupt();
+}
+
+void Engine::wait() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  cond_.wait(lock, [this]() { return queued_.empty() && running_.empty(); });
+}
+
+Engine::~Engine() noexcept { wait(); }
+
+void Engine::start() noexcept {
+  while (running_.size() < max_active_ && !queued_.empty()) {
+    auto job = std::move(queued_.front());
+    queued_.pop_front();
+    running_.push_back(job);
+    worker_pool_->submit([this, job]() mutable noexcept {
+      if (!job->interrupted_) (void)job->runner_->run();
+      done(std::move(job));
+    });
+  }
+}
+
+void Engine::done(std::shared_ptr<EngineJob> job) noexcept {
+  {
+    std::unique_lock<std::mutex> _{job->mutex_};
+    job->done_ = true;
+    job->cond_.notify_all();
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  running_.erase(std::find(running_.begin(), running_.end(), job));
+  // Note: we drop our reference here, because a Runner holds the worker pool
+  // that is running us, which must not be destroyed by one of its threads.
+  job.reset();
+  start();
+  cond_.notify_all();
+}
+
 #endif  // LIBNETTEST2_NO_INLINE_IMPL
 }  // namespace libnettest2
 }  // namespace measurement_kit